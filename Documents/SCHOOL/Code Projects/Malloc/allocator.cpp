@@ -1,332 +1,4100 @@
 #include "allocator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <iomanip>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
-// The heap buffer - allocated at program start
-static char heap_buffer[HEAP_SIZE];
-static BlockHeader* free_list = nullptr;
+// Address the current function returns to (in its caller)
+#if defined(_MSC_VER)
+#define CALLER_ADDRESS() _ReturnAddress()
+#else
+#define CALLER_ADDRESS() __builtin_return_address(0)
+#endif
 
-// Helper function to align size up to ALIGN_SIZE boundary
-static size_t align_size(size_t size) {
-    return (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
-}
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define ALLOCATOR_HAS_BACKTRACE 1
+#endif
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
 
-// Initialize the allocator
-// Sets up the entire heap as one large free block
-void init_allocator() {
-    // Clear the heap buffer
-    std::memset(heap_buffer, 0, HEAP_SIZE);
+
+struct Arena;
+struct HeapState;
+struct HeapOps;
+
+// A chunk of OS memory owned by one arena
+// Blocks tile [blocks_start, end); blocks never coalesce across regions.
+// The slab page map (one flag per SLAB_PAGE_SIZE page of the region) follows this header
+struct Region {
+    Arena* owner;
+    Region* next;           // Next region of the same arena
+    char* blocks_start;
+    char* end;
+    bool* slab_page_map;
+};
+
+// Second-level subdivisions of each size class (used by the TLSF engine)
+static const size_t TLSF_SL_LOG2 = 4;
+static const size_t TLSF_SL_COUNT = static_cast<size_t>(1) << TLSF_SL_LOG2;
+
+// Quick lists per arena: one per total block size up to QUICK_LIST_MAX_SIZE usable bytes
+static const size_t NUM_QUICK_LISTS = (QUICK_LIST_MAX_SIZE + sizeof(BlockHeader)) / ALIGN_SIZE + 1;
+
+// NUMA node ids an arena can be bound to (one word of node mask)
+static const size_t MAX_NUMA_NODES = sizeof(unsigned long) * 8;
+
+// Maximum number of slots in one slab page (smallest slot size)
+static const size_t SLAB_MAX_SLOTS = SLAB_PAGE_SIZE / SLAB_SLOT_GRANULARITY;
+
+// Header at the start of every slab page
+// The slots follow the header; free slots form an intrusive singly-linked list
+// (each free slot stores the address of the next one)
+struct SlabPage {
+    SlabPage* next;             // Next page of this class with free slots
+    SlabPage* prev;             // Previous page of this class with free slots
+    void* free_slots;           // First free slot, nullptr when the page is full
+    char* slots_begin;          // Address of slot 0
+    size_t slot_size;           // Bytes per slot
+    size_t slot_count;          // Number of slots in this page
+    size_t used_count;          // Number of allocated slots
+    uint64_t used_map[SLAB_MAX_SLOTS / 64];  // Bit per slot, set while allocated
+};
+
+// Number of malloc and free calls per size class (by the usable size of the block)
+// Every set of counters has a single writer at a time (a thread, or whoever holds
+// an arena's lock), so a count is bumped with a plain load and store instead of
+// a locked read-modify-write; the atomics only make reading them from another thread safe
+struct CallCounts {
+    std::atomic<uint64_t> mallocs[NUM_SIZE_CLASSES];
+    std::atomic<uint64_t> frees[NUM_SIZE_CLASSES];
+};
+
+// Lock of an arena, of the kind its heap was built with (HeapLocking)
+// The heap operations are compiled for one locking policy and take the policy's lock
+// with get<Lock>(); the rarer calls shared by every heap (statistics, purging, printing)
+// lock it through lock() and unlock(), which check the mode
+// Usable with std::lock_guard and std::unique_lock like a std::mutex
+class ArenaLock {
+public:
+    // constexpr so the default heap's arenas are set up before any code runs
+    constexpr ArenaLock() : mode(HEAP_LOCK_MUTEX) {}
+    
+    // Only while no thread uses the arena
+    void set_mode(HeapLocking new_mode) {
+        mode = new_mode;
+    }
     
-    // Create initial free block covering the entire heap
-    BlockHeader* initial_block = reinterpret_cast<BlockHeader*>(heap_buffer);
-    initial_block->size = HEAP_SIZE;
-    initial_block->is_free = true;
-    initial_block->next = nullptr;
+    void lock() {
+        if (mode == HEAP_LOCK_MUTEX) {
+            mutex.lock();
+        } else if (mode == HEAP_LOCK_SPIN) {
+            spin.lock();
+        }
+    }
+    
+    void unlock() {
+        if (mode == HEAP_LOCK_MUTEX) {
+            mutex.unlock();
+        } else if (mode == HEAP_LOCK_SPIN) {
+            spin.unlock();
+        }
+    }
+    
+    // The lock of one policy (the one this arena's heap was built with)
+    template <typename Lock>
+    Lock& get();
     
-    // Initialize free list
-    free_list = initial_block;
+private:
+    HeapLocking mode;
+    MutexLock mutex;
+    SpinLock spin;
+};
+
+static NoLock no_lock;  // Holds no state, so one serves every arena
+
+template <>
+MutexLock& ArenaLock::get<MutexLock>() {
+    return mutex;
 }
 
-// Check if a pointer is within the heap bounds
-static bool is_valid_ptr(void* ptr) {
-    char* char_ptr = reinterpret_cast<char*>(ptr);
-    return (char_ptr >= heap_buffer && char_ptr < heap_buffer + HEAP_SIZE);
+template <>
+SpinLock& ArenaLock::get<SpinLock>() {
+    return spin;
 }
 
-// Get the minimum size needed for a block (header + minimum user data)
-static size_t get_min_block_size() {
-    return align_size(sizeof(BlockHeader) + 1);
+template <>
+NoLock& ArenaLock::get<NoLock>() {
+    return no_lock;
 }
 
-// Split a free block if it's large enough
-// Returns pointer to the allocated block, or nullptr if block can't be split
-static BlockHeader* split_block(BlockHeader* block, size_t requested_size) {
-    size_t aligned_size = align_size(requested_size);
-    size_t total_size = sizeof(BlockHeader) + aligned_size;
+// An independent sub-heap made of a chain of regions
+// Each arena has its own lock, so threads working in different arenas never
+// wait for each other
+struct Arena {
+    HeapState* heap;    // Heap the arena belongs to
     
-    // Check if block is large enough to split
-    size_t min_remaining = get_min_block_size();
-    if (block->size < total_size + min_remaining) {
-        // Not large enough to split, use entire block
-        return block;
-    }
+    // Lock protecting this arena's blocks, free lists and slab pages
+    // Thread caches only take it to refill or flush a whole batch
+    ArenaLock lock;
     
-    // Split the block
-    char* block_start = reinterpret_cast<char*>(block);
-    BlockHeader* new_block = reinterpret_cast<BlockHeader*>(block_start + total_size);
+    Region* regions;
     
-    // Setup new free block (the remainder)
-    new_block->size = block->size - total_size;
-    new_block->is_free = true;
+    // Segregated free lists, indexed by [size class][subdivision]
+    // The segregated-fit engine only uses subdivision 0 of each class, and so does the
+    // best-fit engine, whose "list" is the root of a tree
+    // Bit i of free_list_bitmap is set while any list of class i is non-empty,
+    // bit j of sub_list_bitmaps[i] is set while free_lists[i][j] is non-empty
+    FreeLink free_lists[NUM_SIZE_CLASSES][TLSF_SL_COUNT];
+    size_t free_list_bitmap;
+    size_t sub_list_bitmaps[NUM_SIZE_CLASSES];
     
-    // Update original block size
-    block->size = total_size;
+    // Pages with at least one free slot, one list per slab class
+    SlabPage* slab_pages[NUM_SLAB_CLASSES];
     
-    // Insert new block into free list (after current block)
-    new_block->next = block->next;
-    block->next = new_block;
+    // Freed blocks waiting to be coalesced (deferred coalescing), list i holding blocks of
+    // i * ALIGN_SIZE bytes; linked through next(), they still count as allocated
+    FreeLink quick_lists[NUM_QUICK_LISTS];
+    size_t quick_list_bytes;    // Total size of the quick-listed blocks
+    size_t quick_list_count;
     
-    return block;
+    // Blocks freed by threads of other arenas, waiting to be given back
+    // Lock-free stack linked through the first word of each payload: any thread may
+    // push, and the arena drains the whole stack at once under its lock
+    // remote_free_bytes counts the usable bytes of the queued general blocks (slab slots
+    // stay inside pages that count as used): added before a push, taken off after a drain
+    std::atomic<void*> remote_frees;
+    std::atomic<size_t> remote_free_bytes;
+    
+    // When the last automatic purge pass ran
+    std::chrono::steady_clock::time_point last_purge;
+    
+    // Running totals, kept up to date (under the lock) by every change to the blocks
+    // so statistics never have to walk the heap
+    size_t region_bytes;        // Bytes of all regions' block areas
+    size_t free_list_bytes;     // Total size of the blocks in the free lists
+    size_t free_block_count;
+    size_t used_block_count;    // Allocated blocks (slab pages included)
+    
+    // Calls served by this arena (heaps without thread caches only)
+    CallCounts calls;
+    
+    size_t numa_node;           // Id of the node its regions are bound to (when the heap spreads over nodes)
+};
+
+// Everything one heap owns
+// The default heap (behind my_malloc/my_free) lives in static storage and reserves
+// its address space from the OS at the first init_allocator(); a Heap built over
+// caller memory keeps its HeapState, arenas and region table at the start of it
+struct HeapState {
+    // Address space the heap manages
+    // Regions are committed from it one after another, so memory that was never
+    // needed costs no physical memory (and nothing in the executable's BSS)
+    char* base;
+    char* limit;
+    char* top;                  // End of the committed regions
+    std::mutex region_lock;     // Protects top while a region is created
+    
+    bool owns_memory;           // Reserved from the OS: committed on demand, purged when idle
+    bool use_thread_cache;      // Small blocks go through the thread caches (default heap only)
+    AllocatorEngine engine;     // Chosen when the heap is set up
+    HugePageMode huge_pages;    // How committed regions are backed (default heap only)
+    std::atomic<bool> defer_coalescing;  // Frees go to the quick lists (set_deferred_coalescing)
+    bool count_calls;           // Calls are counted per size class (off for Heaps built without statistics)
+    const HeapOps* ops;         // Operations compiled for the heap's locking and statistics
+    size_t numa_nodes;          // NUMA nodes the arenas are spread over (1: pages land where first touched)
+    
+    Arena* arenas;
+    size_t arena_count;
+    
+    // Region covering each REGION_SIZE granule of [base, limit) (nullptr if uncommitted)
+    // Lets a pointer find its region, and thus its arena, in O(1)
+    std::atomic<Region*>* region_table;
+    
+    // constexpr so the default heap is set up before any code runs
+    constexpr HeapState(Arena* arenas, std::atomic<Region*>* region_table)
+        : base(nullptr), limit(nullptr), top(nullptr), owns_memory(false), use_thread_cache(false),
+          engine(ENGINE_SEGREGATED_FIT), huge_pages(HUGE_PAGES_NONE), defer_coalescing(false),
+          count_calls(true), ops(nullptr), numa_nodes(1), arenas(arenas), arena_count(1), region_table(region_table) {}
+};
+
+static Arena default_arenas[MAX_ARENAS];
+static std::atomic<Region*> default_region_table[HEAP_RESERVE_SIZE / REGION_SIZE];
+static HeapState default_heap(default_arenas, default_region_table);
+
+// Round-robin counter used to assign threads to arenas of the default heap
+// (one per NUMA node when the arenas are spread over nodes, in the order of online_numa_nodes)
+static std::atomic<size_t> next_arena(0);
+static std::atomic<size_t> next_arena_on_node[MAX_NUMA_NODES];
+
+// Ids of the online NUMA nodes the default heap's arenas are spread over (numa_nodes of them)
+// Ids can have gaps ("0,2"), so arena i belongs to node online_numa_nodes[i % numa_nodes]
+static size_t online_numa_nodes[MAX_NUMA_NODES];
+
+// Same for the other heaps: each thread draws a number once and uses
+// arena (number % arena_count) of every heap
+static std::atomic<size_t> next_thread_number(0);
+static thread_local size_t thread_number = next_thread_number.fetch_add(1, std::memory_order_relaxed);
+
+// Purge states of a free block (BlockHeader::purge_state)
+// A block is purged once it stayed free, and dirty, through a whole decay period:
+// one pass marks it aged, the next releases its pages
+enum PurgeState {
+    PURGE_DIRTY,    // Pages may hold data
+    PURGE_AGED,     // Was already free at the last purge pass
+    PURGE_CLEAN,    // Whole pages inside the block were handed back to the OS
+    PURGE_ZERO      // Fresh from the OS: every byte but the block's own links and footer is zero
+};
+
+static std::atomic<unsigned> purge_decay_ms(PURGE_DECAY_MS);
+
+// Bumped by init_allocator() so thread caches drop blocks of an older heap
+static std::atomic<unsigned> heap_generation(0);
+
+// Per-thread cache of freed blocks, one bin per TCACHE_GRANULARITY size step
+// A cached block stays allocated as far as the backend is concerned; its first
+// word links to the next cached block and its second word holds the owning
+// cache, which makes double frees of cached blocks cheap to spot
+// The cache also counts the thread's calls to the default heap
+struct ThreadCache {
+    void* bins[NUM_TCACHE_BINS];
+    size_t counts[NUM_TCACHE_BINS];
+    size_t cached_bytes;    // Sum of the bin sizes of all cached blocks
+    Arena* arena;           // Arena this thread refills from
+    unsigned generation;
+    
+    CallCounts calls;
+    std::atomic<unsigned> calls_generation;  // Heap the calls were made to (read by statistics)
+    ThreadCache* next;      // All live caches, for statistics
+    ThreadCache* prev;
+    
+    ThreadCache();
+    ~ThreadCache();
+};
+
+// Every live thread cache, and the calls of the threads that exited since the last
+// init_allocator() (protected by cache_list_lock)
+static std::mutex cache_list_lock;
+static ThreadCache* thread_caches = nullptr;
+static CallCounts exited_thread_calls;
+
+static void reset_call_counts(CallCounts& calls) {
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        calls.mallocs[i].store(0, std::memory_order_relaxed);
+        calls.frees[i].store(0, std::memory_order_relaxed);
+    }
 }
 
-// Remove a block from the free list
-static void remove_from_free_list(BlockHeader* block) {
-    if (!free_list) {
-        return;
+// Add one set of call counters to another (the target's writer must be excluded)
+static void add_call_counts(CallCounts& total, const CallCounts& calls) {
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        total.mallocs[i].store(total.mallocs[i].load(std::memory_order_relaxed) +
+                               calls.mallocs[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        total.frees[i].store(total.frees[i].load(std::memory_order_relaxed) +
+                             calls.frees[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+}
+
+// Report a corrupted heap and stop: nothing in it can be trusted any more
+// Written with stdio, since the arena lock may be held and iostreams may allocate
+void report_heap_corruption(const char* what) {
+    std::fputs("ERROR: Heap corruption detected (", stderr);
+    std::fputs(what, stderr);
+    std::fputs(")\n", stderr);
+    std::abort();
+}
+
+// Links of the singly-linked lists kept inside freed memory (slab slots, thread cache
+// bins, remote frees), encoded the same way as FreeLink in hardened builds
+static void store_link(void** where, void* value) {
+#if defined(ALLOCATOR_HARDENED)
+    value = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(value) ^ (reinterpret_cast<uintptr_t>(where) >> 12));
+#endif
+    *where = value;
+}
+
+static void* load_link(void* const* where) {
+#if defined(ALLOCATOR_HARDENED)
+    uintptr_t value = reinterpret_cast<uintptr_t>(*where) ^ (reinterpret_cast<uintptr_t>(where) >> 12);
+    if (value & (ALIGN_SIZE - 1)) {
+        report_heap_corruption("free list link");
+    }
+    return reinterpret_cast<void*>(value);
+#else
+    return *where;
+#endif
+}
+
+// Helper function to align size up to ALIGN_SIZE boundary
+static size_t align_size(size_t size) {
+    return (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+}
+
+// Index of the lowest set bit (mask must be non-zero)
+static size_t find_first_set(size_t mask) {
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<size_t>(__builtin_ctzll(mask));
+#endif
+}
+
+// Index of the highest set bit (value must be non-zero)
+static size_t floor_log2(size_t value) {
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return index;
+#else
+    return static_cast<size_t>(63 - __builtin_clzll(value));
+#endif
+}
+
+// Count a call for a block with the given usable size (0: nothing was allocated or freed)
+static void count_call(std::atomic<uint64_t>* counts, size_t usable_size) {
+    if (usable_size) {
+        std::atomic<uint64_t>& count = counts[floor_log2(usable_size)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
     }
+}
+
+// Position of a block size in the free list table
+struct FreeListIndex {
+    size_t size_class;   // First level: floor(log2(size))
+    size_t subdivision;  // Second level: next TLSF_SL_LOG2 bits of the size (TLSF only)
+};
+
+// Free list of an arena that holds blocks with the given total size
+static FreeListIndex get_free_list_index(const Arena* arena, size_t total_size) {
+    FreeListIndex index;
+    index.size_class = floor_log2(total_size);
+    index.subdivision = 0;
     
-    // If it's the first block
-    if (free_list == block) {
-        free_list = block->next;
-        return;
+    if (arena->heap->engine == ENGINE_TLSF) {
+        // Drop the leading 1 bit and keep the next TLSF_SL_LOG2 bits
+        // (every block is larger than TLSF_SL_COUNT bytes, so the shift is valid)
+        index.subdivision = (total_size >> (index.size_class - TLSF_SL_LOG2)) & (TLSF_SL_COUNT - 1);
     }
     
-    // Find the block before it in the free list
-    BlockHeader* current = free_list;
-    while (current && current->next != block) {
-        current = current->next;
+    return index;
+}
+
+// Bookkeeping bytes per allocated block (just the header; only free blocks have a footer)
+static const size_t BLOCK_OVERHEAD = sizeof(BlockHeader);
+
+// Copy the block size into its footer
+// Must be called whenever a free block's size changes
+static void write_footer(BlockHeader* block) {
+    BlockFooter::of(block)->size = block->get_size();
+}
+
+// Best-fit trees
+// Each size class of the best-fit engine is a Cartesian tree (treap) of its free
+// blocks: a binary search tree on (size, address) that is also a heap on a priority
+// hashed from the address. The hash acts as a random priority, so the expected depth
+// is O(log n) whatever the order blocks are freed in, and it needs no storage: the
+// two free list words hold the child links, and no parent link is kept
+
+// Priority of a block in its tree (a bit mixer over its address)
+static uint64_t tree_priority(const BlockHeader* block) {
+    uint64_t x = reinterpret_cast<uintptr_t>(block);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+// Tree order: by size, then by address
+static bool tree_less(BlockHeader* a, BlockHeader* b) {
+    return a->get_size() < b->get_size() || (a->get_size() == b->get_size() && a < b);
+}
+
+// Insert a block into a tree
+// It goes below every node with a higher priority; the subtree it replaces is split
+// around it into its left (smaller) and right (larger) children
+static void tree_insert(FreeLink* link, BlockHeader* block) {
+    uint64_t priority = tree_priority(block);
+    while (*link && tree_priority(*link) > priority) {
+        link = tree_less(block, *link) ? &(*link)->left() : &(*link)->right();
     }
     
-    if (current) {
-        current->next = block->next;
+    BlockHeader* rest = *link;
+    *link = block;
+    FreeLink* smaller = &block->left();
+    FreeLink* larger = &block->right();
+    while (rest) {
+        if (tree_less(rest, block)) {
+            *smaller = rest;
+            smaller = &rest->right();
+            rest = rest->right();
+        } else {
+            *larger = rest;
+            larger = &rest->left();
+            rest = rest->left();
+        }
     }
+    *smaller = nullptr;
+    *larger = nullptr;
 }
 
-// Coalesce a freed block with adjacent free blocks
-// Returns the block that should be inserted into the free list
-// Returns nullptr if the block was merged into a previous block (already in free list)
-static BlockHeader* coalesce_block(BlockHeader* block) {
-    char* heap_start = heap_buffer;
-    char* heap_end = heap_buffer + HEAP_SIZE;
-    char* block_start = reinterpret_cast<char*>(block);
-    char* block_end = block_start + block->size;
+// Remove a block from its tree (found by its size and address, so the size must not have changed)
+// Its two subtrees are merged in its place, the higher priority on top
+static void tree_remove(FreeLink* link, BlockHeader* block) {
+    while (*link != block) {
+        link = tree_less(block, *link) ? &(*link)->left() : &(*link)->right();
+    }
     
-    // Check if next block exists and is free
-    if (block_end < heap_end) {
-        BlockHeader* next_block = reinterpret_cast<BlockHeader*>(block_end);
-        if (next_block->is_free) {
-            // Remove next block from free list
-            remove_from_free_list(next_block);
-            
-            // Merge next block into current block
-            block->size += next_block->size;
+    BlockHeader* smaller = block->left();
+    BlockHeader* larger = block->right();
+    while (smaller && larger) {
+        if (tree_priority(smaller) > tree_priority(larger)) {
+            *link = smaller;
+            link = &smaller->right();
+            smaller = smaller->right();
+        } else {
+            *link = larger;
+            link = &larger->left();
+            larger = larger->left();
         }
     }
+    *link = smaller ? smaller : larger;
+}
+
+// Smallest block of a tree with a total size of at least total_size (lowest address among equals)
+static BlockHeader* tree_lower_bound(BlockHeader* node, size_t total_size) {
+    BlockHeader* best = nullptr;
+    while (node) {
+        if (node->get_size() >= total_size) {
+            best = node;
+            node = node->left();
+        } else {
+            node = node->right();
+        }
+    }
+    return best;
+}
+
+// Block that follows another in tree order, found from the root (nullptr after the last one)
+static BlockHeader* tree_successor(BlockHeader* node, BlockHeader* block) {
+    BlockHeader* next = nullptr;
+    while (node) {
+        if (tree_less(block, node)) {
+            next = node;
+            node = node->left();
+        } else {
+            node = node->right();
+        }
+    }
+    return next;
+}
+
+// Clear the bitmap bits of a list that just became empty
+static void mark_list_empty(Arena* arena, FreeListIndex index) {
+    arena->sub_list_bitmaps[index.size_class] &= ~(static_cast<size_t>(1) << index.subdivision);
+    if (!arena->sub_list_bitmaps[index.size_class]) {
+        arena->free_list_bitmap &= ~(static_cast<size_t>(1) << index.size_class);
+    }
+}
+
+// Remove a block from its size class free list
+// The lists are doubly linked, so no search for the predecessor is needed
+// Must be called before the block's size changes
+static void remove_from_free_list(Arena* arena, BlockHeader* block) {
+    arena->free_list_bytes -= block->get_size();
+    arena->free_block_count--;
     
-    // Check if previous block exists and is free
-    // We need to traverse from the start to find previous block
-    char* prev_block_end = heap_start;
-    BlockHeader* prev_block = nullptr;
-    
-    // Find the block before this one
-    while (prev_block_end < block_start) {
-        BlockHeader* current = reinterpret_cast<BlockHeader*>(prev_block_end);
-        char* current_end = prev_block_end + current->size;
-        
-        if (current_end == block_start && current->is_free) {
-            prev_block = current;
-            break;
+    if (arena->heap->engine == ENGINE_BEST_FIT) {
+        FreeListIndex index = get_free_list_index(arena, block->get_size());
+        FreeLink& root = arena->free_lists[index.size_class][index.subdivision];
+        tree_remove(&root, block);
+        if (!root) {
+            mark_list_empty(arena, index);
         }
-        
-        if (current_end >= block_start) {
-            break;
+        return;
+    }
+    
+    // Each link is read once: in hardened builds reading one means decoding and checking it
+    BlockHeader* prev = block->prev();
+    BlockHeader* next = block->next();
+#if defined(ALLOCATOR_HARDENED)
+    // Both neighbours are written below anyway, so checking that they point back is nearly free
+    if ((prev && prev->next() != block) || (next && next->prev() != block)) {
+        report_heap_corruption("free list");
+    }
+#endif
+    if (prev) {
+        prev->next() = next;
+    } else {
+        // It's the first block of its list
+        FreeListIndex index = get_free_list_index(arena, block->get_size());
+        arena->free_lists[index.size_class][index.subdivision] = next;
+        if (!next) {
+            mark_list_empty(arena, index);
         }
-        
-        prev_block_end = current_end;
     }
     
-    // If previous block is free, merge current into it
-    if (prev_block) {
-        // Note: block is not in free list yet (we just freed it)
-        // So we just merge it into prev_block
-        prev_block->size += block->size;
-        // prev_block is already in free list, so return nullptr
-        return nullptr;
+    if (next) {
+        next->prev() = prev;
     }
+}
+
+// Insert a block at the beginning of its size class free list (or into its tree)
+static void insert_into_free_list(Arena* arena, BlockHeader* block) {
+    FreeListIndex index = get_free_list_index(arena, block->get_size());
+    FreeLink& head = arena->free_lists[index.size_class][index.subdivision];
     
-    // Block was not merged into previous block, so it needs to be inserted
+    if (arena->heap->engine == ENGINE_BEST_FIT) {
+        tree_insert(&head, block);
+    } else {
+        block->next() = head;
+        block->prev() = nullptr;
+        
+        if (head) {
+            head->prev() = block;
+        }
+        head = block;
+    }
+    arena->sub_list_bitmaps[index.size_class] |= static_cast<size_t>(1) << index.subdivision;
+    arena->free_list_bitmap |= static_cast<size_t>(1) << index.size_class;
+    arena->free_list_bytes += block->get_size();
+    arena->free_block_count++;
+}
+
+// First block of a free list, and the one after a given block
+// (a best-fit tree is visited in size and address order; each step is a search from its root)
+static BlockHeader* first_free_block(Arena* arena, size_t size_class, size_t subdivision) {
+    BlockHeader* block = arena->free_lists[size_class][subdivision];
+    if (arena->heap->engine == ENGINE_BEST_FIT) {
+        while (block && block->left()) {
+            block = block->left();
+        }
+    }
     return block;
 }
 
-// Allocate memory
-void* my_malloc(size_t size) {
-    if (size == 0) {
-        return nullptr;
+static BlockHeader* next_free_block(Arena* arena, BlockHeader* block) {
+    if (arena->heap->engine == ENGINE_BEST_FIT) {
+        FreeListIndex index = get_free_list_index(arena, block->get_size());
+        return tree_successor(arena->free_lists[index.size_class][index.subdivision], block);
     }
+    return block->next();
+}
+
+// Segregated fit: find a free block with a total size of at least total_size
+// Every block in a class above the request's own class is large enough, so a
+// find-first-set on the bitmap picks one in O(1). The request's own class is
+// only scanned (first-fit) when no larger class has a free block.
+static BlockHeader* segregated_find_free_block(Arena* arena, size_t total_size) {
+    size_t size_class = floor_log2(total_size);
     
-    // Calculate required size (header + aligned user data)
-    size_t aligned_size = align_size(size);
-    size_t total_size = sizeof(BlockHeader) + aligned_size;
-    
-    // Search free list for a block large enough
-    BlockHeader* current = free_list;
-    BlockHeader* prev = nullptr;
+    if (size_class + 1 < NUM_SIZE_CLASSES) {
+        size_t larger_classes = arena->free_list_bitmap & (~static_cast<size_t>(0) << (size_class + 1));
+        if (larger_classes) {
+            return arena->free_lists[find_first_set(larger_classes)][0];
+        }
+    }
     
+    BlockHeader* current = arena->free_lists[size_class][0];
     while (current) {
-        if (current->size >= total_size) {
-            // Found a block large enough
-            BlockHeader* block_to_use = split_block(current, size);
-            
-            // Remove from free list
-            if (block_to_use == free_list) {
-                free_list = block_to_use->next;
-            } else {
-                if (prev) {
-                    prev->next = block_to_use->next;
-                }
-            }
-            
-            // Mark as allocated
-            block_to_use->is_free = false;
-            block_to_use->next = nullptr;
-            
-            // Return pointer to user data
-            return block_to_use->get_data();
+        if (current->get_size() >= total_size) {
+            return current;
         }
-        
-        prev = current;
-        current = current->next;
+        current = current->next();
     }
     
-    // No suitable block found
     return nullptr;
 }
 
-// Free memory
-void my_free(void* ptr) {
-    if (!ptr) {
-        return;  // Freeing nullptr is safe (like standard free)
+// TLSF rounds a request up to the next subdivision boundary (0 if that overflows)
+static size_t tlsf_round_up(size_t total_size) {
+    size_t round_up = (static_cast<size_t>(1) << (floor_log2(total_size) - TLSF_SL_LOG2)) - 1;
+    if (total_size > ~static_cast<size_t>(0) - round_up) {
+        return 0;
     }
-    
-    // Get block header
-    BlockHeader* block = BlockHeader::get_header(ptr);
-    
-    // Validate pointer
-    if (!is_valid_ptr(block)) {
-        std::cerr << "ERROR: Invalid pointer passed to my_free (not in heap)\n";
-        return;
+    return total_size + round_up;
+}
+
+// TLSF: find a free block with a total size of at least total_size
+// The request is rounded up to the next subdivision boundary so that every block
+// in the chosen list fits (good fit). The lookup is two bitmap searches and
+// never walks a list, which bounds the worst case.
+static BlockHeader* tlsf_find_free_block(Arena* arena, size_t total_size) {
+    size_t search_size = tlsf_round_up(total_size);
+    if (!search_size) {
+        return nullptr;
     }
+    FreeListIndex index = get_free_list_index(arena, search_size);
     
-    // Check for double free
-    if (block->is_free) {
-        std::cerr << "ERROR: Double free detected\n";
-        return;
+    // Look for a non-empty subdivision at or above the rounded one in the same class
+    size_t subdivisions = arena->sub_list_bitmaps[index.size_class] & (~static_cast<size_t>(0) << index.subdivision);
+    if (!subdivisions) {
+        // Otherwise take the smallest list of the next non-empty class
+        if (index.size_class + 1 >= NUM_SIZE_CLASSES) {
+            return nullptr;
+        }
+        size_t larger_classes = arena->free_list_bitmap & (~static_cast<size_t>(0) << (index.size_class + 1));
+        if (!larger_classes) {
+            return nullptr;
+        }
+        index.size_class = find_first_set(larger_classes);
+        subdivisions = arena->sub_list_bitmaps[index.size_class];
     }
     
-    // Mark as free
-    block->is_free = true;
-    block->next = nullptr;
-    
-    // Coalesce with adjacent free blocks
-    // Returns the block to insert, or nullptr if merged into previous block (already in free list)
-    BlockHeader* block_to_insert = coalesce_block(block);
+    return arena->free_lists[index.size_class][find_first_set(subdivisions)];
+}
+
+// Best fit: find the smallest free block with a total size of at least total_size
+// The request's own class is searched in O(log n); failing that, every block of the
+// next non-empty class is larger, so its smallest one is the best fit
+static BlockHeader* best_fit_find_free_block(Arena* arena, size_t total_size) {
+    size_t size_class = floor_log2(total_size);
+    BlockHeader* block = tree_lower_bound(arena->free_lists[size_class][0], total_size);
+    if (block || size_class + 1 >= NUM_SIZE_CLASSES) {
+        return block;
+    }
     
-    // Insert into free list if needed (at the beginning for simplicity)
-    if (block_to_insert) {
-        block_to_insert->next = free_list;
-        free_list = block_to_insert;
+    size_t larger_classes = arena->free_list_bitmap & (~static_cast<size_t>(0) << (size_class + 1));
+    if (!larger_classes) {
+        return nullptr;
     }
+    return first_free_block(arena, find_first_set(larger_classes), 0);
 }
 
-// Get used memory in bytes
-size_t get_used_memory() {
-    size_t used = 0;
-    char* current = heap_buffer;
-    char* heap_end = heap_buffer + HEAP_SIZE;
-    
-    while (current < heap_end) {
-        BlockHeader* block = reinterpret_cast<BlockHeader*>(current);
-        if (!block->is_free) {
-            used += (block->size - sizeof(BlockHeader));
-        }
-        current += block->size;
+// Search the free lists with the engine chosen when the heap was set up
+static BlockHeader* search_free_lists(Arena* arena, size_t total_size) {
+    if (arena->heap->engine == ENGINE_TLSF) {
+        return tlsf_find_free_block(arena, total_size);
     }
-    
-    return used;
+    if (arena->heap->engine == ENGINE_BEST_FIT) {
+        return best_fit_find_free_block(arena, total_size);
+    }
+    return segregated_find_free_block(arena, total_size);
 }
 
-// Get free memory in bytes
-size_t get_free_memory() {
-    size_t free = 0;
-    BlockHeader* current = free_list;
-    
-    while (current) {
-        free += (current->size - sizeof(BlockHeader));
-        current = current->next;
+static bool sweep_quick_lists(Arena* arena);
+
+// Find a free block with a total size of at least total_size
+// Deferred frees are merged into the free lists before giving up
+static BlockHeader* find_free_block(Arena* arena, size_t total_size) {
+    BlockHeader* block = search_free_lists(arena, total_size);
+    if (!block && sweep_quick_lists(arena)) {
+        block = search_free_lists(arena, total_size);
     }
-    
-    return free;
+    return block;
 }
 
-// Get fragmentation count (number of free blocks)
-size_t get_fragmentation_count() {
-    size_t count = 0;
-    BlockHeader* current = free_list;
-    
-    while (current) {
-        count++;
-        current = current->next;
+// Get the minimum size needed for a block (header + minimum user data + footer)
+// Once the block is freed, its user data must be able to hold the free list
+// links and purge state, followed by the footer
+static size_t get_min_block_size() {
+    return align_size(BLOCK_OVERHEAD + 2 * sizeof(BlockHeader*) + sizeof(unsigned char) + sizeof(BlockFooter));
+}
+
+// Reserve address space without committing any memory
+static char* reserve_memory(size_t size) {
+#if defined(_WIN32)
+    return static_cast<char*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS));
+#else
+    void* memory = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return memory == MAP_FAILED ? nullptr : static_cast<char*>(memory);
+#endif
+}
+
+// Make reserved address space usable (the pages read as zero)
+static bool commit_memory(char* address, size_t size) {
+#if defined(_WIN32)
+    return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// Whether the system hands out reserved huge pages (MAP_HUGETLB) at the moment
+static bool explicit_huge_pages_available() {
+#if defined(MAP_HUGETLB)
+    void* probe = mmap(nullptr, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (probe == MAP_FAILED) {
+        return false;
     }
-    
-    return count;
+    munmap(probe, HUGE_PAGE_SIZE);
+    return true;
+#else
+    return false;
+#endif
 }
 
-// Print heap state for debugging
-void print_heap_state() {
-    std::cout << "\n=== Heap State ===\n";
-    std::cout << "Heap Size: " << HEAP_SIZE << " bytes (" << (HEAP_SIZE / 1024.0) << " KB)\n";
-    std::cout << "Used Memory: " << get_used_memory() << " bytes\n";
-    std::cout << "Free Memory: " << get_free_memory() << " bytes\n";
-    std::cout << "Fragmentation: " << get_fragmentation_count() << " free blocks\n";
-    std::cout << "\nBlock Layout:\n";
-    std::cout << std::left << std::setw(12) << "Address" 
-              << std::setw(12) << "Size" 
-              << std::setw(12) << "User Size"
-              << std::setw(10) << "Status"
-              << "\n";
-    std::cout << std::string(50, '-') << "\n";
-    
-    char* current = heap_buffer;
-    char* heap_end = heap_buffer + HEAP_SIZE;
-    size_t block_num = 0;
-    
-    while (current < heap_end) {
-        BlockHeader* block = reinterpret_cast<BlockHeader*>(current);
-        size_t user_size = block->size - sizeof(BlockHeader);
-        
-        std::cout << std::hex << std::setw(12) << reinterpret_cast<void*>(current)
-                  << std::dec << std::setw(12) << block->size
-                  << std::setw(12) << user_size
-                  << std::setw(10) << (block->is_free ? "FREE" : "USED")
-                  << "\n";
-        
-        current += block->size;
-        block_num++;
-        
-        // Safety check to prevent infinite loop
-        if (block->size == 0 || block_num > 10000) {
-            std::cerr << "ERROR: Corrupted heap or infinite loop detected\n";
-            break;
+// Commit a region of reserved space, backed the way the heap asks for
+static bool commit_region(HeapState* heap, char* address, size_t size) {
+#if defined(MAP_HUGETLB)
+    if (heap->huge_pages == HUGE_PAGES_EXPLICIT) {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+        if (mmap(address, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0) != MAP_FAILED) {
+            return true;
+        }
+        // The pool ran dry: use transparent huge pages for this region (a failed
+        // MAP_FIXED mapping leaves the range unmapped, so map regular pages over it
+        // rather than just changing the protection)
+        if (mmap(address, size, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) {
+            return false;
         }
+    } else if (!commit_memory(address, size)) {
+        return false;
     }
-    
-    std::cout << "\nFree List:\n";
-    BlockHeader* free_block = free_list;
-    size_t free_num = 0;
-    while (free_block) {
-        std::cout << "  [" << free_num << "] " 
-                  << std::hex << reinterpret_cast<void*>(free_block)
-                  << std::dec << " -> size: " << free_block->size << " bytes\n";
-        free_block = free_block->next;
-        free_num++;
+#else
+    (void)heap;
+    if (!commit_memory(address, size)) {
+        return false;
     }
+#endif
     
-    if (free_num == 0) {
-        std::cout << "  (empty)\n";
+#if defined(MADV_HUGEPAGE)
+    if (heap->huge_pages != HUGE_PAGES_NONE) {
+        madvise(address, size, MADV_HUGEPAGE);  // No effect on a MAP_HUGETLB mapping
+    }
+#endif
+    return true;
+}
+
+// Ids of the NUMA nodes the machine has memory on, stored in nodes (Linux only; node 0 elsewhere)
+// Returns how many were found, at least 1. Ids of MAX_NUMA_NODES and above are skipped,
+// since a node mask can't name them
+// Read with plain system calls: this runs inside init_allocator, which may itself be
+// running inside the first malloc of a program
+static size_t detect_numa_nodes(size_t* nodes) {
+    nodes[0] = 0;
+#if defined(__linux__)
+    int file = open("/sys/devices/system/node/online", O_RDONLY);
+    if (file < 0) {
+        return 1;
+    }
+    char text[256];
+    ssize_t length = read(file, text, sizeof(text) - 1);
+    close(file);
+    if (length <= 0) {
+        return 1;
     }
     
-    std::cout << "\n";
+    // A list of ids and ranges such as "0-3", "0,2" or "0-1,4-5"
+    size_t count = 0;
+    ssize_t i = 0;
+    while (i < length && count < MAX_NUMA_NODES) {
+        if (text[i] < '0' || text[i] > '9') {
+            i++;
+            continue;
+        }
+        size_t first = 0;
+        for (; i < length && text[i] >= '0' && text[i] <= '9'; i++) {
+            first = first * 10 + (text[i] - '0');
+        }
+        size_t last = first;
+        if (i + 1 < length && text[i] == '-' && text[i + 1] >= '0' && text[i + 1] <= '9') {
+            last = 0;
+            for (i++; i < length && text[i] >= '0' && text[i] <= '9'; i++) {
+                last = last * 10 + (text[i] - '0');
+            }
+        }
+        for (size_t node = first; node <= last && node < MAX_NUMA_NODES && count < MAX_NUMA_NODES; node++) {
+            nodes[count++] = node;
+        }
+    }
+    return count ? count : 1;
+#else
+    return 1;
+#endif
+}
+
+// Id of the NUMA node of the CPU the calling thread runs on
+static size_t current_numa_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+        return node;
+    }
+#endif
+    return 0;
+}
+
+// Ask for the pages of a range to come from one node once they are touched
+// MPOL_PREFERRED rather than MPOL_BIND: a full node falls back to the others
+// instead of failing the allocation. Failures are ignored (first touch decides then)
+static void bind_to_numa_node(char* address, size_t size, size_t node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    const int MPOL_PREFERRED_MODE = 1;
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, address, size, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8 + 1, 0);
+#else
+    (void)address;
+    (void)size;
+    (void)node;
+#endif
+}
+
+// Granularity regions are sized in (and purged in, so a huge page is never split)
+static size_t get_page_granularity(const HeapState* heap, size_t small_page) {
+    return heap->huge_pages != HUGE_PAGES_NONE ? HUGE_PAGE_SIZE : small_page;
+}
+
+// Give committed memory back to the OS, keeping the address space reserved
+static void decommit_memory(char* address, size_t size) {
+#if defined(_WIN32)
+    VirtualFree(address, size, MEM_DECOMMIT);
+#else
+    // Mapping fresh pages over the range drops the old ones
+    mmap(address, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
 }
 
+// Region of a heap that contains a pointer, or nullptr if it is not inside a committed region
+static Region* get_region(const HeapState* heap, const void* ptr) {
+    const char* char_ptr = static_cast<const char*>(ptr);
+    if (!heap->base || char_ptr < heap->base || char_ptr >= heap->limit) {
+        return nullptr;
+    }
+    return heap->region_table[(char_ptr - heap->base) / REGION_SIZE].load(std::memory_order_acquire);
+}
+
+// Offset of the first block of a region of the given size
+// Chosen so the first block's user data is ALIGN_SIZE aligned
+static size_t get_region_header_size(size_t region_size) {
+    size_t slab_page_map_size = (region_size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+    return align_size(sizeof(Region) + slab_page_map_size + sizeof(BlockHeader)) - sizeof(BlockHeader);
+}
+
+// Commit a new region large enough for a block of min_block_size bytes and add it
+// to the arena as one free block
+// Caller must hold the arena's lock; returns nullptr when the heap's space is used up
+static Region* create_region(Arena* arena, size_t min_block_size) {
+    HeapState* heap = arena->heap;
+    
+    // TLSF only takes a block from a list whose every block fits, so the new block
+    // must reach the boundary the request is rounded up to
+    if (heap->engine == ENGINE_TLSF && min_block_size && tlsf_round_up(min_block_size)) {
+        min_block_size = tlsf_round_up(min_block_size);
+    }
+    size_t region_step = get_page_granularity(heap, REGION_SIZE);
+    
+    char* start;
+    size_t region_size;
+    {
+        std::lock_guard<std::mutex> guard(heap->region_lock);
+        size_t available = heap->limit - heap->top;
+        if (min_block_size > available) {
+            return nullptr;  // Could never fit (and sizing its region could overflow)
+        }
+        
+        // Whole steps holding the header, the block and the alignment slack; the header
+        // grows with the region by a byte per slab page, so one more step may be needed
+        size_t needed = min_block_size + ALIGN_SIZE;
+        region_size = (needed + get_region_header_size(needed) + region_step - 1) / region_step * region_step;
+        if (get_region_header_size(region_size) + needed > region_size) {
+            region_size += region_step;
+        }
+        if (region_size > available) {
+            // Caller memory may end part way through a region: the last one gets what is left
+            region_size = available;
+            if (get_region_header_size(region_size) + min_block_size + get_min_block_size() + ALIGN_SIZE > region_size) {
+                return nullptr;
+            }
+        }
+        if (heap->owns_memory && !commit_region(heap, heap->top, region_size)) {
+            return nullptr;
+        }
+        if (heap->numa_nodes > 1) {
+            // Before anything is written to it, so even the region header is node-local
+            bind_to_numa_node(heap->top, region_size, arena->numa_node);
+        }
+        start = heap->top;
+        heap->top += region_size;
+    }
+    
+    Region* region = reinterpret_cast<Region*>(start);
+    region->owner = arena;
+    region->next = arena->regions;
+    region->blocks_start = start + get_region_header_size(region_size);
+    region->end = region->blocks_start + ((start + region_size - region->blocks_start) & ~(ALIGN_SIZE - 1));
+    region->slab_page_map = reinterpret_cast<bool*>(region + 1);
+    std::memset(region->slab_page_map, 0, (region_size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE);
+    arena->regions = region;
+    arena->region_bytes += region->end - region->blocks_start;
+    
+    for (size_t offset = 0; offset < region_size; offset += REGION_SIZE) {
+        heap->region_table[(start + offset - heap->base) / REGION_SIZE].store(region, std::memory_order_release);
+    }
+    
+    // The whole region starts out as one free block
+    BlockHeader* initial_block = reinterpret_cast<BlockHeader*>(region->blocks_start);
+    initial_block->init(region->end - region->blocks_start, BlockHeader::FREE);
+    // Fresh pages are not backed yet, and read as zero (caller memory may hold anything)
+    initial_block->purge_state() = heap->owns_memory ? PURGE_ZERO : PURGE_CLEAN;
+    write_footer(initial_block);
+    insert_into_free_list(arena, initial_block);
+    
+    return region;
+}
+
+// Set up an empty arena of a heap with its first region
+static void init_arena(HeapState* heap, Arena* arena) {
+    std::lock_guard<ArenaLock> guard(arena->lock);
+    arena->heap = heap;
+    arena->regions = nullptr;
+    
+    // Initialize free lists
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        for (size_t j = 0; j < TLSF_SL_COUNT; j++) {
+            arena->free_lists[i][j] = nullptr;
+        }
+        arena->sub_list_bitmaps[i] = 0;
+    }
+    arena->free_list_bitmap = 0;
+    
+    // No slab pages yet
+    for (size_t i = 0; i < NUM_SLAB_CLASSES; i++) {
+        arena->slab_pages[i] = nullptr;
+    }
+    for (size_t i = 0; i < NUM_QUICK_LISTS; i++) {
+        arena->quick_lists[i] = nullptr;
+    }
+    arena->quick_list_bytes = 0;
+    arena->quick_list_count = 0;
+    arena->remote_frees.store(nullptr, std::memory_order_relaxed);
+    arena->remote_free_bytes.store(0, std::memory_order_relaxed);
+    arena->last_purge = std::chrono::steady_clock::now();
+    
+    arena->region_bytes = 0;
+    arena->free_list_bytes = 0;
+    arena->free_block_count = 0;
+    arena->used_block_count = 0;
+    reset_call_counts(arena->calls);
+    
+    // Only the pages that get touched are backed by physical memory
+    create_region(arena, 0);
+}
+
+// Number of arenas a heap may have (at least 1, at most MAX_ARENAS)
+static size_t clamp_arena_count(size_t arena_count) {
+    if (arena_count < 1) {
+        return 1;
+    }
+    return arena_count > MAX_ARENAS ? MAX_ARENAS : arena_count;
+}
+
+static void clear_samples();
+static const HeapOps* get_heap_ops(HeapLocking locking, bool count_calls);
+
+// Set once the default heap exists (by init_allocator or by the first allocation)
+static std::atomic<bool> default_heap_ready(false);
+static std::mutex default_heap_init_lock;
+
+// Initialize the allocator
+// Gives every region of the default heap back to the OS and starts arena_count
+// arenas with one region each, managed by the given engine
+// Only the regions' headers are written: the rest of their pages fault in when first used
+void init_allocator(AllocatorEngine engine, size_t arena_count, HugePageMode huge_pages) {
+    HeapState* heap = &default_heap;
+    heap->engine = engine;
+    heap->arena_count = clamp_arena_count(arena_count);
+    heap->owns_memory = true;
+    heap->use_thread_cache = true;
+    heap->ops = get_heap_ops(HEAP_LOCK_MUTEX, true);
+    
+#if defined(_WIN32)
+    // Large pages on Windows can't be committed into reserved space
+    huge_pages = HUGE_PAGES_NONE;
+#else
+    if (huge_pages == HUGE_PAGES_EXPLICIT && !explicit_huge_pages_available()) {
+        huge_pages = HUGE_PAGES_TRANSPARENT;
+    }
+#endif
+    heap->huge_pages = huge_pages;
+    
+    // Spread the arenas over the NUMA nodes when every node gets at least one;
+    // with fewer arenas, first touch puts pages nearer their users than binding would
+    size_t nodes[MAX_NUMA_NODES];
+    size_t numa_nodes = detect_numa_nodes(nodes);
+    heap->numa_nodes = numa_nodes > 1 && heap->arena_count >= numa_nodes ? numa_nodes : 1;
+    for (size_t i = 0; i < heap->numa_nodes; i++) {
+        online_numa_nodes[i] = nodes[i];
+    }
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        heap->arenas[i].numa_node = heap->numa_nodes > 1 ? nodes[i % heap->numa_nodes] : 0;
+    }
+    
+    {
+        std::lock_guard<std::mutex> guard(heap->region_lock);
+        if (!heap->base) {
+            // One huge page of slack lets the heap start on a huge page boundary
+            char* reserved = reserve_memory(HEAP_RESERVE_SIZE + HUGE_PAGE_SIZE);
+            if (!reserved) {
+                // The arenas are still set up, with no room to grow, so every allocation fails cleanly
+                std::cerr << "ERROR: Could not reserve address space for the heap\n";
+            } else {
+                heap->base = reserved + ((HUGE_PAGE_SIZE - reinterpret_cast<uintptr_t>(reserved) % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE);
+                heap->limit = heap->base + HEAP_RESERVE_SIZE;
+                heap->top = heap->base;
+            }
+        }
+        
+        // Entries past the top were never set
+        for (size_t i = 0; i < static_cast<size_t>(heap->top - heap->base) / REGION_SIZE; i++) {
+            heap->region_table[i].store(nullptr, std::memory_order_relaxed);
+        }
+        if (heap->top > heap->base) {
+            decommit_memory(heap->base, heap->top - heap->base);
+        }
+        heap->top = heap->base;
+    }
+    
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        init_arena(heap, &heap->arenas[i]);
+    }
+    
+    // Anything still sitting in a thread cache belongs to the old heap, and so do the calls counted so far
+    {
+        std::lock_guard<std::mutex> guard(cache_list_lock);
+        reset_call_counts(exited_thread_calls);
+        heap_generation++;
+    }
+    clear_samples();
+    default_heap_ready.store(true, std::memory_order_release);
+}
+
+static void init_default_heap() {
+    std::lock_guard<std::mutex> guard(default_heap_init_lock);
+    if (!default_heap_ready.load(std::memory_order_relaxed)) {
+        init_allocator();
+    }
+}
+
+// Set up the default heap with the default settings on its first allocation, so
+// nothing has to call init_allocator() before my_malloc (not even the static
+// constructors of other translation units, which may run before main)
+static void ensure_default_heap() {
+    if (!default_heap_ready.load(std::memory_order_acquire)) {
+        init_default_heap();
+    }
+}
+
+// Round an address up to a power-of-two boundary
+static char* align_pointer(char* ptr, size_t alignment) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+    return ptr + ((alignment - (address & (alignment - 1))) & (alignment - 1));
+}
+
+// Set up a heap inside caller memory
+// Layout: HeapState, arenas, region table, then the regions from the next page boundary
+// Returns nullptr if the memory can't even hold the bookkeeping
+static HeapState* create_heap(void* memory, size_t size, AllocatorEngine engine, size_t arena_count,
+                              HeapLocking locking, bool count_calls) {
+    arena_count = clamp_arena_count(arena_count);
+    char* memory_end = static_cast<char*>(memory) + size;
+    size_t table_entries = size / REGION_SIZE + 1;
+    
+    char* state_start = align_pointer(static_cast<char*>(memory), alignof(HeapState));
+    char* arenas_start = align_pointer(state_start + sizeof(HeapState), alignof(Arena));
+    char* table_start = align_pointer(arenas_start + arena_count * sizeof(Arena), alignof(std::atomic<Region*>));
+    char* base = align_pointer(table_start + table_entries * sizeof(std::atomic<Region*>), SLAB_PAGE_SIZE);
+    if (base >= memory_end) {
+        return nullptr;
+    }
+    
+    Arena* arenas = reinterpret_cast<Arena*>(arenas_start);
+    std::atomic<Region*>* table = reinterpret_cast<std::atomic<Region*>*>(table_start);
+    for (size_t i = 0; i < arena_count; i++) {
+        new (&arenas[i]) Arena();
+        arenas[i].lock.set_mode(locking);
+        arenas[i].numa_node = 0;
+    }
+    for (size_t i = 0; i < table_entries; i++) {
+        new (&table[i]) std::atomic<Region*>(nullptr);
+    }
+    
+    HeapState* heap = new (state_start) HeapState(arenas, table);
+    heap->base = base;
+    heap->limit = memory_end;
+    heap->top = base;
+    heap->engine = engine;
+    heap->arena_count = arena_count;
+    heap->count_calls = count_calls;
+    heap->ops = get_heap_ops(locking, count_calls);
+    
+    // Regions are handed out in order, so arenas that don't fit stay empty
+    for (size_t i = 0; i < arena_count; i++) {
+        init_arena(heap, &arenas[i]);
+    }
+    return heap;
+}
+
+// Check if a pointer is within the bounds of a heap's blocks
+static bool is_valid_ptr(const HeapState* heap, const void* ptr) {
+    Region* region = get_region(heap, ptr);
+    const char* char_ptr = static_cast<const char*>(ptr);
+    return region && char_ptr >= region->blocks_start && char_ptr < region->end;
+}
+
+// Arena that owns a heap pointer
+static Arena* get_arena(const HeapState* heap, void* ptr) {
+    return get_region(heap, ptr)->owner;
+}
+
+// Total size of a block serving a request of the given size
+// Returns 0 for a request so big that adding the header and rounding up would wrap
+static size_t get_block_size(size_t requested_size) {
+    if (requested_size > SIZE_MAX - BLOCK_OVERHEAD - ALIGN_SIZE) {
+        return 0;
+    }
+    size_t total_size = align_size(BLOCK_OVERHEAD + requested_size);
+    size_t min_block = get_min_block_size();
+    return total_size < min_block ? min_block : total_size;
+}
+
+// Tell the block after this one whether this block is free
+// That flag is what lets allocated blocks do without a footer
+static void update_next_prev_free(Arena* arena, BlockHeader* block) {
+    char* block_end = reinterpret_cast<char*>(block) + block->get_size();
+    if (block_end < get_region(arena->heap, block)->end) {
+        reinterpret_cast<BlockHeader*>(block_end)->set_prev_free(block->is_free());
+    }
+}
+
+// Split a free block if it's large enough
+// The block must already be removed from the free lists and is about to be
+// allocated; the remainder is inserted
+// Returns pointer to the allocated block
+static BlockHeader* split_block(Arena* arena, BlockHeader* block, size_t requested_size) {
+    size_t total_size = get_block_size(requested_size);
+    
+    // Check if block is large enough to split
+    size_t min_remaining = get_min_block_size();
+    if (block->get_size() < total_size + min_remaining) {
+        // Not large enough to split, use entire block
+        return block;
+    }
+    
+    // Split the block
+    char* block_start = reinterpret_cast<char*>(block);
+    BlockHeader* new_block = reinterpret_cast<BlockHeader*>(block_start + total_size);
+    
+    // Setup new free block (the remainder)
+    // Its pages are untouched, so it keeps the purge state of the block it came from
+    // The block before it is the one being allocated, so PREV_FREE stays clear
+    new_block->init(block->get_size() - total_size, BlockHeader::FREE);
+    new_block->purge_state() = block->purge_state();
+    
+    // Update original block size
+    block->set_size(total_size);
+    
+    // Only the free half needs a boundary tag
+    write_footer(new_block);
+    
+    // Insert new block into the free list of its size class
+    insert_into_free_list(arena, new_block);
+    
+    return block;
+}
+
+// Coalesce a freed block with adjacent free blocks
+// Returns the (possibly merged) block that should be inserted into the free list
+// Runs in O(1): the previous block, when PREV_FREE says it is free, is located through its footer
+// Merging stops at the region boundaries
+static BlockHeader* coalesce_block(Arena* arena, BlockHeader* block) {
+    Region* region = get_region(arena->heap, block);
+    char* heap_start = region->blocks_start;
+    char* heap_end = region->end;
+    char* block_start = reinterpret_cast<char*>(block);
+    char* block_end = block_start + block->get_size();
+    
+    // Check if next block exists and is free
+    if (block_end < heap_end) {
+        BlockHeader* next_block = reinterpret_cast<BlockHeader*>(block_end);
+        if (!next_block->is_intact()) {
+            report_heap_corruption("block header");
+        }
+        if (next_block->is_free()) {
+            // Remove next block from free list
+            remove_from_free_list(arena, next_block);
+            
+            // Merge next block into current block
+            block->set_size(block->get_size() + next_block->get_size());
+        }
+    }
+    
+    // Check if previous block exists and is free
+    // Only then does its footer sit directly in front of this header
+    if (block_start > heap_start && block->is_prev_free()) {
+        BlockFooter* prev_footer = reinterpret_cast<BlockFooter*>(block_start) - 1;
+        BlockHeader* prev_block = reinterpret_cast<BlockHeader*>(block_start - prev_footer->size);
+        if (!prev_block->is_intact() || prev_block->get_size() != prev_footer->size) {
+            report_heap_corruption("block header");
+        }
+        
+        // Merge current into the previous block
+        // Note: block is not in free list yet (we just freed it)
+        // prev_block is, and growing it may move it to another size class,
+        // so take it out and let the caller insert the merged block
+        remove_from_free_list(arena, prev_block);
+        prev_block->set_size(prev_block->get_size() + block->get_size());
+        prev_block->purge_state() = PURGE_DIRTY;
+        write_footer(prev_block);
+        return prev_block;
+    }
+    
+    // Block was not merged into previous block
+    write_footer(block);
+    return block;
+}
+
+// Second word of a parked block: the arena that parked it (same word as prev())
+static void*& parked_tag(BlockHeader* block) {
+    return static_cast<void**>(block->get_data())[1];
+}
+
+// Allocate a block from the general-purpose heap
+// Returns the allocated block, or nullptr if no free block is large enough
+// and the arena cannot grow
+// With zeroed, a block carved out of fresh OS memory has its few written bytes cleared
+// and *zeroed is set, so the caller knows its user data is all zero
+static BlockHeader* allocate_block(Arena* arena, size_t size, bool* zeroed = nullptr) {
+    // Calculate required size (header + aligned user data)
+    size_t total_size = get_block_size(size);
+    if (total_size == 0) {
+        return nullptr;
+    }
+    
+    // A deferred free of exactly this size is still allocated: hand it out as it is
+    if (arena->quick_list_bytes && total_size / ALIGN_SIZE < NUM_QUICK_LISTS && arena->quick_lists[total_size / ALIGN_SIZE]) {
+        BlockHeader* block = arena->quick_lists[total_size / ALIGN_SIZE];
+        arena->quick_lists[total_size / ALIGN_SIZE] = block->next();
+        arena->quick_list_bytes -= total_size;
+        arena->quick_list_count--;
+        parked_tag(block) = nullptr;
+        if (zeroed) {
+            *zeroed = false;
+        }
+        return block;
+    }
+    
+    // Search the size class free lists for a block large enough
+    BlockHeader* block_to_use = find_free_block(arena, total_size);
+    if (!block_to_use) {
+        // No suitable block found: ask the OS for another region
+        if (!create_region(arena, total_size)) {
+            return nullptr;
+        }
+        block_to_use = find_free_block(arena, total_size);
+        if (!block_to_use) {
+            return nullptr;
+        }
+    }
+    
+    // Remove from free list, then split off the unused remainder
+    remove_from_free_list(arena, block_to_use);
+    block_to_use = split_block(arena, block_to_use, size);
+    
+    if (zeroed) {
+        // Only the links and the footer were ever written (the footer is the remainder's after a split)
+        *zeroed = block_to_use->purge_state() == PURGE_ZERO;
+        if (*zeroed) {
+            unsigned char* data = static_cast<unsigned char*>(block_to_use->get_data());
+            std::memset(data, 0, &block_to_use->purge_state() + 1 - data);
+            BlockFooter::of(block_to_use)->size = 0;
+        }
+    }
+    
+    // Mark as allocated
+    block_to_use->set_free(false);
+    update_next_prev_free(arena, block_to_use);
+    arena->used_block_count++;
+    
+    return block_to_use;
+}
+
+// Allocate a block whose user data starts on an alignment boundary
+// (alignment must be a power of two and a multiple of ALIGN_SIZE)
+// The leading padding is split off as a free block of its own
+static BlockHeader* allocate_aligned_block(Arena* arena, size_t alignment, size_t size) {
+    size_t min_block = get_min_block_size();
+    
+    // Worst case the padding is a full minimum-size block plus one alignment step
+    size_t total_size = get_block_size(size);
+    if (total_size == 0 || total_size > SIZE_MAX - alignment - min_block) {
+        return nullptr;
+    }
+    size_t search_size = total_size + alignment + min_block;
+    BlockHeader* block = find_free_block(arena, search_size);
+    if (!block) {
+        if (!create_region(arena, search_size)) {
+            return nullptr;
+        }
+        block = find_free_block(arena, search_size);
+        if (!block) {
+            return nullptr;
+        }
+    }
+    remove_from_free_list(arena, block);
+    
+    char* data = reinterpret_cast<char*>(block->get_data());
+    uintptr_t address = reinterpret_cast<uintptr_t>(data);
+    char* aligned_data = data + ((alignment - (address & (alignment - 1))) & (alignment - 1));
+    
+    if (aligned_data != data) {
+        // The padding must be big enough to form a valid free block
+        while (static_cast<size_t>(aligned_data - data) < min_block) {
+            aligned_data += alignment;
+        }
+        
+        size_t padding = aligned_data - data;
+        BlockHeader* aligned_block = reinterpret_cast<BlockHeader*>(reinterpret_cast<char*>(block) + padding);
+        aligned_block->init(block->get_size() - padding, BlockHeader::PREV_FREE);
+        aligned_block->purge_state() = block->purge_state();  // Handed on to a split remainder
+        
+        // The neighbour before a free block is never free, so the padding
+        // block can go straight back into the free lists
+        block->set_size(padding);
+        write_footer(block);
+        insert_into_free_list(arena, block);
+        
+        block = aligned_block;
+    }
+    
+    block = split_block(arena, block, size);
+    block->set_free(false);
+    update_next_prev_free(arena, block);
+    arena->used_block_count++;
+    
+    return block;
+}
+
+// Carve up to count blocks of the same size out of as few free blocks as possible
+// Each free block found is cut into consecutive blocks in one pass, and only the
+// final remainder goes back to the free lists
+// Caller must hold the arena's lock; returns the number of blocks carved
+static size_t allocate_block_batch(Arena* arena, size_t size, void** out, size_t count) {
+    size_t total_size = get_block_size(size);
+    size_t min_block = get_min_block_size();
+    size_t done = 0;
+    if (total_size == 0) {
+        return 0;
+    }
+    
+    while (done < count) {
+        // Prefer one block that holds the whole rest of the batch (when its size doesn't wrap)
+        size_t wanted = count - done <= SIZE_MAX / total_size ? (count - done) * total_size : total_size;
+        BlockHeader* block = find_free_block(arena, wanted);
+        if (!block) {
+            block = find_free_block(arena, total_size);
+        }
+        if (!block) {
+            if (!create_region(arena, wanted) && !create_region(arena, total_size)) {
+                break;
+            }
+            continue;
+        }
+        remove_from_free_list(arena, block);
+        
+        unsigned char purge_state = block->purge_state();
+        char* current = reinterpret_cast<char*>(block);
+        char* end = current + block->get_size();
+        BlockHeader* last = nullptr;
+        
+        // The block before a free block is never free, so PREV_FREE starts out clear
+        while (done < count && static_cast<size_t>(end - current) >= total_size) {
+            size_t block_size = total_size;
+            if (static_cast<size_t>(end - current) - total_size < min_block) {
+                block_size = end - current;  // The rest couldn't form a block of its own
+            }
+            last = reinterpret_cast<BlockHeader*>(current);
+            last->init(block_size, 0);
+            out[done++] = last->get_data();
+            arena->used_block_count++;
+            current += block_size;
+        }
+        
+        if (current < end) {
+            BlockHeader* rest = reinterpret_cast<BlockHeader*>(current);
+            rest->init(end - current, BlockHeader::FREE);
+            rest->purge_state() = purge_state;
+            write_footer(rest);
+            insert_into_free_list(arena, rest);
+        } else {
+            update_next_prev_free(arena, last);
+        }
+    }
+    
+    return done;
+}
+
+// Return a block to the general-purpose heap
+static void release_block(Arena* arena, BlockHeader* block) {
+    // Mark as free (the profiler already dropped its record of a sampled block)
+    block->set_free(true);
+    block->set_flag(BlockHeader::SAMPLED, false);
+    arena->used_block_count--;
+    block->purge_state() = PURGE_DIRTY;
+    
+    // Coalesce with adjacent free blocks
+    BlockHeader* block_to_insert = coalesce_block(arena, block);
+    update_next_prev_free(arena, block_to_insert);
+    
+    // Insert into the free list of its size class (at the beginning for simplicity)
+    insert_into_free_list(arena, block_to_insert);
+}
+
+// Deferred coalescing
+
+// Park a freed block in the quick list of its size instead of merging it
+// Its second word is tagged with the arena, which makes double frees cheap to spot
+// Sweeps the arena once its quick lists hold more than QUICK_LIST_MAX_BYTES
+// Caller must hold the arena's lock
+static void defer_block(Arena* arena, BlockHeader* block) {
+    FreeLink& head = arena->quick_lists[block->get_size() / ALIGN_SIZE];
+    
+    // A block tagged with this arena is probably already in the list
+    // (the tag is read as a plain word: until now the block held user data)
+    if (parked_tag(block) == arena) {
+        for (BlockHeader* parked = head; parked; parked = parked->next()) {
+            if (parked == block) {
+                std::cerr << "ERROR: Double free detected\n";
+                return;
+            }
+        }
+    }
+    
+    block->set_flag(BlockHeader::SAMPLED, false);
+    block->next() = head;
+    parked_tag(block) = arena;
+    head = block;
+    arena->quick_list_bytes += block->get_size();
+    arena->quick_list_count++;
+    
+    if (arena->quick_list_bytes > QUICK_LIST_MAX_BYTES) {
+        sweep_quick_lists(arena);
+    }
+}
+
+// Sort a list linked through next() by address
+// Bottom-up merge sort: runs of 1, 2, 4, ... blocks are merged pairwise until one is left,
+// which needs no memory besides the links
+static BlockHeader* sort_by_address(BlockHeader* list) {
+    for (size_t width = 1; ; width *= 2) {
+        FreeLink sorted;
+        FreeLink* tail = &sorted;
+        size_t merges = 0;
+        
+        while (list) {
+            merges++;
+            BlockHeader* a = list;
+            BlockHeader* b = list;
+            size_t a_length = 0;
+            while (b && a_length < width) {
+                b = b->next();
+                a_length++;
+            }
+            size_t b_length = width;
+            
+            while (a_length > 0 || (b_length > 0 && b)) {
+                BlockHeader* next;
+                if (a_length > 0 && (b_length == 0 || !b || a < b)) {
+                    next = a;
+                    a = a->next();
+                    a_length--;
+                } else {
+                    next = b;
+                    b = b->next();
+                    b_length--;
+                }
+                *tail = next;
+                tail = &next->next();
+            }
+            list = b;
+        }
+        *tail = nullptr;
+        
+        if (merges <= 1) {
+            return sorted;
+        }
+        list = sorted;
+    }
+}
+
+// Merge every quick-listed block back into the free lists
+// The blocks are taken in address order, so each run of neighbours is released as one
+// block and coalesced only once (the way my_free_batch frees runs)
+// Caller must hold the arena's lock; returns whether there was anything to sweep
+static bool sweep_quick_lists(Arena* arena) {
+    if (!arena->quick_list_bytes) {
+        return false;
+    }
+    
+    BlockHeader* parked = nullptr;
+    for (size_t i = 0; i < NUM_QUICK_LISTS; i++) {
+        while (arena->quick_lists[i]) {
+            BlockHeader* block = arena->quick_lists[i];
+            arena->quick_lists[i] = block->next();
+            block->next() = parked;
+            parked = block;
+        }
+    }
+    arena->quick_list_bytes = 0;
+    arena->quick_list_count = 0;
+    
+    BlockHeader* block = sort_by_address(parked);
+    while (block) {
+        BlockHeader* run = block;
+        char* run_end = reinterpret_cast<char*>(block) + block->get_size();
+        block = block->next();
+        
+        while (block && reinterpret_cast<char*>(block) == run_end && get_region(arena->heap, block) == get_region(arena->heap, run)) {
+            run_end += block->get_size();
+            arena->used_block_count--;  // Merged into the run
+            block = block->next();
+        }
+        
+        run->set_size(run_end - reinterpret_cast<char*>(run));
+        release_block(arena, run);
+    }
+    return true;
+}
+
+// Resize an allocated block without moving it
+// Growing absorbs the next block if it is free and big enough; any tail that is big
+// enough to be a block of its own goes back to the free lists
+// Caller must hold the arena's lock; returns false if the block can't grow in place
+static bool resize_block(Arena* arena, BlockHeader* block, size_t size) {
+    size_t total_size = get_block_size(size);
+    if (total_size == 0) {
+        return false;
+    }
+    
+    if (total_size > block->get_size()) {
+        char* block_end = reinterpret_cast<char*>(block) + block->get_size();
+        if (block_end >= get_region(arena->heap, block)->end) {
+            return false;
+        }
+        BlockHeader* next_block = reinterpret_cast<BlockHeader*>(block_end);
+        if (!next_block->is_free() || block->get_size() + next_block->get_size() < total_size) {
+            return false;
+        }
+        remove_from_free_list(arena, next_block);
+        block->set_size(block->get_size() + next_block->get_size());
+    }
+    
+    if (block->get_size() >= total_size + get_min_block_size()) {
+        // The tail is freed like any other block, so it merges with a free next block
+        BlockHeader* tail = reinterpret_cast<BlockHeader*>(reinterpret_cast<char*>(block) + total_size);
+        tail->init(block->get_size() - total_size, 0);
+        block->set_size(total_size);
+        arena->used_block_count++;
+        release_block(arena, tail);
+    } else {
+        // A neighbour that was absorbed is no longer free
+        update_next_prev_free(arena, block);
+    }
+    
+    return true;
+}
+
+// Release the whole pages inside a free block, keeping the address space committed
+// With huge pages only whole huge pages are released: giving back part of one
+// would make the kernel split it into small pages
+// The header, the free list links and the footer stay untouched
+// Returns the number of bytes released
+static size_t purge_block(const HeapState* heap, BlockHeader* block) {
+    uintptr_t page_size = get_page_granularity(heap, SLAB_PAGE_SIZE);
+    uintptr_t first = reinterpret_cast<uintptr_t>(&block->purge_state() + 1);
+    uintptr_t last = reinterpret_cast<uintptr_t>(BlockFooter::of(block));
+    first = (first + page_size - 1) & ~(page_size - 1);
+    last &= ~(page_size - 1);
+    
+    block->purge_state() = PURGE_CLEAN;
+    if (last <= first) {
+        return 0;
+    }
+    
+    // The pages read back as zero (or keep their old contents) when next used;
+    // either way no recommit is needed before a split writes into them
+#if defined(_WIN32)
+    VirtualAlloc(reinterpret_cast<void*>(first), last - first, MEM_RESET, PAGE_READWRITE);
+#else
+    madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+#endif
+    return last - first;
+}
+
+// Walk the free blocks big enough to hold a page and purge them
+// With aging, dirty blocks are only marked and purged on the next pass
+// Caller must hold the arena's lock; returns the number of bytes released
+static size_t purge_arena(Arena* arena, bool aging) {
+    size_t released = 0;
+    
+    for (size_t i = floor_log2(get_page_granularity(arena->heap, SLAB_PAGE_SIZE)); i < NUM_SIZE_CLASSES; i++) {
+        if (!(arena->free_list_bitmap & (static_cast<size_t>(1) << i))) {
+            continue;
+        }
+        for (size_t j = 0; j < TLSF_SL_COUNT; j++) {
+            for (BlockHeader* block = first_free_block(arena, i, j); block; block = next_free_block(arena, block)) {
+                if (block->purge_state() == PURGE_CLEAN || block->purge_state() == PURGE_ZERO) {
+                    continue;
+                }
+                if (aging && block->purge_state() == PURGE_DIRTY) {
+                    block->purge_state() = PURGE_AGED;
+                    continue;
+                }
+                released += purge_block(arena->heap, block);
+            }
+        }
+    }
+    
+    return released;
+}
+
+// Run an aging purge pass if a decay period has passed since the last one
+// Only called from allocation slow paths, never from my_free; heaps over caller
+// memory are never purged (the pages aren't theirs to give back)
+// Caller must hold the arena's lock
+static void maybe_purge(Arena* arena) {
+    unsigned decay = purge_decay_ms.load(std::memory_order_relaxed);
+    if (decay == 0 || !arena->heap->owns_memory) {
+        return;
+    }
+    
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now - arena->last_purge < std::chrono::milliseconds(decay)) {
+        return;
+    }
+    arena->last_purge = now;
+    purge_arena(arena, true);
+}
+
+// Slab class serving requests of the given size (1..SLAB_MAX_SIZE bytes)
+static size_t get_slab_class(size_t size) {
+    return (size - 1) / SLAB_SLOT_GRANULARITY;
+}
+
+// Check if a heap pointer lies inside a slab page
+static bool is_slab_ptr(const HeapState* heap, void* ptr) {
+    Region* region = get_region(heap, ptr);
+    size_t offset = reinterpret_cast<char*>(ptr) - reinterpret_cast<char*>(region);
+    return region->slab_page_map[offset / SLAB_PAGE_SIZE];
+}
+
+// Add a page to the front of its class's list of pages with free slots
+static void link_slab_page(Arena* arena, SlabPage* page) {
+    SlabPage*& head = arena->slab_pages[get_slab_class(page->slot_size)];
+    page->prev = nullptr;
+    page->next = head;
+    if (head) {
+        head->prev = page;
+    }
+    head = page;
+}
+
+// Remove a page from its class's list of pages with free slots
+static void unlink_slab_page(Arena* arena, SlabPage* page) {
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        arena->slab_pages[get_slab_class(page->slot_size)] = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->next = nullptr;
+    page->prev = nullptr;
+}
+
+// Carve a new page-aligned slab page for a class out of the general heap
+static SlabPage* create_slab_page(Arena* arena, size_t slab_class) {
+    BlockHeader* block = allocate_aligned_block(arena, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (!block) {
+        return nullptr;
+    }
+    
+    SlabPage* page = reinterpret_cast<SlabPage*>(block->get_data());
+    char* page_start = reinterpret_cast<char*>(page);
+    size_t header_size = (sizeof(SlabPage) + SLAB_SLOT_GRANULARITY - 1) & ~(SLAB_SLOT_GRANULARITY - 1);
+    
+    page->slot_size = (slab_class + 1) * SLAB_SLOT_GRANULARITY;
+    page->slots_begin = page_start + header_size;
+    page->slot_count = (SLAB_PAGE_SIZE - header_size) / page->slot_size;
+    page->used_count = 0;
+    std::memset(page->used_map, 0, sizeof(page->used_map));
+    
+    // Thread every slot onto the free list, lowest address first
+    page->free_slots = nullptr;
+    for (size_t i = page->slot_count; i > 0; i--) {
+        void* slot = page->slots_begin + (i - 1) * page->slot_size;
+        store_link(static_cast<void**>(slot), page->free_slots);
+        page->free_slots = slot;
+    }
+    
+    Region* region = get_region(arena->heap, page_start);
+    region->slab_page_map[(page_start - reinterpret_cast<char*>(region)) / SLAB_PAGE_SIZE] = true;
+    link_slab_page(arena, page);
+    return page;
+}
+
+// Give an empty slab page back to the general heap
+static void release_slab_page(Arena* arena, SlabPage* page) {
+    unlink_slab_page(arena, page);
+    Region* region = get_region(arena->heap, page);
+    region->slab_page_map[(reinterpret_cast<char*>(page) - reinterpret_cast<char*>(region)) / SLAB_PAGE_SIZE] = false;
+    release_block(arena, BlockHeader::get_header(page));
+}
+
+// Allocate a slot from the slab layer
+// Returns nullptr if a new slab page was needed and the heap has no room for it
+static void* slab_malloc(Arena* arena, size_t size) {
+    size_t slab_class = get_slab_class(size);
+    SlabPage* page = arena->slab_pages[slab_class];
+    if (!page) {
+        page = create_slab_page(arena, slab_class);
+        if (!page) {
+            return nullptr;
+        }
+    }
+    
+    // Pop the first free slot
+    void* slot = page->free_slots;
+    page->free_slots = load_link(static_cast<void**>(slot));
+    
+    size_t index = (reinterpret_cast<char*>(slot) - page->slots_begin) / page->slot_size;
+    page->used_map[index / 64] |= static_cast<uint64_t>(1) << (index % 64);
+    page->used_count++;
+    
+    // Full pages leave the list so the next malloc doesn't look at them
+    if (!page->free_slots) {
+        unlink_slab_page(arena, page);
+    }
+    
+    return slot;
+}
+
+// Slab page that contains a slot
+static SlabPage* get_slab_page(void* ptr) {
+    return reinterpret_cast<SlabPage*>(reinterpret_cast<uintptr_t>(ptr) & ~(SLAB_PAGE_SIZE - 1));
+}
+
+// Check if a pointer is the start of a slot of its slab page
+static bool is_slab_slot(SlabPage* page, void* ptr) {
+    char* slot = reinterpret_cast<char*>(ptr);
+    size_t offset = slot - page->slots_begin;
+    return slot >= page->slots_begin && offset % page->slot_size == 0 &&
+           offset / page->slot_size < page->slot_count;
+}
+
+// Free a slot that belongs to a slab page
+static void slab_free(Arena* arena, void* ptr) {
+    char* slot = reinterpret_cast<char*>(ptr);
+    SlabPage* page = get_slab_page(ptr);
+    
+    // Validate pointer (must be the start of a slot)
+    if (!is_slab_slot(page, ptr)) {
+        std::cerr << "ERROR: Invalid pointer passed to my_free (not a slab slot)\n";
+        return;
+    }
+    
+    // Check for double free
+    size_t index = (slot - page->slots_begin) / page->slot_size;
+    uint64_t bit = static_cast<uint64_t>(1) << (index % 64);
+    if (!(page->used_map[index / 64] & bit)) {
+        std::cerr << "ERROR: Double free detected\n";
+        return;
+    }
+    page->used_map[index / 64] &= ~bit;
+    
+    // A full page gets free slots again, so it rejoins the list
+    if (!page->free_slots) {
+        link_slab_page(arena, page);
+    }
+    store_link(static_cast<void**>(ptr), page->free_slots);
+    page->free_slots = slot;
+    page->used_count--;
+    
+    // Keep one empty page per class around so alloc/free loops don't thrash,
+    // but hand any further empty pages back to the general heap
+    if (page->used_count == 0 && (page->prev || page->next)) {
+        release_slab_page(arena, page);
+    }
+}
+
+// Allocate from an arena (slab layer, then general-purpose heap)
+// Caller must hold the arena's lock
+static void* backend_malloc(Arena* arena, size_t size, bool* zeroed = nullptr) {
+    // Small requests are served by the slab layer (no per-object header)
+    if (size <= SLAB_MAX_SIZE) {
+        void* slot = slab_malloc(arena, size);
+        if (slot) {
+            if (zeroed) {
+                *zeroed = false;
+            }
+            return slot;
+        }
+    }
+    
+    BlockHeader* block = allocate_block(arena, size, zeroed);
+    if (!block) {
+        return nullptr;
+    }
+    
+    // Return pointer to user data
+    return block->get_data();
+}
+
+// Free a validated pointer to the arena that owns it
+// Caller must hold the arena's lock
+static void backend_free(Arena* arena, void* ptr) {
+    BlockHeader* block = BlockHeader::get_header(ptr);
+    if (is_slab_ptr(arena->heap, ptr)) {
+        slab_free(arena, ptr);
+    } else if (arena->heap->defer_coalescing.load(std::memory_order_relaxed) &&
+               block->get_size() - BLOCK_OVERHEAD <= QUICK_LIST_MAX_SIZE) {
+        defer_block(arena, block);
+    } else {
+        release_block(arena, block);
+    }
+}
+
+static size_t heap_usable_size(const HeapState* heap, void* ptr);
+
+// Queue a block freed by another arena's thread on its owner, without taking the owner's lock
+static void push_remote_free(Arena* owner, void* ptr) {
+    if (!is_slab_ptr(owner->heap, ptr)) {
+        owner->remote_free_bytes.fetch_add(BlockHeader::get_header(ptr)->get_size() - BLOCK_OVERHEAD,
+                                           std::memory_order_relaxed);
+    }
+    void** link = static_cast<void**>(ptr);
+    void* head = owner->remote_frees.load(std::memory_order_relaxed);
+    do {
+        store_link(link, head);
+    } while (!owner->remote_frees.compare_exchange_weak(head, ptr,
+                                                        std::memory_order_release,
+                                                        std::memory_order_relaxed));
+}
+
+// Per-size-class call counting, for the statistics policy the heap operations are compiled for
+// A heap with thread caches counts a call in the calling thread's cache, any other heap in
+// the arena serving it (under its lock); with NoStats every call here is empty
+template <typename StatsPolicy>
+struct CallRecorder;
+
+template <>
+struct CallRecorder<NoStats> {
+    static void count_arena_malloc(Arena*, void*) {}
+    static void count_arena_free(Arena*, size_t) {}
+    static void count_thread_malloc(HeapState*, void*) {}
+    static void count_thread_free(HeapState*, size_t) {}
+    static void count_cached(std::atomic<uint64_t>*, size_t) {}
+};
+
+template <>
+struct CallRecorder<Stats> {
+    // In the arena, for heaps without thread caches (caller holds the arena's lock)
+    static void count_arena_malloc(Arena* arena, void* ptr) {
+        if (!arena->heap->use_thread_cache) {
+            count_call(arena->calls.mallocs, heap_usable_size(arena->heap, ptr));
+        }
+    }
+    
+    static void count_arena_free(Arena* arena, size_t usable_size) {
+        if (!arena->heap->use_thread_cache) {
+            count_call(arena->calls.frees, usable_size);
+        }
+    }
+    
+    // For the calling thread, for heaps with thread caches (defined with the thread caches)
+    static void count_thread_malloc(HeapState* heap, void* ptr);
+    static void count_thread_free(HeapState* heap, size_t usable_size);
+    
+    // In the counters of a thread cache the caller holds
+    static void count_cached(std::atomic<uint64_t>* counts, size_t usable_size) {
+        count_call(counts, usable_size);
+    }
+};
+
+// Give every queued remote free back to the arena
+// Caller must hold the arena's lock
+template <typename StatsPolicy>
+static void drain_remote_frees(Arena* arena) {
+    if (!arena->remote_frees.load(std::memory_order_relaxed)) {
+        return;
+    }
+    
+    void* ptr = arena->remote_frees.exchange(nullptr, std::memory_order_acquire);
+    size_t drained_bytes = 0;
+    while (ptr) {
+        void* next = load_link(static_cast<void**>(ptr));
+        if (StatsPolicy::enabled) {
+            CallRecorder<StatsPolicy>::count_arena_free(arena, heap_usable_size(arena->heap, ptr));
+        }
+        if (!is_slab_ptr(arena->heap, ptr)) {
+            drained_bytes += BlockHeader::get_header(ptr)->get_size() - BLOCK_OVERHEAD;
+        }
+        backend_free(arena, ptr);
+        ptr = next;
+    }
+    arena->remote_free_bytes.fetch_sub(drained_bytes, std::memory_order_relaxed);
+}
+
+// Give an arena every free it hasn't processed yet: queued remote frees and deferred ones
+// Caller must hold the arena's lock
+static void settle_frees(Arena* arena) {
+    if (arena->heap->count_calls) {
+        drain_remote_frees<Stats>(arena);
+    } else {
+        drain_remote_frees<NoStats>(arena);
+    }
+    sweep_quick_lists(arena);
+}
+
+// Allocate from the given arena, falling back to the others when it is full
+// A non-zero alignment asks for a general-purpose block aligned to it; without one,
+// zeroed reports whether the block is already all zero (see allocate_block)
+// Takes the arena locks one at a time
+template <typename Lock, typename StatsPolicy>
+static void* arena_malloc(Arena* home, size_t size, size_t alignment = 0, bool* zeroed = nullptr) {
+    HeapState* heap = home->heap;
+    size_t home_index = home - heap->arenas;
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        Arena* arena = &heap->arenas[(home_index + i) % heap->arena_count];
+        std::lock_guard<Lock> guard(arena->lock.get<Lock>());
+        drain_remote_frees<StatsPolicy>(arena);
+        maybe_purge(arena);
+        
+        void* ptr;
+        if (alignment) {
+            BlockHeader* block = allocate_aligned_block(arena, alignment, size);
+            ptr = block ? block->get_data() : nullptr;
+        } else {
+            ptr = backend_malloc(arena, size, zeroed);
+        }
+        if (ptr) {
+            CallRecorder<StatsPolicy>::count_arena_malloc(arena, ptr);
+            return ptr;
+        }
+    }
+    return nullptr;
+}
+
+// The calling thread's cache (created on first use, flushed on thread exit)
+static thread_local ThreadCache thread_cache;
+
+// Set once the calling thread's cache is destroyed at thread exit
+// Calls that come later (from other thread_local destructors or atexit handlers) must
+// not touch the cache: they go straight to the thread's arena instead
+// A plain bool with a constant initializer, so it is never destroyed itself
+static thread_local bool thread_cache_destroyed = false;
+
+ThreadCache::ThreadCache() : cached_bytes(0), arena(nullptr), generation(heap_generation.load(std::memory_order_relaxed)),
+                             calls_generation(generation), prev(nullptr) {
+    for (size_t i = 0; i < NUM_TCACHE_BINS; i++) {
+        bins[i] = nullptr;
+        counts[i] = 0;
+    }
+    reset_call_counts(calls);
+    
+    std::lock_guard<std::mutex> guard(cache_list_lock);
+    next = thread_caches;
+    if (next) {
+        next->prev = this;
+    }
+    thread_caches = this;
+}
+
+ThreadCache::~ThreadCache() {
+    flush_thread_cache();
+    thread_cache_destroyed = true;
+    
+    // Keep the thread's calls in the statistics
+    std::lock_guard<std::mutex> guard(cache_list_lock);
+    if (calls_generation.load(std::memory_order_relaxed) == heap_generation.load(std::memory_order_relaxed)) {
+        add_call_counts(exited_thread_calls, calls);
+    }
+    if (prev) {
+        prev->next = next;
+    } else {
+        thread_caches = next;
+    }
+    if (next) {
+        next->prev = prev;
+    }
+}
+
+// Arena of the default heap for a thread that starts using it: the next one round-robin
+// among the arenas of the NUMA node the thread runs on (among all of them without NUMA)
+// A thread the scheduler later moves to another node keeps its arena
+static Arena* pick_default_arena() {
+    HeapState* heap = &default_heap;
+    if (heap->numa_nodes <= 1) {
+        return &heap->arenas[next_arena.fetch_add(1, std::memory_order_relaxed) % heap->arena_count];
+    }
+    
+    // Position of the node among the online ones (the first for a node we don't know)
+    size_t node_id = current_numa_node();
+    size_t node = 0;
+    while (node < heap->numa_nodes && online_numa_nodes[node] != node_id) {
+        node++;
+    }
+    if (node == heap->numa_nodes) {
+        node = 0;
+    }
+    
+    // Arenas node, node + numa_nodes, node + 2 * numa_nodes, ... are on the node
+    size_t node_arenas = (heap->arena_count - node + heap->numa_nodes - 1) / heap->numa_nodes;
+    size_t turn = next_arena_on_node[node].fetch_add(1, std::memory_order_relaxed);
+    return &heap->arenas[node + (turn % node_arenas) * heap->numa_nodes];
+}
+
+// Get the calling thread's cache of the default heap, emptied if init_allocator() ran since its last use
+static ThreadCache& get_thread_cache() {
+    ThreadCache& cache = thread_cache;
+    unsigned generation = heap_generation.load(std::memory_order_relaxed);
+    if (cache.generation != generation) {
+        // The blocks belong to a heap that no longer exists: drop them, don't free them
+        for (size_t i = 0; i < NUM_TCACHE_BINS; i++) {
+            cache.bins[i] = nullptr;
+            cache.counts[i] = 0;
+        }
+        cache.cached_bytes = 0;
+        cache.arena = nullptr;
+        cache.generation = generation;
+        reset_call_counts(cache.calls);
+        cache.calls_generation.store(generation, std::memory_order_relaxed);
+    }
+    if (!cache.arena) {
+        cache.arena = pick_default_arena();
+    }
+    return cache;
+}
+
+// Count a call of the calling thread to the default heap: in its cache, or once the cache
+// is destroyed, with the calls of the threads that have exited
+static void count_thread_call(bool is_free, size_t usable_size) {
+    if (!thread_cache_destroyed) {
+        CallCounts& calls = get_thread_cache().calls;
+        count_call(is_free ? calls.frees : calls.mallocs, usable_size);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(cache_list_lock);
+    count_call(is_free ? exited_thread_calls.frees : exited_thread_calls.mallocs, usable_size);
+}
+
+void CallRecorder<Stats>::count_thread_malloc(HeapState* heap, void* ptr) {
+    if (heap->use_thread_cache) {
+        count_thread_call(false, heap_usable_size(heap, ptr));
+    }
+}
+
+void CallRecorder<Stats>::count_thread_free(HeapState* heap, size_t usable_size) {
+    if (heap->use_thread_cache) {
+        count_thread_call(true, usable_size);
+    }
+}
+
+// The default heap's operations: arenas locked with mutexes, calls counted in the thread caches
+typedef HeapEngine<MutexLock, Stats> DefaultEngine;
+
+// Link field of a cached block (word 0 = next block, word 1 = owning cache)
+static void** cache_links(void* ptr) {
+    return reinterpret_cast<void**>(ptr);
+}
+
+// Size every block in a bin can serve
+static size_t get_tcache_bin_size(size_t bin) {
+    return (bin + 1) * TCACHE_GRANULARITY;
+}
+
+// Move up to count blocks from a bin back to the arenas that own them
+// A bin may hold blocks of other arenas (frees from other threads); those are
+// queued as remote frees, so only the thread's own arena lock is ever taken
+static void flush_tcache_bin(ThreadCache& cache, size_t bin, size_t count) {
+    std::unique_lock<MutexLock> guard(cache.arena->lock.get<MutexLock>(), std::defer_lock);
+    
+    while (cache.bins[bin] && count > 0) {
+        void* ptr = cache.bins[bin];
+        cache.bins[bin] = load_link(cache_links(ptr));
+        cache.counts[bin]--;
+        cache.cached_bytes -= get_tcache_bin_size(bin);
+        count--;
+        
+        Arena* owner = get_arena(&default_heap, ptr);
+        if (owner != cache.arena) {
+            push_remote_free(owner, ptr);
+            continue;
+        }
+        if (!guard.owns_lock()) {
+            guard.lock();
+        }
+        backend_free(owner, ptr);
+    }
+}
+
+// Fill a bin with a batch of blocks from the thread's arena and return one of them
+// Other arenas are only used when the thread's own arena is full
+// Returns nullptr if no arena has memory left
+static void* refill_tcache_bin(ThreadCache& cache, size_t bin) {
+    size_t block_size = get_tcache_bin_size(bin);
+    void* batch[TCACHE_BATCH_SIZE];
+    size_t allocated = 0;
+    
+    // Stay within the byte budget (the block handed out doesn't count against it)
+    size_t wanted = 1;
+    if (cache.cached_bytes < TCACHE_MAX_BYTES) {
+        wanted += (TCACHE_MAX_BYTES - cache.cached_bytes) / block_size;
+    }
+    if (wanted > TCACHE_BATCH_SIZE) {
+        wanted = TCACHE_BATCH_SIZE;
+    }
+    
+    {
+        std::lock_guard<MutexLock> guard(cache.arena->lock.get<MutexLock>());
+        drain_remote_frees<Stats>(cache.arena);
+        maybe_purge(cache.arena);
+        while (allocated < wanted) {
+            void* ptr = backend_malloc(cache.arena, block_size);
+            if (!ptr) {
+                break;
+            }
+            batch[allocated++] = ptr;
+        }
+    }
+    
+    if (allocated == 0) {
+        return arena_malloc<MutexLock, Stats>(cache.arena, block_size);
+    }
+    
+    // Push in reverse so later pops hand out the batch in address order
+    for (size_t i = allocated; i > 1; i--) {
+        void** links = cache_links(batch[i - 1]);
+        store_link(links, cache.bins[bin]);
+        links[1] = &cache;
+        cache.bins[bin] = batch[i - 1];
+        cache.counts[bin]++;
+        cache.cached_bytes += block_size;
+    }
+    
+    return batch[0];
+}
+
+// Arena of a heap the calling thread allocates from (and frees to without queuing)
+static Arena* get_home_arena(HeapState* heap) {
+    if (heap->use_thread_cache && !thread_cache_destroyed) {
+        return get_thread_cache().arena;
+    }
+    return &heap->arenas[thread_number % heap->arena_count];
+}
+
+// Heap profiling
+
+// Deepest call stack kept for a sampled block
+const size_t SAMPLE_MAX_FRAMES = 32;
+
+// Bytes a thread allocates between looks at the sampling interval while sampling is off
+const size_t SAMPLE_RECHECK_BYTES = 1024 * 1024;
+
+// One call stack that sampled blocks were allocated from, with the totals of its samples
+struct SampleBucket {
+    void* frames[SAMPLE_MAX_FRAMES];
+    size_t depth;
+    uint64_t hash;
+    uint64_t allocs;
+    uint64_t alloc_bytes;   // Bytes requested
+    uint64_t frees;
+    uint64_t free_bytes;
+    SampleBucket* next;     // Next bucket in the same hash slot
+};
+
+// A sampled block that is still allocated
+struct SampledBlock {
+    SampleBucket* bucket;
+    size_t size;            // Bytes requested
+};
+
+const size_t SAMPLE_BUCKET_SLOTS = 1024;
+
+static std::atomic<size_t> sample_interval(0);      // Mean bytes between samples, 0 = off
+static std::atomic<bool> samples_recorded(false);   // Some block was sampled since the last init_allocator()
+
+// Protects the buckets and the sampled blocks
+// Taken before any arena lock (its containers allocate from the heap when
+// malloc_override.cpp is linked in), never while one is held
+static std::mutex sample_lock;
+static SampleBucket* sample_buckets[SAMPLE_BUCKET_SLOTS];
+static std::unordered_map<void*, SampledBlock>* sampled_blocks = nullptr;  // Created by the first sample
+
+// Bytes the calling thread may still allocate before its next sample
+// SIZE_MAX while the profiler itself allocates, so it never samples itself
+// Plain values with constant initializers: reading them needs no TLS init check
+static thread_local size_t bytes_until_sample = 0;
+static thread_local uint64_t sample_random = 0;
+
+// Uniform random number in (0, 1] (xorshift64*, seeded per thread)
+static double next_sample_random() {
+    uint64_t& state = sample_random;
+    if (state == 0) {
+        state = (reinterpret_cast<uintptr_t>(&state) ^
+                 static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count())) | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return static_cast<double>(((state * 2685821657736338717ULL) >> 11) + 1) / 9007199254740992.0;
+}
+
+// Bytes until the next sample, drawn from an exponential distribution with the given mean
+// (the continuous form of the geometric distribution of gaps between picked bytes)
+static size_t next_sample_interval(size_t mean) {
+    double interval = -std::log(next_sample_random()) * static_cast<double>(mean);
+    return interval < static_cast<double>(SIZE_MAX / 2) ? static_cast<size_t>(interval) + 1 : SIZE_MAX / 2;
+}
+
+// Whether an allocation of the given size is sampled
+// Almost always a compare and a subtract on a thread-local counter; only when the
+// counter runs out is the interval looked at and the next gap drawn
+static bool should_sample(size_t size) {
+    if (bytes_until_sample >= size) {
+        bytes_until_sample -= size;
+        return false;
+    }
+    size_t mean = sample_interval.load(std::memory_order_relaxed);
+    bytes_until_sample = mean ? next_sample_interval(mean) : SAMPLE_RECHECK_BYTES;
+    return mean != 0;
+}
+
+// Capture the calling thread's stack from the frame that returns to caller onwards,
+// dropping the allocator's own frames; returns the number of frames stored
+static size_t capture_stack(void* caller, void** frames) {
+    void* stack[SAMPLE_MAX_FRAMES + 8];
+#if defined(_WIN32)
+    size_t depth = CaptureStackBackTrace(0, SAMPLE_MAX_FRAMES + 8, stack, nullptr);
+#elif defined(ALLOCATOR_HAS_BACKTRACE)
+    size_t depth = backtrace(stack, SAMPLE_MAX_FRAMES + 8);
+#else
+    size_t depth = 0;
+#endif
+    
+    size_t first = 0;
+    while (first < depth && stack[first] != caller) {
+        first++;
+    }
+    if (first == depth) {
+        // No unwinder (or the caller wasn't found): the caller alone still tells where it came from
+        frames[0] = caller;
+        return 1;
+    }
+    
+    size_t count = std::min(depth - first, SAMPLE_MAX_FRAMES);
+    std::memcpy(frames, stack + first, count * sizeof(void*));
+    return count;
+}
+
+// Count a sampled block under the call stack that allocated it
+// If the record can't be allocated the block stays untracked (it is still freed normally)
+static void record_sample(void* ptr, size_t size, void* const* frames, size_t depth) {
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a over the frame addresses
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ reinterpret_cast<uintptr_t>(frames[i])) * 1099511628211ULL;
+    }
+    
+    std::lock_guard<std::mutex> guard(sample_lock);
+    SampleBucket** slot = &sample_buckets[hash % SAMPLE_BUCKET_SLOTS];
+    SampleBucket* bucket = *slot;
+    while (bucket && (bucket->hash != hash || bucket->depth != depth ||
+                      std::memcmp(bucket->frames, frames, depth * sizeof(void*)) != 0)) {
+        bucket = bucket->next;
+    }
+    
+    try {
+        if (!sampled_blocks) {
+            sampled_blocks = new std::unordered_map<void*, SampledBlock>();
+        }
+        if (!bucket) {
+            bucket = new SampleBucket();
+            std::memcpy(bucket->frames, frames, depth * sizeof(void*));
+            bucket->depth = depth;
+            bucket->hash = hash;
+            bucket->next = *slot;
+            *slot = bucket;
+        }
+        SampledBlock block = {bucket, size};
+        (*sampled_blocks)[ptr] = block;
+    } catch (const std::bad_alloc&) {
+        return;
+    }
+    bucket->allocs++;
+    bucket->alloc_bytes += size;
+    samples_recorded.store(true, std::memory_order_relaxed);
+}
+
+// Forget a sampled block that is being freed
+// Must run before the block goes back to its arena, or its address could be sampled again first
+static void drop_sample(void* ptr) {
+    std::lock_guard<std::mutex> guard(sample_lock);
+    if (!sampled_blocks) {
+        return;
+    }
+    std::unordered_map<void*, SampledBlock>::iterator it = sampled_blocks->find(ptr);
+    if (it != sampled_blocks->end()) {
+        it->second.bucket->frees++;
+        it->second.bucket->free_bytes += it->second.size;
+        sampled_blocks->erase(it);
+    }
+}
+
+// Give a sampled block that was resized in place its new size
+// Its bucket's requested bytes follow, so the bucket's live bytes stay the sum of its blocks
+static void resize_sample(void* ptr, size_t size) {
+    std::lock_guard<std::mutex> guard(sample_lock);
+    if (!sampled_blocks) {
+        return;
+    }
+    std::unordered_map<void*, SampledBlock>::iterator it = sampled_blocks->find(ptr);
+    if (it != sampled_blocks->end()) {
+        it->second.bucket->alloc_bytes = it->second.bucket->alloc_bytes - it->second.size + size;
+        it->second.size = size;
+    }
+}
+
+// Drop every record (the blocks they describe are gone after init_allocator())
+static void clear_samples() {
+    std::lock_guard<std::mutex> guard(sample_lock);
+    for (size_t i = 0; i < SAMPLE_BUCKET_SLOTS; i++) {
+        while (sample_buckets[i]) {
+            SampleBucket* next = sample_buckets[i]->next;
+            delete sample_buckets[i];
+            sample_buckets[i] = next;
+        }
+    }
+    if (sampled_blocks) {
+        sampled_blocks->clear();
+    }
+    samples_recorded.store(false, std::memory_order_relaxed);
+}
+
+// Allocate a block of the default heap picked by the sampler and record who asked for it
+// It is always a general-purpose block (never a slab slot) tagged SAMPLED, so
+// heap_free knows to drop its record without looking it up, and it never enters a
+// thread cache, where a later owner would inherit the tag
+static void* sampled_malloc(size_t alignment, size_t size, void* caller) {
+    HeapState* heap = &default_heap;
+    size_t remaining = bytes_until_sample;
+    bytes_until_sample = SIZE_MAX;
+    
+    void* frames[SAMPLE_MAX_FRAMES];
+    size_t depth = capture_stack(caller, frames);
+    
+    void* ptr = arena_malloc<MutexLock, Stats>(get_home_arena(heap), size, std::max(alignment, ALIGN_SIZE));
+    if (ptr) {
+        count_thread_call(false, heap_usable_size(heap, ptr));
+        {
+            // Neighbours update the PREV_FREE flag under this lock
+            std::lock_guard<MutexLock> guard(get_arena(heap, ptr)->lock.get<MutexLock>());
+            BlockHeader::get_header(ptr)->set_flag(BlockHeader::SAMPLED, true);
+        }
+        record_sample(ptr, size, frames, depth);
+    }
+    
+    bytes_until_sample = remaining;
+    return ptr;
+}
+
+// Allocate memory from a heap
+template <typename Lock, typename StatsPolicy>
+static void* heap_malloc(HeapState* heap, size_t size) {
+    if (size == 0) {
+        return nullptr;
+    }
+    
+    if (!heap->use_thread_cache) {
+        return arena_malloc<Lock, StatsPolicy>(get_home_arena(heap), size);
+    }
+    if (thread_cache_destroyed) {
+        void* ptr = arena_malloc<Lock, StatsPolicy>(get_home_arena(heap), size);
+        CallRecorder<StatsPolicy>::count_thread_malloc(heap, ptr);
+        return ptr;
+    }
+    
+    // Fast path: pop a cached block of the right size without locking
+    ThreadCache& cache = get_thread_cache();
+    void* ptr;
+    if (size <= TCACHE_MAX_SIZE) {
+        size_t bin = (size + TCACHE_GRANULARITY - 1) / TCACHE_GRANULARITY - 1;
+        
+        ptr = cache.bins[bin];
+        if (ptr) {
+            void** links = cache_links(ptr);
+            cache.bins[bin] = load_link(links);
+            links[1] = nullptr;
+            cache.counts[bin]--;
+            cache.cached_bytes -= get_tcache_bin_size(bin);
+            CallRecorder<StatsPolicy>::count_cached(cache.calls.mallocs, get_tcache_bin_size(bin));  // Same size class as the block
+            return ptr;
+        }
+        
+        ptr = refill_tcache_bin(cache, bin);
+        if (!ptr) {
+            // Out of memory: memory parked in this thread's other bins may help
+            flush_thread_cache();
+            ptr = refill_tcache_bin(cache, bin);
+        }
+    } else {
+        ptr = arena_malloc<Lock, StatsPolicy>(cache.arena, size);
+    }
+    CallRecorder<StatsPolicy>::count_thread_malloc(heap, ptr);
+    return ptr;
+}
+
+// Allocate memory whose address is a multiple of alignment (a power of two)
+// The padding in front is split off as a free block, so freeing works as usual
+template <typename Lock, typename StatsPolicy>
+static void* heap_aligned_alloc(HeapState* heap, size_t alignment, size_t size) {
+    if (size == 0) {
+        return nullptr;
+    }
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        std::cerr << "ERROR: Alignment passed to my_aligned_alloc is not a power of two\n";
+        return nullptr;
+    }
+    
+    // Every block is already aligned this much
+    if (alignment <= ALIGN_SIZE) {
+        return heap_malloc<Lock, StatsPolicy>(heap, size);
+    }
+    
+    void* ptr = arena_malloc<Lock, StatsPolicy>(get_home_arena(heap), size, alignment);
+    CallRecorder<StatsPolicy>::count_thread_malloc(heap, ptr);
+    return ptr;
+}
+
+// Allocate zeroed memory
+// Cached and slab blocks were used before and are always cleared; a larger block
+// carved out of fresh OS memory is zero already, and clearing it would only fault
+// in every one of its pages
+// Only my_calloc uses it, on the default heap
+static void* heap_calloc(HeapState* heap, size_t size) {
+    if (size == 0) {
+        return nullptr;
+    }
+    if (heap->use_thread_cache && size <= TCACHE_MAX_SIZE) {
+        void* ptr = DefaultEngine::malloc(heap, size);
+        if (ptr) {
+            std::memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+    
+    bool zeroed = false;
+    void* ptr = arena_malloc<MutexLock, Stats>(get_home_arena(heap), size, 0, &zeroed);
+    CallRecorder<Stats>::count_thread_malloc(heap, ptr);
+    if (ptr && !zeroed) {
+        std::memset(ptr, 0, size);
+    }
+    return ptr;
+}
+    
+template <typename Lock, typename StatsPolicy>
+static void heap_free(HeapState* heap, void* ptr);
+
+// Resize an allocation, in place when possible
+// Shrinking splits off the tail and growing absorbs a free neighbour; only when
+// neither works is the data copied to a new block
+template <typename Lock, typename StatsPolicy>
+static void* heap_realloc(HeapState* heap, void* ptr, size_t size) {
+    if (!ptr) {
+        return heap_malloc<Lock, StatsPolicy>(heap, size);
+    }
+    if (size == 0) {
+        heap_free<Lock, StatsPolicy>(heap, ptr);
+        return nullptr;
+    }
+    
+    BlockHeader* block = BlockHeader::get_header(ptr);
+    if (!is_valid_ptr(heap, block) || !is_valid_ptr(heap, ptr)) {
+        std::cerr << "ERROR: Invalid pointer passed to my_realloc (not in heap)\n";
+        return nullptr;
+    }
+    
+    size_t usable_size;
+    if (is_slab_ptr(heap, ptr)) {
+        // Slots can't change size, but a smaller request still fits
+        SlabPage* page = get_slab_page(ptr);
+        if (!is_slab_slot(page, ptr)) {
+            std::cerr << "ERROR: Invalid pointer passed to my_realloc (not a slab slot)\n";
+            return nullptr;
+        }
+        usable_size = page->slot_size;
+        if (size <= usable_size) {
+            return ptr;
+        }
+    } else {
+        if (!block->is_intact()) {
+            report_heap_corruption("block header");
+        }
+        if (block->is_free()) {
+            std::cerr << "ERROR: my_realloc called on a freed block\n";
+            return nullptr;
+        }
+        
+        Arena* owner = get_arena(heap, ptr);
+        bool resized;
+        {
+            std::lock_guard<Lock> guard(owner->lock.get<Lock>());
+            resized = resize_block(owner, block, size);
+        }
+        if (resized) {
+            // The profiler's lock can't be taken under the arena's
+            if (block->is_sampled()) {
+                resize_sample(ptr, size);
+            }
+            return ptr;
+        }
+        usable_size = block->get_size() - BLOCK_OVERHEAD;
+    }
+    
+    // Move the data to a new block
+    void* new_ptr = heap_malloc<Lock, StatsPolicy>(heap, size);
+    if (!new_ptr) {
+        return nullptr;  // The old block is left untouched
+    }
+    std::memcpy(new_ptr, ptr, usable_size < size ? usable_size : size);
+    heap_free<Lock, StatsPolicy>(heap, ptr);
+    return new_ptr;
+}
+
+// Bytes the caller may use in an allocation of a heap (0 for anything that isn't one)
+static size_t heap_usable_size(const HeapState* heap, void* ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    
+    BlockHeader* block = BlockHeader::get_header(ptr);
+    if (!is_valid_ptr(heap, block) || !is_valid_ptr(heap, ptr)) {
+        return 0;
+    }
+    if (is_slab_ptr(heap, ptr)) {
+        SlabPage* page = get_slab_page(ptr);
+        return is_slab_slot(page, ptr) ? page->slot_size : 0;
+    }
+    return block->is_free() ? 0 : block->get_size() - BLOCK_OVERHEAD;
+}
+
+// Free memory of a heap
+template <typename Lock, typename StatsPolicy>
+static void heap_free(HeapState* heap, void* ptr) {
+    if (!ptr) {
+        return;  // Freeing nullptr is safe (like standard free)
+    }
+    
+    // Get block header
+    BlockHeader* block = BlockHeader::get_header(ptr);
+    
+    // Validate pointer
+    if (!is_valid_ptr(heap, block) || !is_valid_ptr(heap, ptr)) {
+        std::cerr << "ERROR: Invalid pointer passed to my_free (not in heap)\n";
+        return;
+    }
+    
+    // Find the usable size (slab slots have no header of their own)
+    size_t usable_size;
+    bool sampled = false;
+    if (is_slab_ptr(heap, ptr)) {
+        SlabPage* page = get_slab_page(ptr);
+        if (!is_slab_slot(page, ptr)) {
+            std::cerr << "ERROR: Invalid pointer passed to my_free (not a slab slot)\n";
+            return;
+        }
+        usable_size = page->slot_size;
+    } else {
+        // A header overwritten (say by an overflow of the block before it) fails its checksum
+        if (!block->is_intact()) {
+            report_heap_corruption("block header");
+        }
+        
+        // Check for double free
+        if (block->is_free()) {
+            std::cerr << "ERROR: Double free detected\n";
+            return;
+        }
+        usable_size = block->get_size() - BLOCK_OVERHEAD;
+        sampled = block->is_sampled();
+        if (sampled) {
+            drop_sample(ptr);
+        }
+    }
+    
+    // Fast path: park the block in this thread's cache without locking
+    // (not a block of another NUMA node: reusing it here would keep the memory remote)
+    if (heap->use_thread_cache && !thread_cache_destroyed && !sampled && usable_size >= TCACHE_GRANULARITY &&
+        usable_size <= TCACHE_MAX_SIZE && (heap->numa_nodes <= 1 || get_arena(heap, ptr)->numa_node == get_thread_cache().arena->numa_node)) {
+        ThreadCache& cache = get_thread_cache();
+        size_t bin = usable_size / TCACHE_GRANULARITY - 1;
+        void** links = cache_links(ptr);
+        
+        // A block tagged with this cache is probably already in it
+        if (links[1] == &cache) {
+            for (void* cached = cache.bins[bin]; cached; cached = load_link(cache_links(cached))) {
+                if (cached == ptr) {
+                    std::cerr << "ERROR: Double free detected\n";
+                    return;
+                }
+            }
+        }
+        
+        if (cache.counts[bin] >= TCACHE_BIN_CAPACITY) {
+            flush_tcache_bin(cache, bin, TCACHE_BATCH_SIZE);
+        }
+        
+        // Over budget: the block goes straight back to the backend below
+        if (cache.cached_bytes + get_tcache_bin_size(bin) <= TCACHE_MAX_BYTES) {
+            store_link(links, cache.bins[bin]);
+            links[1] = &cache;
+            cache.bins[bin] = ptr;
+            cache.counts[bin]++;
+            cache.cached_bytes += get_tcache_bin_size(bin);
+            CallRecorder<StatsPolicy>::count_cached(cache.calls.frees, usable_size);
+            return;
+        }
+    }
+    
+    // Large blocks go straight back to the arena that owns them, or are queued
+    // there if it belongs to another thread's arena
+    // Note: a double free of a queued block is not detected
+    // (and, in heaps without thread caches, it is counted when it is drained)
+    Arena* owner = get_arena(heap, ptr);
+    CallRecorder<StatsPolicy>::count_thread_free(heap, usable_size);
+    if (owner != get_home_arena(heap)) {
+        push_remote_free(owner, ptr);
+        return;
+    }
+    std::lock_guard<Lock> guard(owner->lock.get<Lock>());
+    CallRecorder<StatsPolicy>::count_arena_free(owner, usable_size);
+    backend_free(owner, ptr);
+}
+
+// Allocate count blocks of the same size with one lock and one free list search
+// (small sizes come from the slab layer); the blocks bypass the thread cache
+// Stores the pointers in out and returns how many were allocated
+template <typename Lock, typename StatsPolicy>
+static size_t heap_malloc_batch(HeapState* heap, size_t size, void** out, size_t count) {
+    if (size == 0 || count == 0) {
+        return 0;
+    }
+    
+    // At thread exit, once the thread's cache is gone, the blocks are allocated one by one
+    if (heap->use_thread_cache && thread_cache_destroyed) {
+        size_t done = 0;
+        while (done < count && (out[done] = heap_malloc<Lock, StatsPolicy>(heap, size)) != nullptr) {
+            done++;
+        }
+        return done;
+    }
+    
+    Arena* home = get_home_arena(heap);
+    size_t home_index = home - heap->arenas;
+    size_t done = 0;
+    
+    for (size_t i = 0; i < heap->arena_count && done < count; i++) {
+        Arena* arena = &heap->arenas[(home_index + i) % heap->arena_count];
+        std::lock_guard<Lock> guard(arena->lock.get<Lock>());
+        drain_remote_frees<StatsPolicy>(arena);
+        maybe_purge(arena);
+        
+        size_t first = done;
+        if (size <= SLAB_MAX_SIZE) {
+            while (done < count) {
+                void* slot = slab_malloc(arena, size);
+                if (!slot) {
+                    break;
+                }
+                out[done++] = slot;
+            }
+        }
+        done += allocate_block_batch(arena, size, out + done, count - done);
+        
+        for (size_t j = first; j < done; j++) {
+            CallRecorder<StatsPolicy>::count_arena_malloc(arena, out[j]);
+            CallRecorder<StatsPolicy>::count_thread_malloc(heap, out[j]);
+        }
+    }
+    
+    return done;
+}
+
+// Free many blocks of a heap at once
+// The pointers are sorted by address (ptrs is reordered), so each run of blocks that
+// sit next to each other in memory is freed as one block and coalesced only once
+// Blocks of other arenas are queued for their owners like any remote free
+template <typename Lock, typename StatsPolicy>
+static void heap_free_batch(HeapState* heap, void** ptrs, size_t count) {
+    std::sort(ptrs, ptrs + count, std::less<void*>());
+    
+    // At thread exit, once the thread's cache is gone, the blocks are freed one by one
+    // (duplicates are still caught, as they are next to each other now)
+    if (heap->use_thread_cache && thread_cache_destroyed) {
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0 && ptrs[i] && ptrs[i - 1] == ptrs[i]) {
+                std::cerr << "ERROR: Double free detected\n";
+                continue;
+            }
+            heap_free<Lock, StatsPolicy>(heap, ptrs[i]);
+        }
+        return;
+    }
+    
+    // Sampled blocks lose their records first: the profiler's lock can't be taken under an arena's
+    if (samples_recorded.load(std::memory_order_relaxed)) {
+        for (size_t i = 0; i < count; i++) {
+            void* ptr = ptrs[i];
+            if (ptr && is_valid_ptr(heap, BlockHeader::get_header(ptr)) && is_valid_ptr(heap, ptr) &&
+                !is_slab_ptr(heap, ptr) && BlockHeader::get_header(ptr)->is_sampled() &&
+                (i == 0 || ptrs[i - 1] != ptr)) {
+                drop_sample(ptr);
+            }
+        }
+    }
+    
+    // Only the calling thread's arena is locked (once, when it first owns a block)
+    Arena* home = get_home_arena(heap);
+    std::unique_lock<Lock> guard(home->lock.get<Lock>(), std::defer_lock);
+    BlockHeader* run = nullptr;     // First block of the current run
+    char* run_end = nullptr;
+    
+    for (size_t i = 0; i <= count; i++) {
+        void* ptr = (i < count) ? ptrs[i] : nullptr;
+        BlockHeader* block = nullptr;
+        
+        if (ptr) {
+            block = BlockHeader::get_header(ptr);
+            if (!is_valid_ptr(heap, block) || !is_valid_ptr(heap, ptr)) {
+                std::cerr << "ERROR: Invalid pointer passed to my_free_batch (not in heap)\n";
+                continue;
+            }
+            if (i > 0 && ptrs[i - 1] == ptr) {
+                std::cerr << "ERROR: Double free detected\n";
+                continue;
+            }
+        }
+        
+        // Extend the current run with a block that starts where it ends
+        if (run && block && reinterpret_cast<char*>(block) == run_end &&
+            get_region(heap, block) == get_region(heap, run) && !is_slab_ptr(heap, ptr) && !block->is_free()) {
+            CallRecorder<StatsPolicy>::count_arena_free(home, block->get_size() - BLOCK_OVERHEAD);
+            CallRecorder<StatsPolicy>::count_thread_free(heap, block->get_size() - BLOCK_OVERHEAD);
+            run_end += block->get_size();
+            home->used_block_count--;  // Merged into the run
+            continue;
+        }
+        
+        // Otherwise the run is complete: free it as one block
+        if (run) {
+            run->set_size(run_end - reinterpret_cast<char*>(run));
+            release_block(home, run);
+            run = nullptr;
+        }
+        if (!ptr) {
+            continue;
+        }
+        
+        // Blocks of other arenas are queued for their owner, as heap_free does:
+        // its lock is never taken, so a consumer thread never waits for a producer
+        Arena* owner = get_arena(heap, ptr);
+        if (owner != home) {
+            bool slab = is_slab_ptr(heap, ptr);
+            if (slab && !is_slab_slot(get_slab_page(ptr), ptr)) {
+                std::cerr << "ERROR: Invalid pointer passed to my_free_batch (not a slab slot)\n";
+            } else if (!slab && !block->is_intact()) {
+                report_heap_corruption("block header");
+            } else if (!slab && block->is_free()) {
+                std::cerr << "ERROR: Double free detected\n";
+            } else {
+                if (StatsPolicy::enabled) {
+                    CallRecorder<StatsPolicy>::count_thread_free(heap, heap_usable_size(heap, ptr));
+                }
+                push_remote_free(owner, ptr);  // Without thread caches, the owner counts it when draining
+            }
+            continue;
+        }
+        if (!guard.owns_lock()) {
+            guard.lock();
+        }
+        
+        if (StatsPolicy::enabled) {
+            size_t usable_size = heap_usable_size(heap, ptr);
+            CallRecorder<StatsPolicy>::count_arena_free(owner, usable_size);
+            CallRecorder<StatsPolicy>::count_thread_free(heap, usable_size);
+        }
+        if (is_slab_ptr(heap, ptr)) {
+            slab_free(owner, ptr);
+        } else if (!block->is_intact()) {
+            report_heap_corruption("block header");
+        } else if (block->is_free()) {
+            std::cerr << "ERROR: Double free detected\n";
+        } else {
+            run = block;
+            run_end = reinterpret_cast<char*>(block) + block->get_size();
+        }
+    }
+}
+
+// The heap operations compiled for each pair of policies
+
+template <typename Lock, typename StatsPolicy>
+void* HeapEngine<Lock, StatsPolicy>::malloc(HeapState* heap, size_t size) {
+    return heap_malloc<Lock, StatsPolicy>(heap, size);
+}
+
+template <typename Lock, typename StatsPolicy>
+void* HeapEngine<Lock, StatsPolicy>::aligned_alloc(HeapState* heap, size_t alignment, size_t size) {
+    return heap_aligned_alloc<Lock, StatsPolicy>(heap, alignment, size);
+}
+
+template <typename Lock, typename StatsPolicy>
+void* HeapEngine<Lock, StatsPolicy>::realloc(HeapState* heap, void* ptr, size_t size) {
+    return heap_realloc<Lock, StatsPolicy>(heap, ptr, size);
+}
+
+template <typename Lock, typename StatsPolicy>
+void HeapEngine<Lock, StatsPolicy>::free(HeapState* heap, void* ptr) {
+    heap_free<Lock, StatsPolicy>(heap, ptr);
+}
+
+template <typename Lock, typename StatsPolicy>
+size_t HeapEngine<Lock, StatsPolicy>::malloc_batch(HeapState* heap, size_t size, void** out, size_t count) {
+    return heap_malloc_batch<Lock, StatsPolicy>(heap, size, out, count);
+}
+
+template <typename Lock, typename StatsPolicy>
+void HeapEngine<Lock, StatsPolicy>::free_batch(HeapState* heap, void** ptrs, size_t count) {
+    heap_free_batch<Lock, StatsPolicy>(heap, ptrs, count);
+}
+
+template struct HeapEngine<NoLock, NoStats>;
+template struct HeapEngine<NoLock, Stats>;
+template struct HeapEngine<SpinLock, NoStats>;
+template struct HeapEngine<SpinLock, Stats>;
+template struct HeapEngine<MutexLock, NoStats>;
+template struct HeapEngine<MutexLock, Stats>;
+
+// One HeapEngine, for a Heap that chooses its policies when it is built
+struct HeapOps {
+    void* (*malloc)(HeapState* heap, size_t size);
+    void* (*aligned_alloc)(HeapState* heap, size_t alignment, size_t size);
+    void* (*realloc)(HeapState* heap, void* ptr, size_t size);
+    void (*free)(HeapState* heap, void* ptr);
+    size_t (*malloc_batch)(HeapState* heap, size_t size, void** out, size_t count);
+    void (*free_batch)(HeapState* heap, void** ptrs, size_t count);
+};
+
+template <typename Lock, typename StatsPolicy>
+struct EngineOps {
+    static const HeapOps ops;
+};
+
+template <typename Lock, typename StatsPolicy>
+const HeapOps EngineOps<Lock, StatsPolicy>::ops = {
+    &HeapEngine<Lock, StatsPolicy>::malloc,
+    &HeapEngine<Lock, StatsPolicy>::aligned_alloc,
+    &HeapEngine<Lock, StatsPolicy>::realloc,
+    &HeapEngine<Lock, StatsPolicy>::free,
+    &HeapEngine<Lock, StatsPolicy>::malloc_batch,
+    &HeapEngine<Lock, StatsPolicy>::free_batch
+};
+
+template <typename Lock>
+static const HeapOps* get_heap_ops(bool count_calls) {
+    return count_calls ? &EngineOps<Lock, Stats>::ops : &EngineOps<Lock, NoStats>::ops;
+}
+
+static const HeapOps* get_heap_ops(HeapLocking locking, bool count_calls) {
+    switch (locking) {
+        case HEAP_LOCK_NONE:
+            return get_heap_ops<NoLock>(count_calls);
+        case HEAP_LOCK_SPIN:
+            return get_heap_ops<SpinLock>(count_calls);
+        default:
+            return get_heap_ops<MutexLock>(count_calls);
+    }
+}
+
+// Allocation tracing
+
+// Events a thread collects before they are written to the trace file
+const size_t TRACE_BUFFER_EVENTS = 256;
+
+struct TraceBuffer {
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    size_t count;
+    unsigned session;       // Trace the events belong to
+    bool registered;        // Linked into trace_buffers
+    bool writing;           // Inside write_trace_buffer (the C library may allocate)
+    TraceBuffer* next;
+    
+    TraceBuffer() : count(0), session(0), registered(false), writing(false), next(nullptr) {}
+    ~TraceBuffer();
+};
+
+static std::atomic<bool> trace_enabled(false);
+static std::atomic<unsigned> trace_session(0);      // Bumped by start_trace()
+static std::atomic<unsigned> next_trace_thread(0);
+static std::chrono::steady_clock::time_point trace_start_time;
+
+// Protects the file and the list of thread buffers
+static std::mutex trace_lock;
+static std::FILE* trace_file = nullptr;
+static TraceBuffer* trace_buffers = nullptr;
+
+static thread_local TraceBuffer trace_buffer;
+
+// Number the calling thread writes to its events (-1 until the first one), and whether its
+// buffer was destroyed at thread exit: events of later calls (from other thread_local
+// destructors or atexit handlers) are then written to the file one at a time
+// Plain values with constant initializers, so they outlive the buffer
+static thread_local int trace_thread = -1;
+static thread_local bool trace_buffer_destroyed = false;
+static thread_local bool trace_writing_event = false;   // Inside write_trace_event
+
+// Append a buffer's events to the file and empty it (caller must hold trace_lock)
+static void write_trace_buffer(TraceBuffer& buffer) {
+    if (trace_file && buffer.session == trace_session.load(std::memory_order_relaxed) && buffer.count) {
+        buffer.writing = true;
+        std::fwrite(buffer.events, sizeof(TraceEvent), buffer.count, trace_file);
+        buffer.writing = false;
+    }
+    buffer.count = 0;
+}
+
+TraceBuffer::~TraceBuffer() {
+    if (registered) {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        write_trace_buffer(*this);
+        TraceBuffer** link = &trace_buffers;
+        while (*link != this) {
+            link = &(*link)->next;
+        }
+        *link = next;
+    }
+    trace_buffer_destroyed = true;
+}
+
+// Write one event of a thread whose buffer is gone straight to the file
+static void write_trace_event(const TraceEvent& event, unsigned session) {
+    if (trace_writing_event) {
+        return;  // The C library allocated inside fwrite
+    }
+    trace_writing_event = true;
+    {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        if (trace_file && session == trace_session.load(std::memory_order_relaxed)) {
+            std::fwrite(&event, sizeof(TraceEvent), 1, trace_file);
+        }
+    }
+    trace_writing_event = false;
+}
+
+// Record a call of the default heap
+// Frees are recorded before the call and allocations after it, so the event that
+// hands a block out again comes after the one that freed it (a moving realloc frees
+// inside the call, replay.cpp copes with the rare event that overtakes it)
+static void record_event(TraceOp op, const void* ptr, uint64_t arg, size_t size) {
+    unsigned session = trace_session.load(std::memory_order_acquire);
+    if (trace_thread < 0) {
+        trace_thread = static_cast<int>(next_trace_thread.fetch_add(1, std::memory_order_relaxed));
+    }
+    TraceEvent late_event;
+    TraceBuffer* buffer = nullptr;
+    if (!trace_buffer_destroyed) {
+        buffer = &trace_buffer;
+        if (buffer->writing) {
+            return;
+        }
+        if (buffer->session != session) {
+            // First event of this trace: drop leftovers of an older one
+            buffer->count = 0;
+            buffer->session = session;
+            if (!buffer->registered) {
+                std::lock_guard<std::mutex> guard(trace_lock);
+                buffer->next = trace_buffers;
+                trace_buffers = buffer;
+                buffer->registered = true;
+            }
+        }
+    }
+    
+    TraceEvent& event = buffer ? buffer->events[buffer->count++] : late_event;
+    event.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - trace_start_time).count();
+    event.ptr = reinterpret_cast<uintptr_t>(ptr);
+    event.arg = arg;
+    event.size = static_cast<uint32_t>(std::min<size_t>(size, UINT32_MAX));
+    event.thread = static_cast<uint16_t>(trace_thread);
+    event.op = static_cast<uint8_t>(op);
+    event.reserved = 0;
+    
+    if (!buffer) {
+        write_trace_event(event, session);
+    } else if (buffer->count == TRACE_BUFFER_EVENTS) {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        write_trace_buffer(*buffer);
+    }
+}
+
+static bool is_tracing() {
+    return trace_enabled.load(std::memory_order_acquire);
+}
+
+bool start_trace(const char* path) {
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (trace_file) {
+        std::cerr << "ERROR: A trace is already running\n";
+        return false;
+    }
+    
+    trace_file = std::fopen(path, "wb");
+    if (!trace_file) {
+        std::cerr << "ERROR: Could not create trace file " << path << "\n";
+        return false;
+    }
+    std::fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, trace_file);
+    
+    trace_start_time = std::chrono::steady_clock::now();
+    trace_session.fetch_add(1, std::memory_order_release);
+    trace_enabled.store(true, std::memory_order_release);
+    return true;
+}
+
+void stop_trace() {
+    std::lock_guard<std::mutex> guard(trace_lock);
+    if (!trace_file) {
+        return;
+    }
+    
+    trace_enabled.store(false, std::memory_order_release);
+    for (TraceBuffer* buffer = trace_buffers; buffer; buffer = buffer->next) {
+        write_trace_buffer(*buffer);
+    }
+    std::fclose(trace_file);
+    trace_file = nullptr;
+}
+
+// Heap profiles
+
+// The calling thread picks up the new interval at once, the others after their current gap
+void set_heap_sampling(size_t mean_bytes) {
+    sample_interval.store(mean_bytes, std::memory_order_relaxed);
+    bytes_until_sample = 0;
+}
+
+size_t get_heap_sampling() {
+    return sample_interval.load(std::memory_order_relaxed);
+}
+
+static bool live_bytes_greater(const SampleBucket& a, const SampleBucket& b) {
+    return a.alloc_bytes - a.free_bytes > b.alloc_bytes - b.free_bytes;
+}
+
+// One line per call stack: "live samples: live bytes [all samples: all bytes] @ addresses"
+void write_heap_profile(std::ostream& out) {
+    size_t remaining = bytes_until_sample;
+    bytes_until_sample = SIZE_MAX;
+    
+    // Copy the buckets, so nothing is written (and no memory allocated by the stream) under the lock
+    std::vector<SampleBucket> buckets;
+    {
+        std::lock_guard<std::mutex> guard(sample_lock);
+        for (size_t i = 0; i < SAMPLE_BUCKET_SLOTS; i++) {
+            for (SampleBucket* bucket = sample_buckets[i]; bucket; bucket = bucket->next) {
+                buckets.push_back(*bucket);
+            }
+        }
+    }
+    std::sort(buckets.begin(), buckets.end(), live_bytes_greater);
+    
+    SampleBucket total;
+    std::memset(&total, 0, sizeof(total));
+    for (size_t i = 0; i < buckets.size(); i++) {
+        total.allocs += buckets[i].allocs;
+        total.alloc_bytes += buckets[i].alloc_bytes;
+        total.frees += buckets[i].frees;
+        total.free_bytes += buckets[i].free_bytes;
+    }
+    
+    std::ios::fmtflags flags = out.flags();
+    out << std::dec << "heap profile: " << total.allocs - total.frees << ": " << total.alloc_bytes - total.free_bytes
+        << " [" << total.allocs << ": " << total.alloc_bytes << "] @ heap_v2/" << get_heap_sampling() << "\n";
+    for (size_t i = 0; i < buckets.size(); i++) {
+        const SampleBucket& bucket = buckets[i];
+        out << std::dec << bucket.allocs - bucket.frees << ": " << bucket.alloc_bytes - bucket.free_bytes
+            << " [" << bucket.allocs << ": " << bucket.alloc_bytes << "] @" << std::hex;
+        for (size_t j = 0; j < bucket.depth; j++) {
+            out << " 0x" << reinterpret_cast<uintptr_t>(bucket.frames[j]);
+        }
+        out << "\n";
+    }
+    
+#if defined(__linux__)
+    std::ifstream maps("/proc/self/maps");
+    if (maps) {
+        out << "\nMAPPED_LIBRARIES:\n" << maps.rdbuf();
+    }
+#endif
+    out.flags(flags);
+    bytes_until_sample = remaining;
+}
+
+// The C-style functions work on the default heap
+
+void* my_malloc(size_t size) {
+    ensure_default_heap();
+    void* ptr = should_sample(size) ? sampled_malloc(0, size, CALLER_ADDRESS()) : DefaultEngine::malloc(&default_heap, size);
+    if (is_tracing()) {
+        record_event(TRACE_MALLOC, ptr, 0, size);
+    }
+    return ptr;
+}
+
+void* my_aligned_alloc(size_t alignment, size_t size) {
+    ensure_default_heap();
+    bool valid = alignment != 0 && (alignment & (alignment - 1)) == 0;  // Otherwise heap_aligned_alloc reports it
+    void* ptr = valid && should_sample(size) ? sampled_malloc(alignment, size, CALLER_ADDRESS())
+                                             : DefaultEngine::aligned_alloc(&default_heap, alignment, size);
+    if (is_tracing()) {
+        record_event(TRACE_ALIGNED_ALLOC, ptr, alignment, size);
+    }
+    return ptr;
+}
+
+// Same as my_aligned_alloc (the traditional name)
+void* my_memalign(size_t alignment, size_t size) {
+    return my_aligned_alloc(alignment, size);
+}
+
+void* my_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        return nullptr;  // count * size doesn't fit in a size_t
+    }
+    ensure_default_heap();
+    
+    void* ptr;
+    if (should_sample(count * size)) {
+        ptr = sampled_malloc(0, count * size, CALLER_ADDRESS());
+        if (ptr) {
+            std::memset(ptr, 0, count * size);
+        }
+    } else {
+        ptr = heap_calloc(&default_heap, count * size);
+    }
+    if (is_tracing()) {
+        record_event(TRACE_MALLOC, ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+// A realloc picked by the sampler: the data moves to a sampled block, unless the
+// old block already fits (then it stays, with whatever sample it had)
+static void* sampled_realloc(void* ptr, size_t size, void* caller) {
+    size_t usable_size = heap_usable_size(&default_heap, ptr);
+    if (ptr && (usable_size == 0 || usable_size >= size)) {
+        return DefaultEngine::realloc(&default_heap, ptr, size);  // (which also reports a bad pointer)
+    }
+    
+    void* new_ptr = sampled_malloc(0, size, caller);
+    if (new_ptr && ptr) {
+        std::memcpy(new_ptr, ptr, usable_size);
+        DefaultEngine::free(&default_heap, ptr);
+    }
+    return new_ptr;
+}
+
+void* my_realloc(void* ptr, size_t size) {
+    ensure_default_heap();
+    void* new_ptr = size != 0 && should_sample(size) ? sampled_realloc(ptr, size, CALLER_ADDRESS())
+                                                    : DefaultEngine::realloc(&default_heap, ptr, size);
+    if (is_tracing()) {
+        record_event(TRACE_REALLOC, new_ptr, reinterpret_cast<uintptr_t>(ptr), size);
+    }
+    return new_ptr;
+}
+
+size_t my_malloc_usable_size(void* ptr) {
+    return heap_usable_size(&default_heap, ptr);
+}
+
+void my_free(void* ptr) {
+    if (ptr && is_tracing()) {
+        record_event(TRACE_FREE, ptr, 0, 0);
+    }
+    DefaultEngine::free(&default_heap, ptr);
+}
+
+size_t my_malloc_batch(size_t size, void** out, size_t count) {
+    ensure_default_heap();
+    size_t allocated = DefaultEngine::malloc_batch(&default_heap, size, out, count);
+    if (is_tracing()) {
+        for (size_t i = 0; i < allocated; i++) {
+            record_event(TRACE_MALLOC, out[i], 0, size);
+        }
+    }
+    return allocated;
+}
+
+void my_free_batch(void** ptrs, size_t count) {
+    if (is_tracing()) {
+        for (size_t i = 0; i < count; i++) {
+            if (ptrs[i]) {
+                record_event(TRACE_FREE, ptrs[i], 0, 0);
+            }
+        }
+    }
+    DefaultEngine::free_batch(&default_heap, ptrs, count);
+}
+
+// Give every block cached by the calling thread back to the shared heap
+void flush_thread_cache() {
+    if (thread_cache_destroyed) {
+        return;  // Already flushed when it was destroyed
+    }
+    ThreadCache& cache = get_thread_cache();
+    for (size_t i = 0; i < NUM_TCACHE_BINS; i++) {
+        flush_tcache_bin(cache, i, cache.counts[i]);
+    }
+}
+
+// Set how long free pages stay resident before automatic purging (0 = never)
+void set_purge_decay(unsigned milliseconds) {
+    purge_decay_ms.store(milliseconds, std::memory_order_relaxed);
+}
+
+// Turn deferred coalescing of a heap on or off; turning it off sweeps every arena
+static void set_heap_deferred_coalescing(HeapState* heap, bool enabled) {
+    heap->defer_coalescing.store(enabled, std::memory_order_relaxed);
+    if (!enabled) {
+        for (size_t i = 0; i < heap->arena_count; i++) {
+            std::lock_guard<ArenaLock> guard(heap->arenas[i].lock);
+            sweep_quick_lists(&heap->arenas[i]);
+        }
+    }
+}
+
+void set_deferred_coalescing(bool enabled) {
+    set_heap_deferred_coalescing(&default_heap, enabled);
+}
+
+bool get_deferred_coalescing() {
+    return default_heap.defer_coalescing.load(std::memory_order_relaxed);
+}
+
+// Release every whole page of every free block of the default heap to the OS
+size_t purge_free_memory() {
+    HeapState* heap = &default_heap;
+    size_t released = 0;
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        std::lock_guard<ArenaLock> guard(heap->arenas[i].lock);
+        settle_frees(&heap->arenas[i]);
+        released += purge_arena(&heap->arenas[i], false);
+    }
+    return released;
+}
+
+// Used memory of an arena in bytes (caller must hold the arena's lock)
+// Every byte of the regions is in a free block or an allocated one, so it follows from the totals
+static size_t compute_used_memory(Arena* arena) {
+    return arena->region_bytes - arena->free_list_bytes - arena->used_block_count * BLOCK_OVERHEAD;
+}
+
+// Free memory of an arena in bytes (caller must hold the arena's lock)
+static size_t compute_free_memory(Arena* arena) {
+    return arena->free_list_bytes - arena->free_block_count * BLOCK_OVERHEAD;
+}
+
+// Number of free blocks in an arena (caller must hold the arena's lock)
+static size_t compute_fragmentation_count(Arena* arena) {
+    return arena->free_block_count;
+}
+
+// Usable bytes of the biggest free block of an arena (caller must hold the arena's lock)
+// Only the highest non-empty list can hold it, so only that list is searched
+static size_t compute_largest_free_block(Arena* arena) {
+    if (!arena->free_list_bitmap) {
+        return 0;
+    }
+    size_t size_class = floor_log2(arena->free_list_bitmap);
+    size_t subdivision = floor_log2(arena->sub_list_bitmaps[size_class]);
+    
+    // A best-fit tree keeps its largest block rightmost; any other list holds blocks
+    // of up to twice each other's size in no order, so it is walked
+    BlockHeader* block = arena->free_lists[size_class][subdivision];
+    size_t largest = block->get_size();
+    if (arena->heap->engine == ENGINE_BEST_FIT) {
+        while (block->right()) {
+            block = block->right();
+        }
+        largest = block->get_size();
+    } else {
+        for (block = block->next(); block; block = block->next()) {
+            largest = std::max(largest, block->get_size());
+        }
+    }
+    return largest - BLOCK_OVERHEAD;
+}
+
+// Usable bytes freed into an arena but not yet taken back: parked on its quick lists or
+// queued by other threads (caller must hold the arena's lock)
+// Both still count as allocated blocks in the totals
+static size_t compute_pending_free_memory(Arena* arena) {
+    return arena->quick_list_bytes - arena->quick_list_count * BLOCK_OVERHEAD +
+           arena->remote_free_bytes.load(std::memory_order_relaxed);
+}
+
+// Statistics read the running totals as they are: queued and parked frees are left alone
+// and reported as pending, so reading them never changes the heap
+
+// Used memory of a heap in bytes (all arenas)
+// Blocks parked in thread caches count as used, pending frees do not
+static size_t heap_used_memory(HeapState* heap) {
+    size_t used = 0;
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        std::lock_guard<ArenaLock> guard(heap->arenas[i].lock);
+        used += compute_used_memory(&heap->arenas[i]) - compute_pending_free_memory(&heap->arenas[i]);
+    }
+    return used;
+}
+
+// Free memory of a heap in bytes (all arenas)
+static size_t heap_free_memory(HeapState* heap) {
+    size_t free = 0;
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        std::lock_guard<ArenaLock> guard(heap->arenas[i].lock);
+        free += compute_free_memory(&heap->arenas[i]);
+    }
+    return free;
+}
+
+// Number of free blocks in all arenas of a heap
+static size_t heap_fragmentation_count(HeapState* heap) {
+    size_t count = 0;
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        std::lock_guard<ArenaLock> guard(heap->arenas[i].lock);
+        count += compute_fragmentation_count(&heap->arenas[i]);
+    }
+    return count;
+}
+
+// Bytes of a heap's space currently given to regions
+static size_t heap_size(HeapState* heap) {
+    std::lock_guard<std::mutex> guard(heap->region_lock);
+    return heap->top - heap->base;
+}
+
+// Snapshot of every statistic of a heap
+// Takes each arena's lock once; the default heap also adds up the calls counted by each thread
+static HeapStats heap_stats(HeapState* heap) {
+    HeapStats stats;
+    std::memset(&stats, 0, sizeof(stats));
+    CallCounts calls;
+    reset_call_counts(calls);
+    
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        Arena* arena = &heap->arenas[i];
+        std::lock_guard<ArenaLock> guard(arena->lock);
+        size_t pending = compute_pending_free_memory(arena);
+        stats.used_memory += compute_used_memory(arena) - pending;
+        stats.free_memory += compute_free_memory(arena);
+        stats.pending_free_memory += pending;
+        stats.free_block_count += compute_fragmentation_count(arena);
+        stats.largest_free_block = std::max(stats.largest_free_block, compute_largest_free_block(arena));
+        if (!heap->use_thread_cache) {
+            add_call_counts(calls, arena->calls);
+        }
+    }
+    
+    if (heap->use_thread_cache) {
+        std::lock_guard<std::mutex> guard(cache_list_lock);
+        add_call_counts(calls, exited_thread_calls);
+        unsigned generation = heap_generation.load(std::memory_order_relaxed);
+        for (ThreadCache* cache = thread_caches; cache; cache = cache->next) {
+            if (cache->calls_generation.load(std::memory_order_relaxed) == generation) {
+                add_call_counts(calls, cache->calls);
+            }
+        }
+    }
+    
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        stats.malloc_counts[i] = calls.mallocs[i].load(std::memory_order_relaxed);
+        stats.free_counts[i] = calls.frees[i].load(std::memory_order_relaxed);
+    }
+    stats.heap_size = heap_size(heap);
+    return stats;
+}
+
+size_t get_used_memory() {
+    return heap_used_memory(&default_heap);
+}
+
+size_t get_free_memory() {
+    return heap_free_memory(&default_heap);
+}
+
+size_t get_fragmentation_count() {
+    return heap_fragmentation_count(&default_heap);
+}
+
+// Get the number of bytes committed from the OS
+size_t get_heap_size() {
+    return heap_size(&default_heap);
+}
+
+HeapStats get_heap_stats() {
+    return heap_stats(&default_heap);
+}
+
+// Get the number of arenas the heap is split into
+size_t get_arena_count() {
+    return default_heap.arena_count;
+}
+
+// Get the index of the arena that owns a heap pointer
+size_t get_arena_index(void* ptr) {
+    return get_arena(&default_heap, ptr) - default_heap.arenas;
+}
+
+size_t get_numa_node_count() {
+    return default_heap.numa_nodes;
+}
+
+size_t get_arena_numa_node(size_t arena) {
+    return default_heap.arenas[arena].numa_node;
+}
+
+// Print the blocks and free lists of one arena (caller must hold the arena's lock)
+// Where a used block that is really a pending free waits: 'd' parked in a quick list
+// (deferred coalescing), 'r' queued by a thread of another arena, 0 if it is in use
+// Caller must hold the arena's lock; the lists are only read, never settled
+static char get_pending_kind(Arena* arena, BlockHeader* block) {
+    size_t list = block->get_size() / ALIGN_SIZE;
+    if (list < NUM_QUICK_LISTS && parked_tag(block) == arena) {
+        for (BlockHeader* parked = arena->quick_lists[list]; parked; parked = parked->next()) {
+            if (parked == block) {
+                return 'd';
+            }
+        }
+    }
+    for (void* ptr = arena->remote_frees.load(std::memory_order_acquire); ptr; ptr = load_link(static_cast<void**>(ptr))) {
+        if (ptr == block->get_data()) {
+            return 'r';
+        }
+    }
+    return 0;
+}
+
+// Caller must hold the arena's lock
+static void print_arena_state(Arena* arena) {
+    std::cout << "\nBlock Layout:\n";
+    std::cout << std::left << std::setw(12) << "Address" 
+              << std::setw(12) << "Size" 
+              << std::setw(12) << "User Size"
+              << std::setw(10) << "Status"
+              << "\n";
+    std::cout << std::string(50, '-') << "\n";
+    
+    for (Region* region = arena->regions; region; region = region->next) {
+        std::cout << "Region " << std::hex << reinterpret_cast<void*>(region) << std::dec
+                  << " (" << (region->end - reinterpret_cast<char*>(region)) << " bytes)\n";
+        
+        char* current = region->blocks_start;
+        
+        while (current < region->end) {
+            BlockHeader* block = reinterpret_cast<BlockHeader*>(current);
+            size_t user_size = block->get_size() - BLOCK_OVERHEAD;
+            bool is_slab = is_slab_ptr(arena->heap, block->get_data());
+            const char* status = "FREE";
+            if (!block->is_free() && is_slab) {
+                status = "SLAB";
+            } else if (!block->is_free()) {
+                char pending = get_pending_kind(arena, block);
+                status = pending == 'd' ? "PARKED" : (pending == 'r' ? "QUEUED" : "USED");
+            }
+            
+            std::cout << std::hex << std::setw(12) << reinterpret_cast<void*>(current)
+                      << std::dec << std::setw(12) << block->get_size()
+                      << std::setw(12) << user_size
+                      << std::setw(10) << status
+                      << "\n";
+            
+            current += block->get_size();
+            
+            // Safety check to prevent infinite loop
+            if (block->get_size() == 0) {
+                std::cerr << "ERROR: Corrupted heap or infinite loop detected\n";
+                break;
+            }
+        }
+    }
+    
+    std::cout << "\nFree Lists:\n";
+    size_t free_num = 0;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        for (size_t j = 0; j < TLSF_SL_COUNT; j++) {
+            if (!arena->free_lists[i][j]) {
+                continue;
+            }
+            
+            size_t class_min = static_cast<size_t>(1) << i;
+            std::cout << "  Size class " << i;
+            if (arena->heap->engine == ENGINE_TLSF) {
+                std::cout << "." << j;
+                class_min += j * (class_min >> TLSF_SL_LOG2);
+            }
+            std::cout << " (" << class_min << "+ bytes):\n";
+            BlockHeader* free_block = first_free_block(arena, i, j);
+            while (free_block) {
+                std::cout << "    [" << free_num << "] " 
+                          << std::hex << reinterpret_cast<void*>(free_block)
+                          << std::dec << " -> size: " << free_block->get_size() << " bytes\n";
+                free_block = next_free_block(arena, free_block);
+                free_num++;
+            }
+        }
+    }
+    
+    if (free_num == 0) {
+        std::cout << "  (empty)\n";
+    }
+}
+
+// Name of an engine, for people or (with json set) for the layout export
+static const char* engine_name(AllocatorEngine engine, bool json) {
+    if (engine == ENGINE_TLSF) {
+        return json ? "tlsf" : "TLSF";
+    }
+    if (engine == ENGINE_BEST_FIT) {
+        return json ? "best_fit" : "Best fit";
+    }
+    return json ? "segregated_fit" : "Segregated fit";
+}
+
+// Print the state of a heap for debugging
+// Pending frees are shown where they wait (PARKED or QUEUED blocks), not processed
+static void print_heap(HeapState* heap) {
+    // Lock every arena (always in index order) for a consistent picture
+    std::unique_lock<ArenaLock> guards[MAX_ARENAS];
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        guards[i] = std::unique_lock<ArenaLock>(heap->arenas[i].lock);
+    }
+    
+    size_t used = 0;
+    size_t pending = 0;
+    size_t free = 0;
+    size_t fragments = 0;
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        size_t arena_pending = compute_pending_free_memory(&heap->arenas[i]);
+        used += compute_used_memory(&heap->arenas[i]) - arena_pending;
+        pending += arena_pending;
+        free += compute_free_memory(&heap->arenas[i]);
+        fragments += compute_fragmentation_count(&heap->arenas[i]);
+    }
+    
+    std::cout << "\n=== Heap State ===\n";
+    std::cout << "Engine: " << engine_name(heap->engine, false) << "\n";
+    if (heap->huge_pages != HUGE_PAGES_NONE) {
+        std::cout << "Pages: " << (heap->huge_pages == HUGE_PAGES_EXPLICIT ? "reserved" : "transparent")
+                  << " huge pages\n";
+    }
+    size_t size = heap_size(heap);
+    std::cout << "Heap Size: " << size << " bytes (" << (size / 1024.0) << " KB)\n";
+    std::cout << "Arenas: " << heap->arena_count << "\n";
+    if (heap->numa_nodes > 1) {
+        std::cout << "NUMA nodes: " << heap->numa_nodes << "\n";
+    }
+    std::cout << "Used Memory: " << used << " bytes\n";
+    if (pending) {
+        std::cout << "Pending Frees: " << pending << " bytes\n";
+    }
+    std::cout << "Free Memory: " << free << " bytes\n";
+    std::cout << "Fragmentation: " << fragments << " free blocks\n";
+    
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        if (heap->arena_count > 1) {
+            std::cout << "\n--- Arena " << i;
+            if (heap->numa_nodes > 1) {
+                std::cout << " (node " << heap->arenas[i].numa_node << ")";
+            }
+            std::cout << " ---\n";
+        }
+        print_arena_state(&heap->arenas[i]);
+    }
+    
+    std::cout << "\n";
+}
+
+// Print heap state for debugging
+void print_heap_state() {
+    print_heap(&default_heap);
+}
+
+// Heap layout export
+
+// One block of a region, copied out under the arena's lock
+struct LayoutRecord {
+    size_t offset;          // From the start of the region
+    size_t size;            // Total size of the block
+    char kind;              // 'u' used, 'f' free, 's' slab page, 'd' parked or 'r' queued (see get_pending_kind)
+    size_t slot_size;       // Slab pages only
+    size_t used_slots;      // Queued slots included
+    size_t queued_slots;
+};
+
+// Free blocks seen so far, for the fragmentation metrics
+struct FreeBlockTotals {
+    size_t bytes;
+    size_t blocks;
+    size_t largest;
+    size_t histogram_blocks[NUM_SIZE_CLASSES];  // By floor(log2(usable size))
+    size_t histogram_bytes[NUM_SIZE_CLASSES];
+};
+
+// Copy the blocks of a region (caller must hold the arena's lock)
+static size_t copy_region_layout(Arena* arena, Region* region, std::vector<LayoutRecord>& records) {
+    size_t count = 0;
+    char* current = region->blocks_start;
+    while (current < region->end && count < records.size()) {
+        BlockHeader* block = reinterpret_cast<BlockHeader*>(current);
+        LayoutRecord& record = records[count++];
+        record.offset = current - reinterpret_cast<char*>(region);
+        record.size = block->get_size();
+        record.kind = block->is_free() ? 'f' : 'u';
+        record.slot_size = 0;
+        record.used_slots = 0;
+        record.queued_slots = 0;
+        if (!block->is_free() && is_slab_ptr(arena->heap, block->get_data())) {
+            SlabPage* page = static_cast<SlabPage*>(block->get_data());
+            record.kind = 's';
+            record.slot_size = page->slot_size;
+            record.used_slots = page->used_count;
+        }
+        
+        if (block->get_size() == 0) {
+            std::cerr << "ERROR: Corrupted heap or infinite loop detected\n";
+            break;
+        }
+        current += block->get_size();
+    }
+    return count;
+}
+
+static bool offset_before_record(size_t offset, const LayoutRecord& record) {
+    return offset < record.offset;
+}
+
+// Copied block of a region holding the given address (nullptr past the copied ones)
+static LayoutRecord* find_record(Region* region, std::vector<LayoutRecord>& records, size_t count, const void* address) {
+    size_t offset = static_cast<const char*>(address) - reinterpret_cast<char*>(region);
+    LayoutRecord* after = std::upper_bound(records.data(), records.data() + count, offset, offset_before_record);
+    if (after == records.data() || offset >= (after - 1)->offset + (after - 1)->size) {
+        return nullptr;
+    }
+    return after - 1;
+}
+
+// Mark the copied blocks of a region that are pending frees as parked or queued, and
+// count the queued slots of its slab pages (caller must hold the arena's lock)
+// The quick lists and the remote-free stack are only read, so the snapshot shows
+// the heap as it is instead of settling it
+static void mark_pending_frees(Arena* arena, Region* region, std::vector<LayoutRecord>& records, size_t count) {
+    for (size_t i = 0; i < NUM_QUICK_LISTS; i++) {
+        for (BlockHeader* parked = arena->quick_lists[i]; parked; parked = parked->next()) {
+            LayoutRecord* record = get_region(arena->heap, parked) == region ? find_record(region, records, count, parked) : nullptr;
+            if (record) {
+                record->kind = 'd';
+            }
+        }
+    }
+    for (void* ptr = arena->remote_frees.load(std::memory_order_acquire); ptr; ptr = load_link(static_cast<void**>(ptr))) {
+        LayoutRecord* record = get_region(arena->heap, ptr) == region ? find_record(region, records, count, ptr) : nullptr;
+        if (record && record->kind == 's') {
+            record->queued_slots++;
+        } else if (record) {
+            record->kind = 'r';
+        }
+    }
+}
+
+// Stream one arena: its regions' blocks, then the lengths of its free lists
+// The lock is held only while one region is copied, so other threads keep going
+// between regions (each region is consistent, the arena as a whole may not be)
+static void export_arena_json(Arena* arena, size_t index, std::ostream& out, FreeBlockTotals& totals) {
+    size_t list_blocks[NUM_SIZE_CLASSES][TLSF_SL_COUNT] = {};
+    size_t list_bytes[NUM_SIZE_CLASSES][TLSF_SL_COUNT] = {};
+    std::vector<LayoutRecord> records;
+    
+    Region* region;
+    {
+        std::lock_guard<ArenaLock> guard(arena->lock);
+        region = arena->regions;
+    }
+    
+    out << "{\"index\":" << index << ",\"regions\":[";
+    for (bool first = true; region; first = false) {
+        // Regions never change size, so the buffer can be sized (and allocated) before locking
+        size_t capacity = (region->end - region->blocks_start) / get_min_block_size() + 1;
+        if (records.size() < capacity) {
+            records.resize(capacity);
+        }
+        
+        size_t count;
+        Region* next;
+        {
+            std::lock_guard<ArenaLock> guard(arena->lock);
+            count = copy_region_layout(arena, region, records);
+            mark_pending_frees(arena, region, records, count);
+            next = region->next;
+        }
+        
+        out << (first ? "" : ",") << "{\"address\":\"" << static_cast<void*>(region) << "\",\"size\":"
+            << (region->end - reinterpret_cast<char*>(region)) << ",\"blocks\":[";
+        for (size_t i = 0; i < count; i++) {
+            const LayoutRecord& record = records[i];
+            out << (i ? "," : "") << "[" << record.offset << "," << record.size << ",\"" << record.kind << "\"";
+            if (record.kind == 's') {
+                out << "," << record.slot_size << "," << record.used_slots << "," << record.queued_slots;
+            }
+            out << "]";
+            
+            if (record.kind == 'f') {
+                size_t usable = record.size - BLOCK_OVERHEAD;
+                FreeListIndex list = get_free_list_index(arena, record.size);
+                list_blocks[list.size_class][list.subdivision]++;
+                list_bytes[list.size_class][list.subdivision] += usable;
+                totals.bytes += usable;
+                totals.blocks++;
+                totals.largest = std::max(totals.largest, usable);
+                totals.histogram_blocks[floor_log2(usable)]++;
+                totals.histogram_bytes[floor_log2(usable)] += usable;
+            }
+        }
+        out << "]}";
+        region = next;
+    }
+    
+    out << "],\"free_lists\":[";
+    bool first = true;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        for (size_t j = 0; j < TLSF_SL_COUNT; j++) {
+            if (list_blocks[i][j]) {
+                out << (first ? "" : ",") << "{\"class\":" << i << ",\"subdivision\":" << j
+                    << ",\"blocks\":" << list_blocks[i][j] << ",\"bytes\":" << list_bytes[i][j] << "}";
+                first = false;
+            }
+        }
+    }
+    out << "]}";
+}
+
+// Write the layout of a heap as one JSON object
+static void export_heap(HeapState* heap, std::ostream& out) {
+    std::ios::fmtflags flags = out.flags();
+    out << std::dec;
+    
+    FreeBlockTotals totals;
+    std::memset(&totals, 0, sizeof(totals));
+    
+    out << "{\"engine\":\"" << engine_name(heap->engine, true) << "\""
+        << ",\"heap_size\":" << heap_size(heap) << ",\"block_header\":" << BLOCK_OVERHEAD << ",\"arenas\":[";
+    for (size_t i = 0; i < heap->arena_count; i++) {
+        out << (i ? "," : "");
+        export_arena_json(&heap->arenas[i], i, out, totals);
+    }
+    out << "]";
+    
+    // External fragmentation: how much of the free memory can't serve one big request
+    double largest_ratio = totals.bytes ? static_cast<double>(totals.largest) / totals.bytes : 1.0;
+    out << ",\"fragmentation\":{\"free_bytes\":" << totals.bytes << ",\"free_blocks\":" << totals.blocks
+        << ",\"largest_free_block\":" << totals.largest << ",\"largest_free_ratio\":" << largest_ratio
+        << ",\"external_fragmentation\":" << 1.0 - largest_ratio << "}";
+    
+    out << ",\"free_block_histogram\":[";
+    bool first = true;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        if (totals.histogram_blocks[i]) {
+            out << (first ? "" : ",") << "{\"min_size\":" << (static_cast<size_t>(1) << i) << ",\"blocks\":"
+                << totals.histogram_blocks[i] << ",\"bytes\":" << totals.histogram_bytes[i] << "}";
+            first = false;
+        }
+    }
+    out << "]}\n";
+    
+    out.flags(flags);
+}
+
+void export_heap_json(std::ostream& out) {
+    export_heap(&default_heap, out);
+}
+
+// Heap objects
+
+Heap::Heap(void* memory, size_t size, AllocatorEngine engine, size_t arena_count,
+           HeapLocking locking, bool count_calls)
+    : state(create_heap(memory, size, engine, arena_count, locking, count_calls)) {
+    if (!state) {
+        std::cerr << "ERROR: Memory given to Heap is too small for its bookkeeping\n";
+    }
+}
+
+Heap::Heap(HeapState* state) : state(state) {}
+
+Heap::~Heap() {
+    // The default heap outlives every Heap object that refers to it
+    if (!state || state == &default_heap) {
+        return;
+    }
+    for (size_t i = 0; i < state->arena_count; i++) {
+        state->arenas[i].~Arena();
+    }
+    state->~HeapState();
+}
+
+void* Heap::malloc(size_t size) {
+    return state ? state->ops->malloc(state, size) : nullptr;
+}
+
+void* Heap::aligned_alloc(size_t alignment, size_t size) {
+    return state ? state->ops->aligned_alloc(state, alignment, size) : nullptr;
+}
+
+void* Heap::realloc(void* ptr, size_t size) {
+    return state ? state->ops->realloc(state, ptr, size) : nullptr;
+}
+
+void Heap::free(void* ptr) {
+    if (state) {
+        state->ops->free(state, ptr);
+    }
+}
+
+size_t Heap::usable_size(void* ptr) const {
+    return state ? heap_usable_size(state, ptr) : 0;
+}
+
+size_t Heap::malloc_batch(size_t size, void** out, size_t count) {
+    return state ? state->ops->malloc_batch(state, size, out, count) : 0;
+}
+
+void Heap::free_batch(void** ptrs, size_t count) {
+    if (state) {
+        state->ops->free_batch(state, ptrs, count);
+    }
+}
+
+bool Heap::contains(const void* ptr) const {
+    return state && is_valid_ptr(state, ptr);
+}
+
+void Heap::set_deferred_coalescing(bool enabled) {
+    if (state) {
+        set_heap_deferred_coalescing(state, enabled);
+    }
+}
+
+size_t Heap::get_used_memory() {
+    return state ? heap_used_memory(state) : 0;
+}
+
+size_t Heap::get_free_memory() {
+    return state ? heap_free_memory(state) : 0;
+}
+
+size_t Heap::get_fragmentation_count() {
+    return state ? heap_fragmentation_count(state) : 0;
+}
+
+size_t Heap::get_heap_size() {
+    return state ? heap_size(state) : 0;
+}
+
+HeapStats Heap::get_stats() {
+    HeapStats stats;
+    if (state) {
+        return heap_stats(state);
+    }
+    std::memset(&stats, 0, sizeof(stats));
+    return stats;
+}
+
+size_t Heap::get_arena_count() const {
+    return state ? state->arena_count : 0;
+}
+
+void Heap::print_state() {
+    if (state) {
+        print_heap(state);
+    }
+}
+
+void Heap::export_json(std::ostream& out) {
+    if (state) {
+        export_heap(state, out);
+    }
+}
+
+// The default heap as a Heap object
+Heap& get_default_heap() {
+    ensure_default_heap();
+    static Heap heap(&default_heap);
+    return heap;
+}
+
+// Monotonic heaps
+
+// Chunk of a MonotonicHeap, taken from its heap with one malloc; the data follows it
+struct MonotonicChunk {
+    MonotonicChunk* next;
+    char* end;
+};
+
+MonotonicHeap::MonotonicHeap(Heap& heap, size_t chunk_size)
+    : heap(&heap), chunk_size(chunk_size), first(nullptr), current(nullptr), top(nullptr) {}
+
+MonotonicHeap::~MonotonicHeap() {
+    release();
+}
+
+void* MonotonicHeap::malloc(size_t size) {
+    return aligned_alloc(ALIGN_SIZE, size);
+}
+
+// Allocate by bumping top; only a full chunk leads back to the heap
+void* MonotonicHeap::aligned_alloc(size_t alignment, size_t size) {
+    if (size == 0) {
+        return nullptr;
+    }
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        std::cerr << "ERROR: Alignment passed to MonotonicHeap::aligned_alloc is not a power of two\n";
+        return nullptr;
+    }
+    
+    if (current) {
+        char* ptr = align_pointer(top, alignment);
+        if (ptr <= current->end && size <= static_cast<size_t>(current->end - ptr)) {
+            top = ptr + size;
+            return ptr;
+        }
+    }
+    return allocate_from_next_chunk(alignment, size);
+}
+
+// Move on to the next chunk, taking a new one from the heap if there is none
+// left over from before a reset (or it is too small for this request)
+void* MonotonicHeap::allocate_from_next_chunk(size_t alignment, size_t size) {
+    MonotonicChunk* next = current ? current->next : first;
+    
+    if (next) {
+        char* ptr = align_pointer(reinterpret_cast<char*>(next + 1), alignment);
+        if (ptr <= next->end && size <= static_cast<size_t>(next->end - ptr)) {
+            current = next;
+            top = ptr + size;
+            return ptr;
+        }
+    }
+    
+    size_t overhead = sizeof(MonotonicChunk) + alignment;
+    if (size > static_cast<size_t>(-1) - overhead) {
+        return nullptr;
+    }
+    size_t bytes = size + overhead > chunk_size ? size + overhead : chunk_size;
+    MonotonicChunk* chunk = static_cast<MonotonicChunk*>(heap->malloc(bytes));
+    if (!chunk) {
+        return nullptr;
+    }
+    
+    // Link it in after the current chunk, ahead of any left-over ones
+    chunk->end = reinterpret_cast<char*>(chunk) + bytes;
+    chunk->next = next;
+    if (current) {
+        current->next = chunk;
+    } else {
+        first = chunk;
+    }
+    current = chunk;
+    
+    char* ptr = align_pointer(reinterpret_cast<char*>(chunk + 1), alignment);
+    top = ptr + size;
+    return ptr;
+}
+
+MonotonicHeap::Marker MonotonicHeap::get_marker() const {
+    Marker marker;
+    marker.chunk = current;
+    marker.top = top;
+    return marker;
+}
+
+// Drop everything allocated since the marker was taken (O(1))
+void MonotonicHeap::rewind(Marker marker) {
+    current = marker.chunk;
+    top = marker.top;
+}
+
+// Drop everything (O(1)); the chunks are reused from the first one on
+void MonotonicHeap::reset() {
+    current = nullptr;
+    top = nullptr;
+}
+
+void MonotonicHeap::release() {
+    while (first) {
+        MonotonicChunk* next = first->next;
+        heap->free(first);
+        first = next;
+    }
+    reset();
+}
+
+size_t MonotonicHeap::get_reserved_memory() const {
+    size_t reserved = 0;
+    for (MonotonicChunk* chunk = first; chunk; chunk = chunk->next) {
+        reserved += chunk->end - reinterpret_cast<char*>(chunk);
+    }
+    return reserved;
+}
@@ -1,42 +1,824 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
 
-// Alignment requirement (8 bytes)
-const size_t ALIGN_SIZE = 8;
+// std::pmr needs C++17 and a standard library that ships <memory_resource>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define ALLOCATOR_HAS_PMR 1
+#endif
+#endif
+#endif
 
-// Heap size (1MB)
-const size_t HEAP_SIZE = 1024 * 1024;
+// Alignment requirement (8 bytes by default)
+// Build with -DALLOCATOR_ALIGNMENT=16 where malloc-compatible alignment is needed
+// (malloc_override.cpp requires it)
+#ifndef ALLOCATOR_ALIGNMENT
+#define ALLOCATOR_ALIGNMENT 8
+#endif
+const size_t ALIGN_SIZE = ALLOCATOR_ALIGNMENT;
+
+// Hardened build (-DALLOCATOR_HARDENED): free list links are stored mangled (safe-linking)
+// and every block header carries a checksum that is verified when the block is freed.
+// A detected corruption is reported and the program is aborted
+#if defined(ALLOCATOR_HARDENED)
+static_assert(sizeof(size_t) == 8, "The hardened build keeps a checksum in the top bits of 64-bit headers");
+#endif
+[[noreturn]] void report_heap_corruption(const char* what);  // Used by the checks (including the inline ones below)
+
+// The heap grows in regions requested from the OS (mmap / VirtualAlloc)
+// Each region is a multiple of REGION_SIZE; together they can use up to
+// HEAP_RESERVE_SIZE bytes of address space, reserved when the heap is first set up
+const size_t REGION_SIZE = 1024 * 1024;
+const size_t HEAP_RESERVE_SIZE = (sizeof(void*) >= 8 ? 1024 : 256) * REGION_SIZE;
+
+// Size of a huge page (x86-64 and most ARM64 systems)
+// With huge pages on, regions are multiples of it and start on its boundary
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Number of segregated free lists (one per power-of-two size class)
+// Size class i holds free blocks whose total size is in [2^i, 2^(i+1))
+const size_t NUM_SIZE_CLASSES = sizeof(size_t) * 8;
+
+// Slab front-end: requests of up to SLAB_MAX_SIZE bytes are served from fixed-size
+// slots carved out of SLAB_PAGE_SIZE pages, with no per-object header
+const size_t SLAB_PAGE_SIZE = 4096;
+const size_t SLAB_SLOT_GRANULARITY = 16;
+const size_t SLAB_MAX_SIZE = 256;
+const size_t NUM_SLAB_CLASSES = SLAB_MAX_SIZE / SLAB_SLOT_GRANULARITY;
+
+// Thread caches: every thread keeps recently freed blocks of up to TCACHE_MAX_SIZE
+// bytes in per-size bins, so most my_malloc/my_free calls never take the heap lock
+const size_t TCACHE_MAX_SIZE = 1024;
+const size_t TCACHE_GRANULARITY = 16;
+const size_t NUM_TCACHE_BINS = TCACHE_MAX_SIZE / TCACHE_GRANULARITY;
+const size_t TCACHE_BIN_CAPACITY = 16;      // Blocks a bin holds before half of it is flushed
+const size_t TCACHE_BATCH_SIZE = 8;         // Blocks moved per refill or flush
+const size_t TCACHE_MAX_BYTES = 32 * 1024;  // Upper bound on the bytes one thread keeps cached
+
+// Deferred coalescing (see set_deferred_coalescing): freed general-purpose blocks of up to
+// QUICK_LIST_MAX_SIZE usable bytes wait unmerged in per-arena quick lists, one per block size
+const size_t QUICK_LIST_MAX_SIZE = 1024;
+const size_t QUICK_LIST_MAX_BYTES = 64 * 1024;  // Bytes an arena's quick lists hold before they are swept
+
+// Arenas: the heap can be split into up to MAX_ARENAS independent sub-heaps, each
+// with its own regions, free lists, slab pages and lock. Threads are spread over them round-robin.
+// On a NUMA machine with at least one arena per node, arena i keeps its memory on the
+// (i % nodes)th online node and threads use the arenas of the node they run on (see get_numa_node_count)
+const size_t MAX_ARENAS = 8;
+
+// Default time free pages stay resident before they are returned to the OS
+const unsigned PURGE_DECAY_MS = 10000;
+
+// Bytes a MonotonicHeap takes from its heap at a time (bigger requests get a chunk of their own)
+const size_t MONOTONIC_CHUNK_SIZE = 64 * 1024;
+
+struct BlockHeader;
+
+#if defined(ALLOCATOR_HARDENED)
+// Free list link stored XORed with its own address shifted right by 12 bits (safe-linking)
+// An overwritten link no longer points where the overwrite said, and the address it
+// decodes to is checked for alignment before it is used (headers sit one word before
+// ALIGN_SIZE-aligned data, so only word alignment can be relied on)
+class FreeLink {
+public:
+    FreeLink() = default;
+    FreeLink(const FreeLink&) = delete;  // A copy at another address would decode wrongly
+    
+    FreeLink& operator=(BlockHeader* block) {
+        value = reinterpret_cast<uintptr_t>(block) ^ key();
+        return *this;
+    }
+    
+    // Links are re-encoded for their new address when copied
+    FreeLink& operator=(const FreeLink& other) {
+        return *this = static_cast<BlockHeader*>(other);
+    }
+    
+    operator BlockHeader*() const {
+        uintptr_t block = value ^ key();
+        if (block & (sizeof(size_t) - 1)) {
+            report_heap_corruption("free list link");
+        }
+        return reinterpret_cast<BlockHeader*>(block);
+    }
+    
+    BlockHeader* operator->() const {
+        return *this;
+    }
+    
+private:
+    uintptr_t key() const {
+        return reinterpret_cast<uintptr_t>(this) >> 12;
+    }
+    
+    uintptr_t value;
+};
+#else
+typedef BlockHeader* FreeLink;
+#endif
+
+static_assert(sizeof(FreeLink) == sizeof(void*), "Free list links take one word");
 
 // Block header structure
-// This header is stored before each memory block in the heap
+// This 8-byte header is stored before each memory block in the heap
+// Block sizes are multiples of ALIGN_SIZE, so the low bits of the size are
+// always zero and hold the flags instead (and, in hardened builds, the top 16 bits
+// hold a checksum of the size and the header's address)
 struct BlockHeader {
-    size_t size;           // Total size of block (including header)
-    bool is_free;          // Whether this block is free
-    BlockHeader* next;     // Next block in free list (only valid if is_free == true)
+    // Total size of block (including header) | flags
+    // Atomic (relaxed) because the PREV_FREE flag of an allocated block is updated by
+    // whoever frees its neighbour, while the block's owner may be reading its header.
+    // All writers hold the arena's lock.
+    std::atomic<size_t> size_and_flags;
+    
+    static const size_t FREE = 1;        // This block is free
+    static const size_t PREV_FREE = 2;   // The block right before this one is free
+    static const size_t SAMPLED = 4;     // Allocated block picked by the heap profiler
+    static const size_t FLAG_MASK = ALIGN_SIZE - 1;
+    static_assert(ALIGN_SIZE >= 8, "The header flags need at least 8-byte alignment");
+    
+#if defined(ALLOCATOR_HARDENED)
+    static const size_t SIZE_MASK = ((static_cast<size_t>(1) << 48) - 1) & ~FLAG_MASK;
+    
+    // Top 16 bits of a multiplicative hash; the flags are left out because
+    // neighbours change PREV_FREE without knowing anything else about the block
+    size_t checksum(size_t size) const {
+        return ((reinterpret_cast<uintptr_t>(this) ^ size) * 0x9e3779b97f4a7c15ULL) & ~(SIZE_MASK | FLAG_MASK);
+    }
+#else
+    static const size_t SIZE_MASK = ~FLAG_MASK;
+    
+    size_t checksum(size_t) const {
+        return 0;
+    }
+#endif
+    
+    // Set size and flags together (for a new header)
+    void init(size_t size, size_t flags) {
+        size_and_flags.store(size | flags | checksum(size), std::memory_order_relaxed);
+    }
+    
+    size_t get_size() const {
+        return size_and_flags.load(std::memory_order_relaxed) & SIZE_MASK;
+    }
+    
+    // Whether the checksum still matches the size (always true outside hardened builds)
+    bool is_intact() const {
+        size_t value = size_and_flags.load(std::memory_order_relaxed);
+        return (value & ~(SIZE_MASK | FLAG_MASK)) == checksum(value & SIZE_MASK);
+    }
+    
+    // Change the size, keeping the flags
+    void set_size(size_t size) {
+        init(size, size_and_flags.load(std::memory_order_relaxed) & FLAG_MASK);
+    }
+    
+    bool is_free() const {
+        return (size_and_flags.load(std::memory_order_relaxed) & FREE) != 0;
+    }
+    
+    void set_free(bool free) {
+        set_flag(FREE, free);
+    }
+    
+    bool is_prev_free() const {
+        return (size_and_flags.load(std::memory_order_relaxed) & PREV_FREE) != 0;
+    }
+    
+    void set_prev_free(bool prev_free) {
+        set_flag(PREV_FREE, prev_free);
+    }
+    
+    bool is_sampled() const {
+        return (size_and_flags.load(std::memory_order_relaxed) & SAMPLED) != 0;
+    }
+    
+    void set_flag(size_t flag, bool on) {
+        size_t value = size_and_flags.load(std::memory_order_relaxed);
+        size_and_flags.store(on ? (value | flag) : (value & ~flag), std::memory_order_relaxed);
+    }
     
     // Get pointer to user data (after header)
     void* get_data() {
         return reinterpret_cast<void*>(this + 1);
     }
     
+    // Free list links and purge state (only valid if is_free())
+    // Overlaid on the first bytes of the user data area, so allocated blocks don't pay for them
+    FreeLink& next() {
+        return reinterpret_cast<FreeLink*>(get_data())[0];
+    }
+    
+    FreeLink& prev() {
+        return reinterpret_cast<FreeLink*>(get_data())[1];
+    }
+    
+    // Child links of a free block in the best-fit engine's trees (the same words as next and prev)
+    FreeLink& left() {
+        return next();
+    }
+    
+    FreeLink& right() {
+        return prev();
+    }
+    
+    // Whether the free block's pages went back to the OS
+    unsigned char& purge_state() {
+        return *reinterpret_cast<unsigned char*>(&prev() + 1);
+    }
+    
     // Get pointer to header from user data pointer
     static BlockHeader* get_header(void* ptr) {
         return reinterpret_cast<BlockHeader*>(ptr) - 1;
     }
 };
 
+// Block footer structure (boundary tag)
+// Only free blocks have a footer: it sits in their last bytes and repeats the
+// block size, so when a header has PREV_FREE set the block before it can be
+// found in O(1). Allocated blocks keep those bytes for user data.
+struct BlockFooter {
+    size_t size;           // Total size of block (same value as the header)
+    
+    // Get pointer to the footer of a free block
+    static BlockFooter* of(BlockHeader* block) {
+        return reinterpret_cast<BlockFooter*>(reinterpret_cast<char*>(block) + block->get_size()) - 1;
+    }
+};
+
+// Allocation engines, selected when the allocator is initialized
+enum AllocatorEngine {
+    ENGINE_SEGREGATED_FIT,  // Power-of-two size classes with a bitmap of non-empty classes
+    ENGINE_TLSF,            // Two-Level Segregated Fit: O(1) good-fit with bounded malloc/free time
+    ENGINE_BEST_FIT         // Size classes holding trees ordered by (size, address): O(log n) best fit,
+                            // lowest address among equal sizes, for the least fragmentation
+};
+
+// How the default heap's regions are backed by physical memory (Linux only;
+// elsewhere regular pages are used)
+// Huge pages cut TLB misses for big heaps; purging then releases whole huge pages only
+enum HugePageMode {
+    HUGE_PAGES_NONE,            // Regular 4 KB pages
+    HUGE_PAGES_TRANSPARENT,     // Ask for transparent huge pages with madvise(MADV_HUGEPAGE)
+    HUGE_PAGES_EXPLICIT         // Reserved huge pages (MAP_HUGETLB); transparent ones when none are left
+};
+
+// How the arenas of a Heap are locked (the default heap always uses mutexes)
+enum HeapLocking {
+    HEAP_LOCK_MUTEX,    // std::mutex: a thread that finds its arena busy sleeps
+    HEAP_LOCK_SPIN,     // Spinlock: never enters the kernel, for short critical sections
+    HEAP_LOCK_NONE      // No locking: the heap must only ever be used by one thread
+};
+
 // Allocator functions
-void init_allocator();
+// The first allocation sets up the default heap with the default settings, so calling
+// init_allocator() is optional. Calling it throws away every block and starts over
+// with an empty heap; no other thread may be using the allocator at the time
+void init_allocator(AllocatorEngine engine = ENGINE_SEGREGATED_FIT, size_t arena_count = 1,
+                    HugePageMode huge_pages = HUGE_PAGES_NONE);
 void* my_malloc(size_t size);
 void my_free(void* ptr);
 
+// Zeroed allocation of count * size bytes (like calloc), nullptr if that overflows
+// Blocks carved out of memory fresh from the OS are known to be zero and aren't cleared
+// again, so a large my_calloc only faults in the pages that are actually touched
+void* my_calloc(size_t count, size_t size);
+
+// Aligned allocation (alignment must be a power of two); free the result with my_free
+void* my_aligned_alloc(size_t alignment, size_t size);
+void* my_memalign(size_t alignment, size_t size);
+
+// Resize an allocation, in place when possible (like realloc)
+void* my_realloc(void* ptr, size_t size);
+
+// Bytes the caller may use in an allocation, 0 if ptr is not a heap pointer or is a
+// free general block (never prints an error, so it can be used to check foreign pointers)
+size_t my_malloc_usable_size(void* ptr);
+
+// Batch allocation: count blocks of one size, returns how many were stored in out
+// Batch free sorts ptrs by address and coalesces neighbouring blocks of the calling
+// thread's arena in one pass; blocks of other arenas are queued for them as remote frees
+size_t my_malloc_batch(size_t size, void** out, size_t count);
+void my_free_batch(void** ptrs, size_t count);
+
+// Give every block cached by the calling thread back to the shared heap
+// (also happens automatically when a thread exits)
+void flush_thread_cache();
+
+// Returning memory to the OS
+// Pages of a free block that stay unused for one to two decay periods are released
+// from the allocation slow path; 0 turns that off
+void set_purge_decay(unsigned milliseconds);
+size_t purge_free_memory();  // Release every whole free page now, returns the bytes released
+
+// Deferred coalescing (off by default, kept across init_allocator())
+// A freed block is parked without merging it with its neighbours, and the next request
+// of exactly its size takes it back without a search: cheaper for code that frees and
+// reallocates the same sizes over and over. A sweep merges all parked blocks in address
+// order when a request finds no free block, when an arena parks more than
+// QUICK_LIST_MAX_BYTES, when memory is purged and when deferral is turned off
+// (statistics count parked blocks as pending, see HeapStats)
+void set_deferred_coalescing(bool enabled);
+bool get_deferred_coalescing();
+
+// Statistics of a heap, kept as running totals by every malloc/free
+// Reading them takes each arena's lock once, never walks the heap and never settles
+// queued or parked frees: those blocks are counted as pending until their arena takes
+// them back, so they are neither used nor free yet
+struct HeapStats {
+    size_t used_memory;          // Usable bytes of all allocated blocks (same as get_used_memory())
+    size_t free_memory;          // Usable bytes of all free blocks (same as get_free_memory())
+    size_t pending_free_memory;  // Usable bytes freed but still queued for another arena or parked
+    size_t free_block_count;     // Same as get_fragmentation_count()
+    size_t largest_free_block;   // Usable bytes of the biggest free block
+    size_t heap_size;            // Same as get_heap_size()
+    
+    // Calls per size class: class i counts blocks with a usable size in [2^i, 2^(i+1))
+    // A realloc in place counts as neither, a moving realloc as one of each
+    uint64_t malloc_counts[NUM_SIZE_CLASSES];
+    uint64_t free_counts[NUM_SIZE_CLASSES];
+};
+
 // Debugging utilities
 void print_heap_state();
 size_t get_used_memory();
 size_t get_free_memory();
 size_t get_fragmentation_count();
+size_t get_heap_size();  // Bytes of regions currently committed from the OS
+size_t get_arena_count();
+size_t get_arena_index(void* ptr);  // Arena that owns a heap pointer
+size_t get_numa_node_count();       // Nodes the arenas are spread over (1 when the heap isn't bound to nodes)
+size_t get_arena_numa_node(size_t arena);  // Id of the node an arena is bound to (as the OS numbers it)
+HeapStats get_heap_stats();         // All of the above at once, plus per-size-class call counts
+
+// Write the heap's block map, free list lengths and fragmentation metrics as JSON
+// An arena is locked only while one of its regions is copied, so threads keep
+// allocating while a large heap is exported. Pending frees are written as parked or
+// queued blocks: like print_heap_state(), the export never settles them
+void export_heap_json(std::ostream& out);
+
+// Allocation tracing
+// While a trace runs, every my_malloc/my_aligned_alloc/my_realloc/my_free call (the
+// batch forms as one event per block) is recorded for replay.cpp. Each thread appends
+// events to its own buffer without locking; a full buffer is written to the file
+// under a lock. A thread that exits writes out its buffer itself
+enum TraceOp {
+    TRACE_MALLOC,
+    TRACE_ALIGNED_ALLOC,
+    TRACE_REALLOC,
+    TRACE_FREE
+};
+
+// One recorded call (32 bytes); a trace file is TRACE_MAGIC followed by events
+// Events of a thread are in call order, those of different threads are merged by timestamp
+struct TraceEvent {
+    uint64_t timestamp;     // Nanoseconds since start_trace()
+    uint64_t ptr;           // Address returned (0 if the call failed) or freed
+    uint64_t arg;           // TRACE_REALLOC: address passed in; TRACE_ALIGNED_ALLOC: alignment
+    uint32_t size;          // Bytes requested (saturates at 4 GB)
+    uint16_t thread;        // Numbered from 0 in the order threads first record an event
+    uint8_t op;             // TraceOp
+    uint8_t reserved;
+};
+
+const char TRACE_MAGIC[] = "ALCTRC01";
+const size_t TRACE_MAGIC_SIZE = sizeof(TRACE_MAGIC) - 1;
+
+// Start recording to a new file; false if it can't be created or a trace is running
+bool start_trace(const char* path);
+// Write out every buffer and close the file
+// Other threads must not be allocating while the trace is stopped
+void stop_trace();
+
+// Heap profiling
+// With sampling on, my_malloc, my_aligned_alloc and my_realloc pick about one
+// allocation per mean_bytes bytes requested and keep the call stack of every picked
+// block until it is freed. The gaps between samples are drawn at random (exponentially
+// distributed), so every byte has the same chance of being picked whatever the sizes
+// around it. While sampling is off, an allocation only counts down a thread-local byte
+// counter. The batch functions are never sampled
+const size_t HEAP_SAMPLE_INTERVAL = 512 * 1024;  // Suggested mean: a few thousand samples per GB
+
+// Set the mean bytes between samples (0, the default, turns sampling off)
+// Threads pick up a new value once their current gap runs out
+void set_heap_sampling(size_t mean_bytes);
+size_t get_heap_sampling();
+
+// Write the call stacks of the sampled blocks in the text heap profile format that
+// pprof reads (pprof <program> <file>). The counts are those of the samples; pprof
+// scales them up to estimate the whole heap. On Linux the address map of the process
+// is appended, so pprof can find the binaries and libraries the addresses belong to
+void write_heap_profile(std::ostream& out);
+
+struct HeapState;
+
+// An independent heap over memory supplied by the caller
+// It shares nothing with the default heap behind my_malloc/my_free, so a subsystem
+// can keep its objects together (and drop them all at once by destroying the Heap).
+// Blocks must be freed through the heap that allocated them. Only the default heap
+// uses thread caches and returns pages to the OS
+class Heap {
+public:
+    // The memory must stay valid while the Heap exists; the heap's own bookkeeping
+    // (about 11 KB per arena) is kept at its start. It never grows beyond it, and it is
+    // handed to the arenas REGION_SIZE at a time, so arenas that find none left stay empty
+    // Without count_calls the per-size-class call counts of get_stats() stay zero
+    Heap(void* memory, size_t size, AllocatorEngine engine = ENGINE_SEGREGATED_FIT, size_t arena_count = 1,
+         HeapLocking locking = HEAP_LOCK_MUTEX, bool count_calls = true);
+    ~Heap();
+    
+    void* malloc(size_t size);
+    void* aligned_alloc(size_t alignment, size_t size);
+    void* realloc(void* ptr, size_t size);
+    void free(void* ptr);
+    size_t usable_size(void* ptr) const;
+    size_t malloc_batch(size_t size, void** out, size_t count);
+    void free_batch(void** ptrs, size_t count);
+    
+    // Whether a pointer lies inside one of this heap's blocks
+    bool contains(const void* ptr) const;
+    
+    // Same as set_deferred_coalescing(), for this heap
+    void set_deferred_coalescing(bool enabled);
+    
+    // Debugging utilities (same as the functions above, for this heap)
+    size_t get_used_memory();
+    size_t get_free_memory();
+    size_t get_fragmentation_count();
+    size_t get_heap_size();
+    size_t get_arena_count() const;
+    HeapStats get_stats();
+    void print_state();
+    void export_json(std::ostream& out);
+    
+private:
+    explicit Heap(HeapState* state);
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+    
+    HeapState* state;
+    
+    friend Heap& get_default_heap();
+    template <typename Config>
+    friend class BasicHeap;
+};
+
+// The heap behind my_malloc/my_free, as a Heap object
+Heap& get_default_heap();
+
+// Size-class policies for BasicHeap: how a request is rounded up before it reaches the heap
+// Rounding to a few sizes lets a freed block fit later requests exactly (less splitting,
+// less fragmentation) at the price of some unused bytes per block
+struct ExactSizes {
+    static size_t round_up(size_t size) {
+        return size;
+    }
+};
+
+// Requests up to a size of the list (in increasing order) are rounded up to it; larger
+// ones are kept as they are. The comparisons are unrolled at compile time:
+//   typedef SizeClassTable<32, 64, 128, 256, 512, 1024> SmallClasses;
+template <size_t... Sizes>
+struct SizeClassTable;
+
+template <>
+struct SizeClassTable<> {
+    static size_t round_up(size_t size) {
+        return size;
+    }
+};
+
+template <size_t First, size_t... Rest>
+struct SizeClassTable<First, Rest...> {
+    static size_t round_up(size_t size) {
+        return size <= First ? First : SizeClassTable<Rest...>::round_up(size);
+    }
+};
+
+// Locking policies for BasicHeap: the lock each of its arenas is taken with
+// The engine's arena operations are compiled once per policy, so a heap's lock calls are
+// direct (and with NoLock, there are none). None of them is lock-free: a free coalesces
+// with both neighbours and relinks them in doubly linked lists, which one atomic
+// compare-and-swap can't do. What is lock-free is the queue that frees from other arenas
+// go through (see Key Concept 13 in README.md)
+
+// No locking: the heap must only ever be used by one thread
+struct NoLock {
+    static const HeapLocking mode = HEAP_LOCK_NONE;
+    
+    void lock() {}
+    void unlock() {}
+};
+
+// Spinlock: never enters the kernel, for short critical sections
+// Spins on a plain load, so waiting threads don't keep stealing the cache line, and
+// yields meanwhile in case the holder was preempted
+class SpinLock {
+public:
+    static const HeapLocking mode = HEAP_LOCK_SPIN;
+    
+    constexpr SpinLock() : locked(false) {}
+    
+    void lock() {
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            while (locked.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+    
+private:
+    std::atomic<bool> locked;
+};
+
+// std::mutex: a thread that finds its arena busy sleeps
+class MutexLock {
+public:
+    static const HeapLocking mode = HEAP_LOCK_MUTEX;
+    
+    constexpr MutexLock() {}
+    
+    void lock() {
+        mutex.lock();
+    }
+    
+    void unlock() {
+        mutex.unlock();
+    }
+    
+private:
+    std::mutex mutex;
+};
+
+// Statistics policies for BasicHeap: whether calls are counted per size class
+// With NoStats the counting is not compiled into the heap's operations at all
+struct NoStats {
+    static const bool enabled = false;
+};
+
+struct Stats {
+    static const bool enabled = true;
+};
+
+// The heap operations compiled for one locking and one statistics policy
+// Defined in allocator.cpp for every pair of the policies above; Heap picks the pair
+// it was built with once, BasicHeap names its pair at compile time
+template <typename Lock, typename StatsPolicy>
+struct HeapEngine {
+    static void* malloc(HeapState* heap, size_t size);
+    static void* aligned_alloc(HeapState* heap, size_t alignment, size_t size);
+    static void* realloc(HeapState* heap, void* ptr, size_t size);
+    static void free(HeapState* heap, void* ptr);
+    static size_t malloc_batch(HeapState* heap, size_t size, void** out, size_t count);
+    static void free_batch(HeapState* heap, void** ptrs, size_t count);
+};
+
+// Compile-time configuration of a BasicHeap; derive from it and override what differs:
+//   struct ParserHeapConfig : DefaultHeapConfig {
+//       typedef NoLock locking;
+//       typedef NoStats stats;
+//   };
+struct DefaultHeapConfig {
+    static const size_t alignment = ALIGN_SIZE;             // Of every block (a power of two)
+    typedef ExactSizes size_classes;                        // Rounding of requests
+    static const AllocatorEngine fit = ENGINE_SEGREGATED_FIT;
+    typedef MutexLock locking;                              // NoLock, SpinLock or MutexLock
+    static const size_t arena_count = 1;
+    typedef Stats stats;                                    // Per-size-class call counts (or NoStats)
+};
+
+// A Heap whose configuration is fixed at compile time
+// Alignment and size classes are applied here, inline, and fold away when they are the
+// defaults; every call goes straight to the engine compiled for the locking and
+// statistics policies, and the fit is handed to the Heap underneath once, when it is
+// built. Heaps of different configurations can live side by side:
+//   BasicHeap<ParserHeapConfig> parser_heap(buffer, sizeof(buffer));
+template <typename Config>
+class BasicHeap {
+public:
+    static_assert(Config::alignment >= ALIGN_SIZE && (Config::alignment & (Config::alignment - 1)) == 0,
+                  "BasicHeap alignment must be a power of two of at least ALIGN_SIZE");
+    
+    typedef HeapEngine<typename Config::locking, typename Config::stats> Engine;
+    
+    BasicHeap(void* memory, size_t size)
+        : heap(memory, size, Config::fit, Config::arena_count, Config::locking::mode, Config::stats::enabled) {}
+    
+    void* malloc(size_t size) {
+        if (size == 0 || !heap.state) {
+            return nullptr;
+        }
+        size = Config::size_classes::round_up(size);
+        return Config::alignment > ALIGN_SIZE ? Engine::aligned_alloc(heap.state, Config::alignment, size)
+                                              : Engine::malloc(heap.state, size);
+    }
+    
+    // Over-aligned blocks never move to a block of the heap's own alignment
+    void* realloc(void* ptr, size_t size) {
+        if (!ptr) {
+            return malloc(size);
+        }
+        if (!heap.state) {
+            return nullptr;
+        }
+        if (size == 0) {
+            return Engine::realloc(heap.state, ptr, 0);
+        }
+        size = Config::size_classes::round_up(size);
+        if (Config::alignment <= ALIGN_SIZE) {
+            return Engine::realloc(heap.state, ptr, size);
+        }
+        
+        size_t old_size = heap.usable_size(ptr);
+        if (size <= old_size) {
+            return ptr;
+        }
+        void* new_ptr = Engine::aligned_alloc(heap.state, Config::alignment, size);
+        if (new_ptr) {
+            std::memcpy(new_ptr, ptr, old_size);
+            Engine::free(heap.state, ptr);
+        }
+        return new_ptr;
+    }
+    
+    void free(void* ptr) {
+        if (heap.state) {
+            Engine::free(heap.state, ptr);
+        }
+    }
+    
+    size_t usable_size(void* ptr) const {
+        return heap.usable_size(ptr);
+    }
+    
+    bool contains(const void* ptr) const {
+        return heap.contains(ptr);
+    }
+    
+    // Only declared with statistics: on a NoStats heap, calling it doesn't compile
+    template <typename StatsPolicy = typename Config::stats>
+    typename std::enable_if<StatsPolicy::enabled, HeapStats>::type get_stats() {
+        return heap.get_stats();
+    }
+    
+    // The Heap underneath, for FreeListAllocator, MonotonicHeap and the debugging utilities
+    Heap& get_heap() {
+        return heap;
+    }
+    
+private:
+    Heap heap;
+};
+
+struct MonotonicChunk;
+
+// Bump-pointer allocator for memory that is dropped all at once (e.g. per request)
+// It takes big chunks from a heap and hands out consecutive pieces of them: no
+// per-block header, no free lists, no splitting. Individual blocks are never freed;
+// reset() drops everything in O(1) and rewind() drops everything allocated after a
+// marker. The chunks are kept for reuse until release() or destruction
+class MonotonicHeap {
+public:
+    // Position to rewind to; valid until a rewind or reset to an earlier point
+    struct Marker {
+        MonotonicChunk* chunk;
+        char* top;
+    };
+    
+    explicit MonotonicHeap(Heap& heap = get_default_heap(), size_t chunk_size = MONOTONIC_CHUNK_SIZE);
+    ~MonotonicHeap();
+    
+    void* malloc(size_t size);
+    void* aligned_alloc(size_t alignment, size_t size);
+    
+    Marker get_marker() const;
+    void rewind(Marker marker);
+    void reset();
+    void release();  // Give every chunk back to the heap
+    
+    size_t get_reserved_memory() const;  // Bytes of chunks taken from the heap
+    
+private:
+    MonotonicHeap(const MonotonicHeap&) = delete;
+    MonotonicHeap& operator=(const MonotonicHeap&) = delete;
+    
+    void* allocate_from_next_chunk(size_t alignment, size_t size);
+    
+    Heap* heap;
+    size_t chunk_size;
+    MonotonicChunk* first;      // Chunks in allocation order
+    MonotonicChunk* current;    // Chunk being bumped through (nullptr before the first allocation)
+    char* top;                  // Next free byte of current
+};
+
+// STL allocator that puts a container's memory in a heap (the default one unless given):
+//   std::vector<int, FreeListAllocator<int>> values;
+//   std::vector<int, FreeListAllocator<int>> local(FreeListAllocator<int>(my_heap));
+// Two allocators are equal when they use the same heap
+template <typename T>
+struct FreeListAllocator {
+    typedef T value_type;
+    
+    FreeListAllocator() noexcept : heap(&get_default_heap()) {}
+    
+    explicit FreeListAllocator(Heap& heap) noexcept : heap(&heap) {}
+    
+    template <typename U>
+    FreeListAllocator(const FreeListAllocator<U>& other) noexcept : heap(other.get_heap()) {}
+    
+    T* allocate(size_t count) {
+        if (count > static_cast<size_t>(-1) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        
+        // Over-aligned types (e.g. alignas(64)) need more than the block alignment
+        // A zero-element request still gets a unique block (the heap returns nullptr for 0 bytes)
+        size_t bytes = count ? count * sizeof(T) : 1;
+        void* ptr = alignof(T) > ALIGN_SIZE ? heap->aligned_alloc(alignof(T), bytes) : heap->malloc(bytes);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+    
+    void deallocate(T* ptr, size_t) noexcept {
+        heap->free(ptr);
+    }
+    
+    Heap* get_heap() const noexcept {
+        return heap;
+    }
+    
+private:
+    Heap* heap;
+};
+
+template <typename T, typename U>
+bool operator==(const FreeListAllocator<T>& a, const FreeListAllocator<U>& b) noexcept {
+    return a.get_heap() == b.get_heap();
+}
+
+template <typename T, typename U>
+bool operator!=(const FreeListAllocator<T>& a, const FreeListAllocator<U>& b) noexcept {
+    return a.get_heap() != b.get_heap();
+}
+
+#ifdef ALLOCATOR_HAS_PMR
+// std::pmr::memory_resource backed by a heap (the default one unless given),
+// for polymorphic containers:
+//   FreeListResource resource(my_heap);
+//   std::pmr::vector<int> values(&resource);
+// It can also be the upstream of a std::pmr pool or monotonic buffer
+class FreeListResource : public std::pmr::memory_resource {
+public:
+    FreeListResource() noexcept : heap(&get_default_heap()) {}
+    
+    explicit FreeListResource(Heap& heap) noexcept : heap(&heap) {}
+    
+    Heap* get_heap() const noexcept {
+        return heap;
+    }
+    
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        bytes = bytes ? bytes : 1;  // Zero bytes is a valid request, but the heap returns nullptr for it
+        void* ptr = alignment > ALIGN_SIZE ? heap->aligned_alloc(alignment, bytes) : heap->malloc(bytes);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+    
+    void do_deallocate(void* ptr, size_t, size_t) override {
+        heap->free(ptr);
+    }
+    
+    // Resources over the same heap can free each other's memory
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        const FreeListResource* resource = dynamic_cast<const FreeListResource*>(&other);
+        return resource && resource->heap == heap;
+    }
+    
+private:
+    Heap* heap;
+};
+#endif
 
 #endif // ALLOCATOR_H
 
@@ -0,0 +1,419 @@
+// Microbenchmarks for the allocator
+// Every pattern runs against my_malloc/my_free and against the system malloc/free,
+// and reports throughput and the p50/p99/p99.9 latency of a single call
+//
+// Usage: benchmark [operations per pattern] [tlsf|bestfit]
+
+#include "allocator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// One of the allocators being compared
+struct AllocatorUnderTest {
+    const char* name;
+    void* (*malloc_fn)(size_t);
+    void (*free_fn)(void*);
+    void* (*realloc_fn)(void*, size_t);
+};
+
+static void* system_malloc(size_t size) {
+    return std::malloc(size);
+}
+
+static void system_free(void* ptr) {
+    std::free(ptr);
+}
+
+static void* system_realloc(void* ptr, size_t size) {
+    return std::realloc(ptr, size);
+}
+
+static const AllocatorUnderTest free_list_allocator = {"free-list", my_malloc, my_free, my_realloc};
+static const AllocatorUnderTest system_allocator = {"system", system_malloc, system_free, system_realloc};
+
+// Engine and operation count for the free-list runs (set from the command line)
+static AllocatorEngine engine = ENGINE_SEGREGATED_FIT;
+static size_t operations = 200000;
+
+// Latency of every timed call of one run, in nanoseconds
+// Each call is timed on its own, so the numbers include the cost of reading the clock
+// An allocation that fails returns nullptr and sets out_of_memory; the pattern then stops
+struct Samples {
+    std::vector<uint32_t> latencies;
+    bool out_of_memory;
+
+    explicit Samples(size_t expected) : out_of_memory(false) {
+        latencies.reserve(expected);
+    }
+
+    void record(Clock::time_point start) {
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        latencies.push_back(static_cast<uint32_t>(ns));
+    }
+
+    void* timed_malloc(const AllocatorUnderTest& allocator, size_t size) {
+        Clock::time_point start = Clock::now();
+        void* ptr = allocator.malloc_fn(size);
+        record(start);
+        if (!ptr) {
+            out_of_memory = true;
+            return nullptr;
+        }
+
+        // Touch the block like a real program would
+        static_cast<char*>(ptr)[0] = 1;
+        return ptr;
+    }
+
+    void timed_free(const AllocatorUnderTest& allocator, void* ptr) {
+        Clock::time_point start = Clock::now();
+        allocator.free_fn(ptr);
+        record(start);
+    }
+
+    // On failure the old block is still allocated
+    void* timed_realloc(const AllocatorUnderTest& allocator, void* ptr, size_t size) {
+        Clock::time_point start = Clock::now();
+        void* new_ptr = allocator.realloc_fn(ptr, size);
+        record(start);
+        if (!new_ptr) {
+            out_of_memory = true;
+            return nullptr;
+        }
+        static_cast<char*>(new_ptr)[size - 1] = 1;
+        return new_ptr;
+    }
+};
+
+// Sizes drawn uniformly from [min_size, max_size]
+static std::vector<size_t> uniform_sizes(size_t count, size_t min_size, size_t max_size, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> distribution(min_size, max_size);
+    std::vector<size_t> sizes(count);
+    for (size_t i = 0; i < count; i++) {
+        sizes[i] = distribution(rng);
+    }
+    return sizes;
+}
+
+// Sizes with a power-law (Pareto) tail: mostly small, occasionally up to 64 KB
+static std::vector<size_t> power_law_sizes(size_t count, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    std::vector<size_t> sizes(count);
+    for (size_t i = 0; i < count; i++) {
+        double size = 16.0 / std::pow(1.0 - distribution(rng), 1.0 / 1.2);
+        sizes[i] = size > 65536.0 ? 65536 : static_cast<size_t>(size);
+    }
+    return sizes;
+}
+
+// Pattern: a working set of live blocks where each step frees a random one and
+// allocates a replacement (long-running server churn)
+static void run_churn(const AllocatorUnderTest& allocator, const std::vector<size_t>& sizes, Samples& samples) {
+    const size_t window = 1024;
+    std::vector<void*> live(window, nullptr);
+    std::mt19937 rng(7);
+    std::vector<size_t> slots(sizes.size());
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i] = rng() % window;
+    }
+
+    for (size_t i = 0; i < sizes.size(); i++) {
+        void*& slot = live[slots[i]];
+        if (slot) {
+            samples.timed_free(allocator, slot);
+        }
+        slot = samples.timed_malloc(allocator, sizes[i]);
+        if (!slot) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < window; i++) {
+        if (live[i]) {
+            allocator.free_fn(live[i]);
+        }
+    }
+}
+
+// Order in which a batch is freed
+enum FreeOrder {
+    FREE_LIFO,      // Newest first (stack-like, e.g. nested scopes)
+    FREE_FIFO,      // Oldest first (queue-like, e.g. message buffers)
+    FREE_RANDOM     // Shuffled (e.g. a cache evicting entries)
+};
+
+// Pattern: allocate a batch of blocks, then free all of them in the given order
+static void run_batches(const AllocatorUnderTest& allocator, const std::vector<size_t>& sizes,
+                        FreeOrder order, Samples& samples) {
+    const size_t batch_size = 1000;
+    std::vector<void*> batch(batch_size);
+    std::vector<size_t> free_order(batch_size);
+    std::mt19937 rng(11);
+
+    for (size_t done = 0; done + batch_size <= sizes.size(); done += batch_size) {
+        for (size_t i = 0; i < batch_size; i++) {
+            batch[i] = samples.timed_malloc(allocator, sizes[done + i]);
+            if (!batch[i]) {
+                for (size_t j = 0; j < i; j++) {
+                    allocator.free_fn(batch[j]);
+                }
+                return;
+            }
+            free_order[i] = (order == FREE_LIFO) ? batch_size - 1 - i : i;
+        }
+        if (order == FREE_RANDOM) {
+            std::shuffle(free_order.begin(), free_order.end(), rng);
+        }
+        for (size_t i = 0; i < batch_size; i++) {
+            samples.timed_free(allocator, batch[free_order[i]]);
+        }
+    }
+}
+
+// Pattern: a buffer that grows by half each step up to 1 MB (vector/string growth)
+static void run_realloc_growth(const AllocatorUnderTest& allocator, size_t count, Samples& samples) {
+    size_t done = 0;
+    while (done < count) {
+        size_t size = 16;
+        void* buffer = samples.timed_malloc(allocator, size);
+        if (!buffer) {
+            return;
+        }
+        while (size < 1024 * 1024 && done < count) {
+            size = size * 3 / 2;
+            void* grown = samples.timed_realloc(allocator, buffer, size);
+            if (!grown) {
+                allocator.free_fn(buffer);
+                return;
+            }
+            buffer = grown;
+            done++;
+        }
+        samples.timed_free(allocator, buffer);
+        done += 2;
+    }
+}
+
+// Single-producer single-consumer ring of pointers
+struct PointerQueue {
+    static const size_t CAPACITY = 1024;
+    void* slots[CAPACITY];
+    std::atomic<size_t> head;   // Next slot to read (consumer)
+    std::atomic<size_t> tail;   // Next slot to write (producer)
+
+    PointerQueue() : head(0), tail(0) {}
+
+    void push(void* ptr) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        while (position - head.load(std::memory_order_acquire) == CAPACITY) {
+            std::this_thread::yield();
+        }
+        slots[position % CAPACITY] = ptr;
+        tail.store(position + 1, std::memory_order_release);
+    }
+
+    void* pop() {
+        size_t position = head.load(std::memory_order_relaxed);
+        while (tail.load(std::memory_order_acquire) == position) {
+            std::this_thread::yield();
+        }
+        void* ptr = slots[position % CAPACITY];
+        head.store(position + 1, std::memory_order_release);
+        return ptr;
+    }
+};
+
+// Pattern: producer threads allocate messages that consumer threads free, so every
+// free happens on a different thread than the malloc
+// A producer that runs out of memory pushes nullptr, which stops its consumer
+static void run_producer_consumer(const AllocatorUnderTest& allocator, size_t count, Samples& samples) {
+    const size_t pairs = 2;
+    size_t per_pair = count / (2 * pairs);
+    std::vector<PointerQueue> queues(pairs);
+    std::vector<Samples> thread_samples(2 * pairs, Samples(per_pair));
+    std::vector<std::thread> threads;
+
+    for (size_t p = 0; p < pairs; p++) {
+        threads.push_back(std::thread([&, p]() {
+            std::vector<size_t> sizes = uniform_sizes(per_pair, 32, 512, static_cast<unsigned>(p));
+            for (size_t i = 0; i < per_pair; i++) {
+                void* message = thread_samples[2 * p].timed_malloc(allocator, sizes[i]);
+                queues[p].push(message);
+                if (!message) {
+                    break;
+                }
+            }
+        }));
+        threads.push_back(std::thread([&, p]() {
+            for (size_t i = 0; i < per_pair; i++) {
+                void* message = queues[p].pop();
+                if (!message) {
+                    break;
+                }
+                thread_samples[2 * p + 1].timed_free(allocator, message);
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    for (size_t i = 0; i < thread_samples.size(); i++) {
+        samples.out_of_memory = samples.out_of_memory || thread_samples[i].out_of_memory;
+        samples.latencies.insert(samples.latencies.end(),
+                                 thread_samples[i].latencies.begin(), thread_samples[i].latencies.end());
+    }
+}
+
+// The benchmark patterns
+enum Pattern {
+    PATTERN_UNIFORM_SMALL,
+    PATTERN_POWER_LAW,
+    PATTERN_LIFO,
+    PATTERN_FIFO,
+    PATTERN_RANDOM_FREE,
+    PATTERN_REALLOC_GROWTH,
+    PATTERN_PRODUCER_CONSUMER,
+    NUM_PATTERNS
+};
+
+static const char* pattern_names[NUM_PATTERNS] = {
+    "uniform small", "power-law sizes", "LIFO", "FIFO",
+    "random-order free", "realloc growth", "producer/consumer"
+};
+
+// Throughput and latency of one pattern on one allocator
+struct RunResult {
+    bool failed;            // Ran out of memory (the other fields are not set)
+    double ops_per_second;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+};
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double fraction) {
+    size_t index = static_cast<size_t>(fraction * sorted.size());
+    return sorted[index < sorted.size() ? index : sorted.size() - 1];
+}
+
+// Run one pattern on one allocator (the free-list heap is started fresh for each run)
+static RunResult run_pattern(Pattern pattern, const AllocatorUnderTest& allocator) {
+    if (&allocator == &free_list_allocator) {
+        init_allocator(engine, pattern == PATTERN_PRODUCER_CONSUMER ? 4 : 1);
+    }
+
+    // Inputs are generated up front so only allocator calls are timed
+    std::vector<size_t> sizes;
+    if (pattern == PATTERN_UNIFORM_SMALL) {
+        sizes = uniform_sizes(operations / 2, 16, 256, 1);
+    } else if (pattern == PATTERN_POWER_LAW) {
+        sizes = power_law_sizes(operations / 2, 2);
+    } else if (pattern == PATTERN_LIFO || pattern == PATTERN_FIFO || pattern == PATTERN_RANDOM_FREE) {
+        sizes = uniform_sizes(operations / 2, 16, 1024, 3);
+    }
+
+    Samples samples(operations + 16);
+    Clock::time_point start = Clock::now();
+    switch (pattern) {
+        case PATTERN_UNIFORM_SMALL:
+        case PATTERN_POWER_LAW:
+            run_churn(allocator, sizes, samples);
+            break;
+        case PATTERN_LIFO:
+            run_batches(allocator, sizes, FREE_LIFO, samples);
+            break;
+        case PATTERN_FIFO:
+            run_batches(allocator, sizes, FREE_FIFO, samples);
+            break;
+        case PATTERN_RANDOM_FREE:
+            run_batches(allocator, sizes, FREE_RANDOM, samples);
+            break;
+        case PATTERN_REALLOC_GROWTH:
+            run_realloc_growth(allocator, operations, samples);
+            break;
+        default:
+            run_producer_consumer(allocator, operations, samples);
+            break;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    RunResult result;
+    result.failed = samples.out_of_memory;
+    if (result.failed) {
+        std::cerr << "ERROR: The " << allocator.name << " allocator ran out of memory in the "
+                  << pattern_names[pattern] << " pattern\n";
+        return result;
+    }
+
+    std::sort(samples.latencies.begin(), samples.latencies.end());
+    result.ops_per_second = samples.latencies.size() / seconds;
+    result.p50 = percentile(samples.latencies, 0.50);
+    result.p99 = percentile(samples.latencies, 0.99);
+    result.p999 = percentile(samples.latencies, 0.999);
+    return result;
+}
+
+static void print_result(const char* pattern, const char* allocator, const RunResult& result) {
+    std::cout << std::left << std::setw(20) << pattern << std::setw(11) << allocator;
+    if (result.failed) {
+        std::cout << "out of memory\n";
+        return;
+    }
+    std::cout << std::right << std::fixed << std::setprecision(2)
+              << std::setw(9) << result.ops_per_second / 1e6
+              << std::setw(9) << result.p50
+              << std::setw(9) << result.p99
+              << std::setw(9) << result.p999 << "\n";
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        operations = std::strtoul(argv[1], nullptr, 10);
+        if (operations < 10000) {
+            operations = 10000;
+        }
+    }
+    if (argc > 2 && std::string(argv[2]) == "tlsf") {
+        engine = ENGINE_TLSF;
+    } else if (argc > 2 && std::string(argv[2]) == "bestfit") {
+        engine = ENGINE_BEST_FIT;
+    }
+
+    std::cout << "Allocator benchmark: " << operations << " operations per pattern, "
+              << (engine == ENGINE_TLSF ? "TLSF" : engine == ENGINE_BEST_FIT ? "best fit" : "segregated fit") << " engine\n";
+    std::cout << "(latencies are per call in ns and include reading the clock)\n\n";
+    std::cout << std::left << std::setw(20) << "Pattern" << std::setw(11) << "Allocator"
+              << std::right << std::setw(9) << "Mops/s" << std::setw(9) << "p50"
+              << std::setw(9) << "p99" << std::setw(9) << "p99.9" << "\n";
+    std::cout << std::string(67, '-') << "\n";
+
+    for (int i = 0; i < NUM_PATTERNS; i++) {
+        Pattern pattern = static_cast<Pattern>(i);
+        RunResult ours = run_pattern(pattern, free_list_allocator);
+        RunResult system = run_pattern(pattern, system_allocator);
+
+        print_result(pattern_names[i], free_list_allocator.name, ours);
+        print_result("", system_allocator.name, system);
+        if (!ours.failed && !system.failed) {
+            std::cout << std::left << std::setw(20) << "" << "throughput vs system: "
+                      << std::setprecision(2) << ours.ops_per_second / system.ops_per_second << "x\n";
+        }
+        std::cout << "\n";
+    }
+
+    return 0;
+}
@@ -1,5 +1,13 @@
 @echo off
 REM Build script for Windows - tries g++ (MinGW) first, then MSVC cl
+REM Usage: build.bat [cpp17]   (C++17 also builds and tests the std::pmr adapter)
+
+set STD=c++11
+set CL_STD=c++14
+if "%1"=="cpp17" (
+    set STD=c++17
+    set CL_STD=c++17
+)
 
 echo Building custom memory allocator...
 
@@ -7,7 +15,7 @@ REM Try g++ first (MinGW/GCC on Windows)
 where g++ >nul 2>&1
 if %ERRORLEVEL% EQU 0 (
     echo Using g++ compiler...
-    g++ -std=c++11 -Wall -Wextra -O2 -o allocator.exe allocator.cpp main.cpp
+    g++ -std=%STD% -Wall -Wextra -O2 -pthread -o allocator.exe allocator.cpp main.cpp
     if %ERRORLEVEL% EQU 0 (
         echo Build successful! Run with: allocator.exe
         exit /b 0
@@ -21,7 +29,7 @@ REM Try cl (MSVC)
 where cl >nul 2>&1
 if %ERRORLEVEL% EQU 0 (
     echo Using MSVC cl compiler...
-    cl /EHsc /std:c++11 /W4 /O2 allocator.cpp main.cpp /Fe:allocator.exe
+    cl /EHsc /std:%CL_STD% /W4 /O2 allocator.cpp main.cpp /Fe:allocator.exe
     if %ERRORLEVEL% EQU 0 (
         echo Build successful! Run with: allocator.exe
         exit /b 0
@@ -35,7 +43,7 @@ REM Try clang++
 where clang++ >nul 2>&1
 if %ERRORLEVEL% EQU 0 (
     echo Using clang++ compiler...
-    clang++ -std=c++11 -Wall -Wextra -O2 -o allocator.exe allocator.cpp main.cpp
+    clang++ -std=%STD% -Wall -Wextra -O2 -pthread -o allocator.exe allocator.cpp main.cpp
     if %ERRORLEVEL% EQU 0 (
         echo Build successful! Run with: allocator.exe
         exit /b 0
@@ -52,7 +60,7 @@ echo   - Microsoft Visual Studio (provides cl)
 echo   - LLVM/Clang (provides clang++)
 echo.
 echo Or compile manually:
-echo   g++ -std=c++11 -Wall -Wextra -O2 -o allocator.exe allocator.cpp main.cpp
+echo   g++ -std=c++11 -Wall -Wextra -O2 -pthread -o allocator.exe allocator.cpp main.cpp
 exit /b 1
 
 
@@ -1,4 +1,12 @@
 # Build script for Windows (PowerShell)
+# Usage: .\build.ps1 [cpp17]   (C++17 also builds and tests the std::pmr adapter)
+
+$std = "c++11"
+$clStd = "c++14"
+if ($args.Count -gt 0 -and $args[0] -eq "cpp17") {
+    $std = "c++17"
+    $clStd = "c++17"
+}
 
 Write-Host "Building custom memory allocator..." -ForegroundColor Cyan
 
@@ -6,7 +14,7 @@ Write-Host "Building custom memory allocator..." -ForegroundColor Cyan
 $gpp = Get-Command g++ -ErrorAction SilentlyContinue
 if ($gpp) {
     Write-Host "Using g++ compiler..." -ForegroundColor Yellow
-    g++ -std=c++11 -Wall -Wextra -O2 -o allocator.exe allocator.cpp main.cpp
+    g++ -std=$std -Wall -Wextra -O2 -pthread -o allocator.exe allocator.cpp main.cpp
     if ($LASTEXITCODE -eq 0) {
         Write-Host "Build successful! Run with: .\allocator.exe" -ForegroundColor Green
         exit 0
@@ -20,7 +28,7 @@ if ($gpp) {
 $cl = Get-Command cl -ErrorAction SilentlyContinue
 if ($cl) {
     Write-Host "Using MSVC cl compiler..." -ForegroundColor Yellow
-    cl /EHsc /std:c++11 /W4 /O2 allocator.cpp main.cpp /Fe:allocator.exe
+    cl /EHsc /std:$clStd /W4 /O2 allocator.cpp main.cpp /Fe:allocator.exe
     if ($LASTEXITCODE -eq 0) {
         Write-Host "Build successful! Run with: .\allocator.exe" -ForegroundColor Green
         exit 0
@@ -34,7 +42,7 @@ if ($cl) {
 $clangpp = Get-Command clang++ -ErrorAction SilentlyContinue
 if ($clangpp) {
     Write-Host "Using clang++ compiler..." -ForegroundColor Yellow
-    clang++ -std=c++11 -Wall -Wextra -O2 -o allocator.exe allocator.cpp main.cpp
+    clang++ -std=$std -Wall -Wextra -O2 -pthread -o allocator.exe allocator.cpp main.cpp
     if ($LASTEXITCODE -eq 0) {
         Write-Host "Build successful! Run with: .\allocator.exe" -ForegroundColor Green
         exit 0
@@ -52,6 +60,6 @@ Write-Host "  - Microsoft Visual Studio (provides cl)" -ForegroundColor White
 Write-Host "  - LLVM/Clang (provides clang++)" -ForegroundColor White
 Write-Host ""
 Write-Host "Or compile manually:" -ForegroundColor Yellow
-Write-Host "  g++ -std=c++11 -Wall -Wextra -O2 -o allocator.exe allocator.cpp main.cpp" -ForegroundColor Cyan
+Write-Host "  g++ -std=c++11 -Wall -Wextra -O2 -pthread -o allocator.exe allocator.cpp main.cpp" -ForegroundColor Cyan
 exit 1
 
@@ -1,8 +1,63 @@
 #!/bin/bash
 # Build script for the custom allocator
+# Usage: ./build.sh [hardened] [cpp17] [preload|bench|replay]
+
+FLAGS=""
+if [ "$1" = "hardened" ]; then
+    # Safe-linked free lists and header checksums (see ALLOCATOR_HARDENED in allocator.h)
+    FLAGS="-DALLOCATOR_HARDENED"
+    shift
+fi
+
+STD="-std=c++11"
+if [ "$1" = "cpp17" ]; then
+    # C++17 also builds (and tests) the std::pmr adapter FreeListResource
+    STD="-std=c++17"
+    shift
+fi
+
+if [ "$1" = "preload" ]; then
+    # Shared library that replaces malloc/free and new/delete via LD_PRELOAD
+    echo "Building liballocator.so..."
+    g++ $STD -Wall -Wextra -O2 -pthread $FLAGS -fPIC -shared -DALLOCATOR_ALIGNMENT=16 -DALLOCATOR_PRELOAD \
+        -o liballocator.so allocator.cpp malloc_override.cpp
+    if [ $? -eq 0 ]; then
+        echo "Build successful! Run with: LD_PRELOAD=./liballocator.so <program>"
+    else
+        echo "Build failed!"
+        exit 1
+    fi
+    exit 0
+fi
+
+if [ "$1" = "bench" ]; then
+    # Microbenchmarks against the system malloc
+    echo "Building benchmark..."
+    g++ $STD -Wall -Wextra -O2 -pthread $FLAGS -o benchmark allocator.cpp benchmark.cpp
+    if [ $? -eq 0 ]; then
+        echo "Build successful! Run with: ./benchmark [operations] [tlsf|bestfit]"
+    else
+        echo "Build failed!"
+        exit 1
+    fi
+    exit 0
+fi
+
+if [ "$1" = "replay" ]; then
+    # Replays traces recorded with start_trace() or ALLOCATOR_TRACE
+    echo "Building replay..."
+    g++ $STD -Wall -Wextra -O2 -pthread $FLAGS -o replay allocator.cpp replay.cpp
+    if [ $? -eq 0 ]; then
+        echo "Build successful! Run with: ./replay <trace file> [tlsf|bestfit]"
+    else
+        echo "Build failed!"
+        exit 1
+    fi
+    exit 0
+fi
 
 echo "Building custom memory allocator..."
-g++ -std=c++11 -Wall -Wextra -O2 -o allocator allocator.cpp main.cpp
+g++ $STD -Wall -Wextra -O2 -pthread $FLAGS -o allocator allocator.cpp main.cpp
 
 if [ $? -eq 0 ]; then
     echo "Build successful! Run with: ./allocator"
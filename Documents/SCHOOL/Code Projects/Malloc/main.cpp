@@ -2,6 +2,21 @@
 #include <iostream>
 #include <cstring>
 #include <cassert>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#if defined(ALLOCATOR_HARDENED) && !defined(_WIN32)
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 // Test function declarations
 void test_basic_allocation();
@@ -10,16 +25,46 @@ void test_block_splitting();
 void test_coalescing();
 void test_edge_cases();
 void test_fragmentation();
+void test_boundary_tags();
+void test_free_list_unlink();
 void demo_usage();
+void test_tlsf_engine();
+void test_slab_allocator();
+void test_thread_cache();
+void test_arenas();
+void test_remote_free();
+void test_growable_heap();
+void test_purge();
+void test_compact_header();
+void test_aligned_alloc();
+void test_realloc();
+void test_batch();
+void test_stl_allocator();
+void test_heap_instances();
+void test_monotonic_heap();
+void test_huge_pages();
+void test_trace();
+void test_heap_stats();
+void test_heap_export();
+void test_heap_profile();
+void test_best_fit_engine();
+void test_deferred_coalescing();
+void test_hardening();
+void test_basic_heap();
+void test_numa_arenas();
+void test_calloc();
 
 int main() {
     std::cout << "========================================\n";
     std::cout << "Custom Memory Allocator Demonstration\n";
     std::cout << "========================================\n\n";
     
-    // Initialize the allocator
+    // The first allocation sets up the heap by itself; init_allocator() starts over
+    assert(get_heap_size() == 0);
+    my_free(my_malloc(16));
+    assert(get_heap_size() > 0);
     init_allocator();
-    std::cout << "Allocator initialized with " << (HEAP_SIZE / 1024) << " KB heap\n";
+    std::cout << "Allocator initialized with " << (get_heap_size() / 1024) << " KB heap\n";
     print_heap_state();
     
     // Run tests
@@ -29,7 +74,34 @@ int main() {
     test_coalescing();
     test_edge_cases();
     test_fragmentation();
+    test_boundary_tags();
+    test_free_list_unlink();
     demo_usage();
+    test_tlsf_engine();
+    test_slab_allocator();
+    test_thread_cache();
+    test_arenas();
+    test_remote_free();
+    test_growable_heap();
+    test_purge();
+    test_compact_header();
+    test_aligned_alloc();
+    test_realloc();
+    test_batch();
+    test_stl_allocator();
+    test_heap_instances();
+    test_monotonic_heap();
+    test_huge_pages();
+    test_trace();
+    test_heap_stats();
+    test_heap_export();
+    test_heap_profile();
+    test_best_fit_engine();
+    test_deferred_coalescing();
+    test_hardening();
+    test_basic_heap();
+    test_numa_arenas();
+    test_calloc();
     
     std::cout << "\n========================================\n";
     std::cout << "All tests completed!\n";
@@ -194,6 +266,31 @@ void test_edge_cases() {
     int stack_var = 42;
     my_free(&stack_var);  // Should print error message
     
+    // Requests bigger than the heap could ever hold fail at once
+    std::cout << "Testing requests larger than the heap...\n";
+    auto huge_start = std::chrono::steady_clock::now();
+    assert(my_malloc(SIZE_MAX - 4096) == nullptr);
+    assert(my_malloc(static_cast<size_t>(1) << 60) == nullptr);
+    assert(std::chrono::steady_clock::now() - huge_start < std::chrono::seconds(1));
+    
+    // Sizes whose header and rounding would wrap around SIZE_MAX fail too
+    void* batch[4];
+    void* kept = my_malloc(100);
+    std::vector<char> wrap_memory(2 * REGION_SIZE);
+    Heap wrap_heap(wrap_memory.data(), wrap_memory.size());
+    assert(my_malloc(SIZE_MAX) == nullptr);
+    assert(my_calloc(1, SIZE_MAX) == nullptr);
+    assert(my_aligned_alloc(16, SIZE_MAX - 7) == nullptr);
+    assert(my_aligned_alloc(4096, SIZE_MAX - 7) == nullptr);
+    assert(my_realloc(kept, SIZE_MAX) == nullptr);
+    assert(my_malloc_usable_size(kept) >= 100);  // The old block is left alone
+    assert(my_malloc_batch(SIZE_MAX, batch, 4) == 0);
+    assert(my_malloc_batch(SIZE_MAX / 2, batch, 4) == 0);
+    assert(wrap_heap.malloc(SIZE_MAX) == nullptr);
+    assert(wrap_heap.aligned_alloc(64, SIZE_MAX - 7) == nullptr);
+    my_free(kept);
+    std::cout << "Huge requests correctly returned nullptr\n";
+    
     print_heap_state();
 }
 
@@ -230,6 +327,83 @@ void test_fragmentation() {
     print_heap_state();
 }
 
+// Test 7: Boundary tags (backward coalescing without a heap walk)
+void test_boundary_tags() {
+    std::cout << "\n>>> Test 7: Boundary Tags\n";
+    std::cout << "Freeing blocks right-to-left and left-to-right to exercise both merge directions...\n";
+    
+    // Large requests so they are carved back-to-back from the big free block
+    void* a = my_malloc(20000);
+    void* b = my_malloc(20000);
+    void* c = my_malloc(20000);
+    void* guard = my_malloc(20000);
+    assert(a && b && c && guard);
+    
+    size_t before = get_fragmentation_count();
+    size_t merged_size = BlockHeader::get_header(a)->get_size() + BlockHeader::get_header(b)->get_size()
+                       + BlockHeader::get_header(c)->get_size();
+    
+    // a becomes a new free fragment
+    my_free(a);
+    assert(get_fragmentation_count() == before + 1);
+    
+    // b finds a through a's footer and merges backward: no new fragment
+    my_free(b);
+    assert(get_fragmentation_count() == before + 1);
+    
+    // c merges backward into a+b as well
+    my_free(c);
+    assert(get_fragmentation_count() == before + 1);
+    
+    // a's header now describes one free block spanning all three
+    BlockHeader* merged = BlockHeader::get_header(a);
+    assert(merged->is_free() && merged->get_size() == merged_size);
+    std::cout << "Three freed neighbours merged into one " << merged->get_size() << " byte block at " << a << "\n";
+    
+    my_free(guard);
+    
+    print_heap_state();
+}
+
+// Test 8: Unlinking from the middle of the doubly-linked free list
+void test_free_list_unlink() {
+    std::cout << "\n>>> Test 8: Free List Unlinking\n";
+    std::cout << "Forward-merging into a block that sits in the middle of the free list...\n";
+    
+    void* blocks[5];
+    for (int i = 0; i < 5; i++) {
+        blocks[i] = my_malloc(20000);
+        assert(blocks[i] != nullptr);
+    }
+    
+    size_t before = get_fragmentation_count();
+    size_t merged_size = BlockHeader::get_header(blocks[1])->get_size() + BlockHeader::get_header(blocks[2])->get_size()
+                       + BlockHeader::get_header(blocks[3])->get_size();
+    
+    // Free list becomes: blocks[3] -> blocks[1] -> ...
+    my_free(blocks[1]);
+    my_free(blocks[3]);
+    assert(get_fragmentation_count() == before + 2);
+    
+    // blocks[2] merges forward with blocks[3] (unlinked from the head) and
+    // backward into blocks[1] (which stays linked)
+    my_free(blocks[2]);
+    assert(get_fragmentation_count() == before + 1);
+    
+    // The merged block must be reusable as a whole
+    BlockHeader* merged = BlockHeader::get_header(blocks[1]);
+    assert(merged->is_free() && merged->get_size() == merged_size);
+    void* reused = my_malloc(merged_size - 64);
+    assert(reused != nullptr);
+    std::cout << "Merged block of " << merged_size << " bytes, reallocated at " << reused << "\n";
+    
+    my_free(reused);
+    my_free(blocks[0]);
+    my_free(blocks[4]);
+    
+    print_heap_state();
+}
+
 // Demonstration: Real-world usage pattern
 void demo_usage() {
     std::cout << "\n>>> Demonstration: Real-World Usage Pattern\n";
@@ -268,4 +442,1759 @@ void demo_usage() {
     std::cout << "All blocks freed - heap should be one large free block\n";
 }
 
+// Test 9: TLSF engine
+void test_tlsf_engine() {
+    std::cout << "\n>>> Test 9: TLSF Engine\n";
+    std::cout << "Re-initializing the allocator with the TLSF engine...\n";
+    
+    init_allocator(ENGINE_TLSF);
+    size_t heap_free = get_free_memory();
+    
+    // Mixed sizes (above the slab range) that land in many different first/second-level lists
+    void* blocks[32];
+    for (int i = 0; i < 32; i++) {
+        blocks[i] = my_malloc(300 + i * 97);
+        assert(blocks[i] != nullptr);
+        std::memset(blocks[i], i, 300 + i * 97);
+    }
+    
+    // Free every other block, then reuse the holes with slightly smaller requests
+    for (int i = 0; i < 32; i += 2) {
+        my_free(blocks[i]);
+    }
+    for (int i = 0; i < 32; i += 2) {
+        blocks[i] = my_malloc(280 + i * 90);
+        assert(blocks[i] != nullptr);
+    }
+    
+    // Odd blocks must be untouched by the reuse above
+    for (int i = 1; i < 32; i += 2) {
+        assert(static_cast<unsigned char*>(blocks[i])[0] == i);
+    }
+    
+    print_heap_state();
+    
+    for (int i = 0; i < 32; i++) {
+        my_free(blocks[i]);
+    }
+    
+    // Everything coalesces back into one block once the thread cache lets go
+    flush_thread_cache();
+    assert(get_fragmentation_count() == 1);
+    assert(get_free_memory() == heap_free);
+    std::cout << "All TLSF blocks freed and coalesced back into one block\n";
+    
+    // A request bigger than a region gets a new region that reaches its rounded-up size
+    void* big = my_malloc(2 * REGION_SIZE - 4096);
+    assert(big != nullptr);
+    my_free(big);
+    
+    // Leave the default engine in place for anyone running after us
+    init_allocator();
+}
+
+// Test 10: Slab front-end for small sizes
+void test_slab_allocator() {
+    std::cout << "\n>>> Test 10: Slab Allocator\n";
+    std::cout << "Allocating many small objects from slab pages...\n";
+    
+    // Warm up the 32-byte class so it owns one cached page
+    my_free(my_malloc(32));
+    flush_thread_cache();
+    size_t used_before = get_used_memory();
+    
+    // Enough objects to need several pages
+    const int count = 500;
+    void* objects[count];
+    for (int i = 0; i < count; i++) {
+        objects[i] = my_malloc(32);
+        assert(objects[i] != nullptr);
+        // Slots carry no header and are 16-byte aligned
+        assert(reinterpret_cast<uintptr_t>(objects[i]) % SLAB_SLOT_GRANULARITY == 0);
+        std::memset(objects[i], i & 0xFF, 32);
+    }
+    
+    // Slots are packed a whole number of slots apart (no per-object header)
+    char* first = static_cast<char*>(objects[0]);
+    char* second = static_cast<char*>(objects[1]);
+    assert((second > first ? second - first : first - second) % 32 == 0);
+    
+    for (int i = 0; i < count; i++) {
+        assert(static_cast<unsigned char*>(objects[i])[31] == (i & 0xFF));
+    }
+    
+    print_heap_state();
+    
+    // Double free of a slot is still detected
+    void* victim = objects[7];
+    my_free(victim);
+    std::cout << "Freed one slot, attempting double free...\n";
+    my_free(victim);  // Should print error message
+    
+    for (int i = 0; i < count; i++) {
+        if (i != 7) {
+            my_free(objects[i]);
+        }
+    }
+    
+    // Every extra page went back to the general heap
+    flush_thread_cache();
+    assert(get_used_memory() == used_before);
+    std::cout << "All slab objects freed, extra slab pages returned to the heap\n";
+    
+    // Sizes above SLAB_MAX_SIZE still use the general-purpose path
+    void* large = my_malloc(SLAB_MAX_SIZE + 1);
+    assert(large != nullptr);
+    assert(BlockHeader::get_header(large)->get_size() >= SLAB_MAX_SIZE + 1);
+    my_free(large);
+}
+
+// Worker for test_thread_cache: churns a window of live blocks and checks
+// that no other thread ever scribbles over them
+static void thread_cache_worker(int id, bool* ok) {
+    const int window = 64;
+    void* live[window] = {};
+    size_t sizes[window] = {};
+    unsigned seed = 12345u + id;
+    
+    for (int i = 0; i < 20000; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int slot = (seed >> 8) % window;
+        
+        if (live[slot]) {
+            // The pattern written at allocation time must still be there
+            unsigned char* bytes = static_cast<unsigned char*>(live[slot]);
+            if (bytes[0] != id || bytes[sizes[slot] - 1] != id) {
+                *ok = false;
+            }
+            my_free(live[slot]);
+        }
+        
+        sizes[slot] = 1 + (seed >> 16) % 1200;
+        live[slot] = my_malloc(sizes[slot]);
+        if (!live[slot]) {
+            *ok = false;
+            continue;
+        }
+        std::memset(live[slot], id, sizes[slot]);
+    }
+    
+    for (int i = 0; i < window; i++) {
+        my_free(live[i]);
+    }
+}
+
+// A thread_local made before its thread's first allocation is destroyed after the
+// thread's cache, like a free in a late destructor of a program using malloc_override.cpp
+struct LateFree {
+    void* block;
+    
+    LateFree() : block(nullptr) {}
+    ~LateFree() {
+        my_free(block);
+        void* late = my_malloc(200);
+        void* batch[4];
+        size_t count = my_malloc_batch(200, batch, 4);
+        my_free_batch(batch, count);
+        my_free(late);
+    }
+};
+
+static thread_local LateFree late_free;
+
+// Test 11: Thread caches
+void test_thread_cache() {
+    std::cout << "\n>>> Test 11: Thread Caches\n";
+    std::cout << "Running 4 threads that allocate and free concurrently...\n";
+    
+    flush_thread_cache();
+    size_t used_before = get_used_memory();
+    
+    const int num_threads = 4;
+    bool ok[num_threads];
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        ok[i] = true;
+        threads.push_back(std::thread(thread_cache_worker, i + 1, &ok[i]));
+    }
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].join();
+        assert(ok[i]);
+    }
+    
+    // Blocks allocated on one thread may be freed on another
+    void* shared = my_malloc(200);
+    std::thread consumer([shared]() { my_free(shared); });
+    consumer.join();
+    
+    // Calls made after a thread's cache is destroyed go straight to its arena, and
+    // are still counted
+    HeapStats before = get_heap_stats();
+    std::thread exiting([]() {
+        LateFree& holder = late_free;
+        holder.block = my_malloc(200);
+    });
+    exiting.join();
+    HeapStats after = get_heap_stats();
+    uint64_t late_mallocs = 0;
+    uint64_t late_frees = 0;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        late_mallocs += after.malloc_counts[i] - before.malloc_counts[i];
+        late_frees += after.free_counts[i] - before.free_counts[i];
+    }
+    assert(late_mallocs == 6 && late_frees == 6);
+    
+    // Exiting threads flushed their caches, so nothing leaked. Only the slab
+    // pages each class keeps around can remain in use.
+    size_t slack = NUM_SLAB_CLASSES * (SLAB_PAGE_SIZE + 64);
+    assert(get_used_memory() <= used_before + slack);
+    std::cout << "All threads finished; memory in use: " << get_used_memory() << " bytes\n";
+}
+
+// Test 12: Multiple arenas
+void test_arenas() {
+    std::cout << "\n>>> Test 12: Multiple Arenas\n";
+    
+    init_allocator(ENGINE_SEGREGATED_FIT, 4);
+    assert(get_arena_count() == 4);
+    std::cout << "Heap split into " << get_arena_count() << " arenas\n";
+    
+    // Each new thread is assigned the next arena in turn (of the arenas on its NUMA node,
+    // so threads may share one on a NUMA machine)
+    const int num_threads = 4;
+    void* blocks[num_threads];
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        threads.push_back(std::thread([&blocks, i]() { blocks[i] = my_malloc(2000); }));
+    }
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].join();
+        assert(blocks[i] != nullptr);
+        for (int j = 0; j < i && get_numa_node_count() == 1; j++) {
+            assert(get_arena_index(blocks[i]) != get_arena_index(blocks[j]));
+        }
+    }
+    
+    // Freeing from another thread queues each block on the arena that owns it
+    // (statistics drain the queues first)
+    for (int i = 0; i < num_threads; i++) {
+        my_free(blocks[i]);
+    }
+    assert(get_fragmentation_count() == 4);  // One free block per arena
+    
+    // Concurrent churn works the same with several arenas
+    bool ok[num_threads];
+    threads.clear();
+    for (int i = 0; i < num_threads; i++) {
+        ok[i] = true;
+        threads.push_back(std::thread(thread_cache_worker, i + 1, &ok[i]));
+    }
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].join();
+        assert(ok[i]);
+    }
+    std::cout << "All threads finished; memory in use: " << get_used_memory() << " bytes\n";
+    
+    init_allocator();  // Back to a single arena
+}
+
+// Test 13: Remote frees between a producer and a consumer thread
+void test_remote_free() {
+    std::cout << "\n>>> Test 13: Remote Frees\n";
+    
+    init_allocator(ENGINE_SEGREGATED_FIT, 2);
+    
+    // The producer allocates messages in its arena, the consumer frees them from the other
+    const int num_messages = 100;
+    void* messages[num_messages];
+    size_t producer_arena = 0;
+    bool reused = false;
+    
+    std::thread producer([&]() {
+        for (int i = 0; i < num_messages; i++) {
+            messages[i] = my_malloc(3000);
+            assert(messages[i] != nullptr);
+        }
+        producer_arena = get_arena_index(messages[0]);
+        
+        std::thread consumer([&]() {
+            void* own = my_malloc(16);  // This thread gets the other arena
+            assert(get_arena_index(own) != producer_arena);
+            for (int i = 0; i < num_messages; i++) {
+                my_free(messages[i]);  // Queued without taking the producer's lock
+            }
+            my_free(own);
+        });
+        consumer.join();
+        
+        // The next allocation drains the queue, so the freed messages are reused
+        void* again = my_malloc(3000);
+        reused = (again == messages[0]);
+        my_free(again);
+    });
+    producer.join();
+    
+    assert(reused);
+    std::cout << "Consumer freed " << num_messages << " messages from the producer's arena "
+              << producer_arena << "; producer reused them\n";
+    
+    init_allocator();
+}
+
+// Test 14: The heap grows in regions from the OS
+void test_growable_heap() {
+    std::cout << "\n>>> Test 14: Growable Heap\n";
+    
+    init_allocator();
+    assert(get_heap_size() == REGION_SIZE);
+    
+    // More than one region's worth of blocks, plus one block bigger than a region
+    void* blocks[4];
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = my_malloc(600 * 1024);
+        assert(blocks[i] != nullptr);
+        std::memset(blocks[i], i, 600 * 1024);
+    }
+    blocks[3] = my_malloc(3 * REGION_SIZE);
+    assert(blocks[3] != nullptr);
+    std::memset(blocks[3], 3, 3 * REGION_SIZE);
+    
+    // 3 regions of one REGION_SIZE, and one of 4 for the big block (it needs room for the region header)
+    std::cout << "Heap grew to " << (get_heap_size() / 1024) << " KB\n";
+    assert(get_heap_size() == 7 * REGION_SIZE);
+    
+    // Blocks only coalesce within their own region: one free block per region
+    for (int i = 0; i < 4; i++) {
+        my_free(blocks[i]);
+    }
+    assert(get_fragmentation_count() == 4);
+    
+    // init_allocator() gives the extra regions back to the OS
+    init_allocator();
+    assert(get_heap_size() == REGION_SIZE);
+}
+
+// Test 15: Returning free pages to the OS
+void test_purge() {
+    std::cout << "\n>>> Test 15: Purging Free Memory\n";
+    
+    init_allocator();
+    set_purge_decay(0);
+    
+    // Touch half a megabyte, then free it: its pages are dirty until purged
+    void* big = my_malloc(512 * 1024);
+    assert(big != nullptr);
+    std::memset(big, 0xAB, 512 * 1024);
+    my_free(big);
+    
+    size_t released = purge_free_memory();
+    std::cout << "Purged " << released << " bytes\n";
+    assert(released >= 512 * 1024);
+    assert(purge_free_memory() == 0);  // Nothing dirty left
+    
+    // The purged memory is still usable
+    big = my_malloc(512 * 1024);
+    assert(big != nullptr);
+    std::memset(big, 0xCD, 512 * 1024);
+    my_free(big);
+    
+    // Automatic purging: the first pass after a decay period ages the free block,
+    // the next one releases it
+    set_purge_decay(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    void* a = my_malloc(2000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    void* b = my_malloc(2000);
+    assert(purge_free_memory() == 0);
+    std::cout << "Decay pass released the idle pages\n";
+    my_free(a);
+    my_free(b);
+    
+    set_purge_decay(PURGE_DECAY_MS);
+    init_allocator();
+}
+
+// Test 16: 8-byte headers with flags packed into the size
+void test_compact_header() {
+    std::cout << "\n>>> Test 16: Compact Headers\n";
+    
+    assert(sizeof(BlockHeader) == 8);
+    
+    // An allocated block only pays for its header: no footer, no free list links
+    void* a = my_malloc(2040);
+    void* b = my_malloc(2040);
+    void* c = my_malloc(2040);
+    assert(a && b && c);
+    BlockHeader* header_b = BlockHeader::get_header(b);
+    assert(header_b->get_size() == sizeof(BlockHeader) + 2040);
+    assert(static_cast<char*>(b) - static_cast<char*>(a) == 2048);
+    assert(!header_b->is_free() && !header_b->is_prev_free());
+    
+    // Freeing a sets the PREV_FREE flag of b, which lets b find a through a's footer
+    my_free(a);
+    assert(BlockHeader::get_header(a)->is_free());
+    assert(header_b->is_prev_free());
+    assert(header_b->get_size() == 2048);  // Flags don't leak into the size
+    
+    my_free(b);
+    assert(BlockHeader::get_header(a)->get_size() == 2 * 2048);
+    assert(BlockHeader::get_header(c)->is_prev_free());
+    std::cout << "Header is " << sizeof(BlockHeader) << " bytes; freed neighbours still merge in O(1)\n";
+    
+    my_free(c);
+}
+
+// Test 17: Aligned allocation
+void test_aligned_alloc() {
+    std::cout << "\n>>> Test 17: Aligned Allocation\n";
+    
+    flush_thread_cache();
+    size_t used_before = get_used_memory();
+    
+    // SIMD vectors and cache-line padded objects, up to a whole page
+    void* blocks[32];
+    int count = 0;
+    for (size_t alignment = 16; alignment <= 4096; alignment *= 2) {
+        for (size_t size = 300; size <= 3000; size += 1400) {
+            void* ptr = my_aligned_alloc(alignment, size);
+            assert(ptr != nullptr);
+            assert(reinterpret_cast<uintptr_t>(ptr) % alignment == 0);
+            std::memset(ptr, 0x5A, size);
+            blocks[count++] = ptr;
+        }
+    }
+    std::cout << count << " aligned blocks allocated (16 to 4096 byte alignment)\n";
+    
+    void* line = my_memalign(64, 64);
+    assert(line && reinterpret_cast<uintptr_t>(line) % 64 == 0);
+    
+    // An alignment that isn't a power of two is rejected
+    assert(my_aligned_alloc(24, 100) == nullptr);  // Should print error message
+    
+    // my_free works unchanged, and the padding blocks merge back
+    my_free(line);
+    for (int i = 0; i < count; i++) {
+        my_free(blocks[i]);
+    }
+    flush_thread_cache();
+    assert(get_used_memory() == used_before);
+}
+
+// Test 18: realloc in place
+void test_realloc() {
+    std::cout << "\n>>> Test 18: Realloc\n";
+    
+    init_allocator();
+    
+    // Vector-style growth: with free space behind it, the buffer never moves
+    size_t size = 2000;
+    char* buffer = static_cast<char*>(my_malloc(size));
+    assert(buffer != nullptr);
+    std::memset(buffer, 'v', size);
+    while (size < 64 * 1024) {
+        size_t new_size = size * 3 / 2;
+        char* grown = static_cast<char*>(my_realloc(buffer, new_size));
+        assert(grown == buffer);
+        std::memset(grown + size, 'v', new_size - size);
+        size = new_size;
+    }
+    std::cout << "Grew to " << size << " bytes without moving\n";
+    
+    // Shrinking splits off the tail in place
+    size_t used_before = get_used_memory();
+    assert(my_realloc(buffer, 3000) == buffer);
+    assert(get_used_memory() < used_before);
+    size = 3000;
+    
+    // Blocked by a neighbour in use: the data is copied
+    void* neighbour = my_malloc(5000);
+    assert(neighbour == buffer + 3000 + sizeof(BlockHeader));
+    char* moved = static_cast<char*>(my_realloc(buffer, 10000));
+    assert(moved != nullptr && moved != buffer);
+    for (size_t i = 0; i < size; i++) {
+        assert(moved[i] == 'v');
+    }
+    std::cout << "Moved to a new block when the neighbour was in use\n";
+    
+    // Small slab slots stay put when the request still fits, and move out otherwise
+    char* small = static_cast<char*>(my_malloc(20));
+    std::strcpy(small, "slab");
+    assert(my_realloc(small, 30) == small);
+    char* big = static_cast<char*>(my_realloc(small, 400));
+    assert(big != small && std::strcmp(big, "slab") == 0);
+    
+    // realloc(nullptr, n) is malloc, realloc(p, 0) is free
+    void* fresh = my_realloc(nullptr, 100);
+    assert(fresh != nullptr);
+    assert(my_realloc(fresh, 0) == nullptr);
+    
+    // Usable size covers the request; foreign pointers report 0 quietly
+    assert(my_malloc_usable_size(moved) >= 10000);
+    assert(my_malloc_usable_size(big) >= 400);
+    int on_stack = 0;
+    assert(my_malloc_usable_size(&on_stack) == 0);
+    assert(my_malloc_usable_size(nullptr) == 0);
+    
+    my_free(big);
+    my_free(moved);
+    my_free(neighbour);
+    init_allocator();
+}
+
+// Test 19: Batch allocation and free
+void test_batch() {
+    std::cout << "\n>>> Test 19: Batch Allocation\n";
+    
+    init_allocator();
+    
+    // Parser nodes: one search and one split sequence for all of them
+    const size_t num_nodes = 40;
+    void* nodes[num_nodes];
+    assert(my_malloc_batch(500, nodes, num_nodes) == num_nodes);
+    for (size_t i = 0; i < num_nodes; i++) {
+        std::memset(nodes[i], static_cast<int>(i), 500);
+        if (i > 0) {
+            // Carved back to back out of the same free block
+            assert(static_cast<char*>(nodes[i]) - static_cast<char*>(nodes[i - 1]) ==
+                   static_cast<ptrdiff_t>(BlockHeader::get_header(nodes[i - 1])->get_size()));
+        }
+    }
+    std::cout << "Allocated " << num_nodes << " nodes of 500 bytes in one batch\n";
+    
+    // Free in scrambled order: sorting first lets every run merge in one pass
+    for (size_t i = 0; i < num_nodes; i += 2) {
+        void* tmp = nodes[i];
+        nodes[i] = nodes[num_nodes - 1 - i];
+        nodes[num_nodes - 1 - i] = tmp;
+    }
+    my_free_batch(nodes, num_nodes);
+    assert(get_fragmentation_count() == 1);
+    std::cout << "Batch free merged everything back into " << get_fragmentation_count() << " free block\n";
+    
+    // Duplicates in a batch are caught like any double free
+    void* twice[2];
+    twice[0] = twice[1] = my_malloc(2000);
+    my_free_batch(twice, 2);  // Should print error message
+    assert(get_fragmentation_count() == 1);
+    
+    // Small sizes come from the slab layer; only the one page a class keeps stays in use
+    void* small[100];
+    assert(my_malloc_batch(32, small, 100) == 100);
+    my_free_batch(small, 100);
+    assert(get_used_memory() <= SLAB_PAGE_SIZE + 64);
+    
+    // A batch from another thread's arena is queued for it, like any remote free
+    init_allocator(ENGINE_SEGREGATED_FIT, 2);
+    const size_t num_messages = 20;
+    void* messages[num_messages];
+    bool reused = false;
+    std::thread producer([&]() {
+        assert(my_malloc_batch(3000, messages, num_messages) == num_messages);
+        size_t producer_arena = get_arena_index(messages[0]);
+        
+        std::thread consumer([&]() {
+            void* own = my_malloc(16);  // This thread gets the other arena
+            assert(get_arena_index(own) != producer_arena);
+            my_free_batch(messages, num_messages);  // Never takes the producer's lock
+            my_free(own);
+        });
+        consumer.join();
+        
+        // Pending until the producer's arena drains them with its next allocation
+        HeapStats stats = get_heap_stats();
+        assert(stats.pending_free_memory >= num_messages * 3000);
+        void* again = my_malloc(3000);
+        HeapStats drained = get_heap_stats();
+        reused = (drained.pending_free_memory == 0 && drained.free_memory > stats.free_memory &&
+                  get_arena_index(again) == producer_arena);
+        my_free(again);
+    });
+    producer.join();
+    assert(reused);
+    std::cout << "Batch freed from another arena was queued and reused by its owner\n";
+    init_allocator();
+}
+
+// Test 20: STL containers on the heap
+struct alignas(64) CacheLine {
+    char bytes[64];
+};
+
+void test_stl_allocator() {
+    std::cout << "\n>>> Test 20: STL Allocator\n";
+    
+    init_allocator();
+    size_t used_before = get_used_memory();
+    
+    {
+        // Every element buffer the containers ask for comes from my_malloc
+        std::vector<int, FreeListAllocator<int>> values;
+        for (int i = 0; i < 10000; i++) {
+            values.push_back(i);
+        }
+        assert(my_malloc_usable_size(values.data()) >= values.size() * sizeof(int));
+        
+        typedef FreeListAllocator<std::pair<const int, int>> MapAllocator;
+        std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, MapAllocator> squares;
+        std::list<int, FreeListAllocator<int>> order;
+        for (int i = 0; i < 1000; i++) {
+            squares[i] = i * i;
+            order.push_back(i);
+        }
+        assert(squares[30] == 900 && order.back() == 999);
+        assert(get_used_memory() > used_before);
+        
+        // Over-aligned element types still get their alignment
+        std::vector<CacheLine, FreeListAllocator<CacheLine>> lines(5);
+        assert(reinterpret_cast<uintptr_t>(lines.data()) % 64 == 0);
+        
+        // Rebound copies of an allocator are interchangeable
+        FreeListAllocator<int> int_alloc;
+        FreeListAllocator<double> double_alloc(int_alloc);
+        assert(int_alloc == double_alloc);
+        
+        // Zero elements is a valid request that still gets a block of its own
+        int* none = int_alloc.allocate(0);
+        CacheLine* no_lines = lines.get_allocator().allocate(0);
+        assert(none && no_lines && static_cast<void*>(none) != static_cast<void*>(no_lines));
+        assert(reinterpret_cast<uintptr_t>(no_lines) % 64 == 0);
+        int_alloc.deallocate(none, 0);
+        lines.get_allocator().deallocate(no_lines, 0);
+        
+        // Running out of memory throws like std::allocator
+        bool threw = false;
+        try {
+            values.get_allocator().allocate(HEAP_RESERVE_SIZE / sizeof(int));
+        } catch (const std::bad_alloc&) {
+            threw = true;
+        }
+        assert(threw);
+        std::cout << "vector, unordered_map and list all ran on the free-list heap\n";
+    }
+    
+#ifdef ALLOCATOR_HAS_PMR
+    {
+        FreeListResource heap;
+        std::pmr::vector<std::pmr::string> names(&heap);
+        for (int i = 0; i < 100; i++) {
+            names.emplace_back(std::to_string(i) + " is a name too long for the small string buffer");
+        }
+        assert(my_malloc_usable_size(names.data()) != 0);
+        assert(my_malloc_usable_size(names[50].data()) != 0);  // Elements use the resource too
+        
+        // As the upstream of a pool, the heap only sees the pool's big chunks
+        std::pmr::unsynchronized_pool_resource pool(&heap);
+        std::pmr::list<int> numbers(&pool);
+        for (int i = 0; i < 1000; i++) {
+            numbers.push_back(i);
+        }
+        FreeListResource other;
+        assert(heap == other);
+        
+        // So is zero bytes for a resource, at any alignment
+        void* empty = heap.allocate(0, 1);
+        void* aligned_empty = heap.allocate(0, 128);
+        assert(empty && aligned_empty && empty != aligned_empty);
+        assert(reinterpret_cast<uintptr_t>(aligned_empty) % 128 == 0);
+        heap.deallocate(empty, 0, 1);
+        heap.deallocate(aligned_empty, 0, 128);
+        std::cout << "std::pmr containers ran on the free-list heap\n";
+    }
+#endif
+    
+    // Destroyed containers gave everything back (each slab class keeps one empty page)
+    flush_thread_cache();
+    assert(get_used_memory() <= used_before + NUM_SLAB_CLASSES * (SLAB_PAGE_SIZE + 64));
+    init_allocator();
+}
+
+// Test 21: Independent heaps over caller memory
+void test_heap_instances() {
+    std::cout << "\n>>> Test 21: Heap Instances\n";
+    
+    init_allocator();
+    size_t default_used = get_used_memory();
+    
+    // Any buffer will do, even one that isn't aligned
+    const size_t buffer_size = 512 * 1024;
+    std::vector<char> buffer(buffer_size + 3);
+    char* memory = buffer.data() + 3;
+    {
+        Heap heap(memory, buffer_size);
+        void* a = heap.malloc(1000);
+        void* b = heap.malloc(40);      // Slab slot
+        void* c = heap.aligned_alloc(256, 500);
+        assert(a && b && c);
+        assert(heap.contains(a) && heap.contains(b) && heap.contains(c));
+        assert(static_cast<char*>(a) >= memory && static_cast<char*>(a) < memory + buffer_size);
+        assert(reinterpret_cast<uintptr_t>(a) % ALIGN_SIZE == 0);
+        assert(reinterpret_cast<uintptr_t>(c) % 256 == 0);
+        
+        // The default heap neither sees nor serves these blocks
+        assert(my_malloc_usable_size(a) == 0);
+        assert(get_used_memory() == default_used);
+        void* outside = my_malloc(1000);
+        assert(!heap.contains(outside));
+        my_free(outside);
+        
+        // realloc keeps the data, staying inside this heap
+        std::strcpy(static_cast<char*>(a), "own heap");
+        assert(heap.realloc(a, 200) == a);
+        a = heap.realloc(a, 3000);
+        assert(heap.contains(a) && heap.usable_size(a) >= 3000);
+        assert(std::strcmp(static_cast<char*>(a), "own heap") == 0);
+        
+        heap.free(a);
+        heap.free(b);
+        heap.free(c);
+        assert(heap.get_fragmentation_count() <= 2);  // At most the slab page stays split off
+        
+        // The heap never grows past the caller's memory
+        std::vector<void*> blocks;
+        while (void* ptr = heap.malloc(10000)) {
+            blocks.push_back(ptr);
+        }
+        assert(blocks.size() > 40 && blocks.size() < buffer_size / 10000);
+        assert(heap.get_heap_size() <= buffer_size);
+        heap.free_batch(blocks.data(), blocks.size());
+        assert(heap.malloc(400 * 1024) != nullptr);
+        std::cout << "A 512 KB heap held " << blocks.size() << " blocks of 10000 bytes, then ran out\n";
+    }
+    
+    // Containers can be pointed at a dedicated heap
+    {
+        Heap heap(memory, buffer_size, ENGINE_TLSF);
+        FreeListAllocator<int> allocator(heap);
+        std::vector<int, FreeListAllocator<int>> values(allocator);
+        for (int i = 0; i < 10000; i++) {
+            values.push_back(i);
+        }
+        assert(heap.contains(values.data()));
+        assert(allocator != FreeListAllocator<int>());
+        assert(FreeListAllocator<int>().get_heap() == &get_default_heap());
+    }
+    
+    // Several threads sharing a heap with two arenas (each gets a region of its own)
+    {
+        std::vector<char> large(3 * REGION_SIZE);
+        Heap heap(large.data(), large.size(), ENGINE_SEGREGATED_FIT, 2);
+        assert(heap.get_arena_count() == 2);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.push_back(std::thread([&heap, t]() {
+                void* live[8] = {};
+                for (int i = 0; i < 2000; i++) {
+                    int slot = i % 8;
+                    heap.free(live[slot]);
+                    live[slot] = heap.malloc(16 + (i * 37 + t) % 2000);
+                    assert(live[slot] != nullptr);
+                }
+                for (int slot = 0; slot < 8; slot++) {
+                    heap.free(live[slot]);
+                }
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); t++) {
+            threads[t].join();
+        }
+        assert(heap.get_used_memory() <= 2 * NUM_SLAB_CLASSES * (SLAB_PAGE_SIZE + 64));
+        std::cout << "4 threads shared a 2-arena heap\n";
+    }
+    
+    // Too little memory for the bookkeeping: every call fails cleanly
+    {
+        char tiny[64];
+        Heap heap(tiny, sizeof(tiny));
+        assert(heap.malloc(8) == nullptr);
+        assert(!heap.contains(tiny));
+    }
+    
+    // The default heap is a Heap as well
+    void* ptr = get_default_heap().malloc(100);
+    assert(ptr != nullptr && my_malloc_usable_size(ptr) >= 100);
+    my_free(ptr);
+    init_allocator();
+}
+
+// Test 22: Monotonic (bump-pointer) heap
+void test_monotonic_heap() {
+    std::cout << "\n>>> Test 22: Monotonic Heap\n";
+    
+    init_allocator();
+    void* long_lived = my_malloc(1000);
+    size_t fragments_before = get_fragmentation_count();
+    
+    {
+        MonotonicHeap scratch;
+        
+        // Blocks follow each other with no header in between
+        char* a = static_cast<char*>(scratch.malloc(32));
+        char* b = static_cast<char*>(scratch.malloc(40));
+        assert(a && b && b == a + 32);
+        void* aligned = scratch.aligned_alloc(64, 10);
+        assert(reinterpret_cast<uintptr_t>(aligned) % 64 == 0);
+        
+        // Rewinding to a marker hands the same memory out again
+        MonotonicHeap::Marker marker = scratch.get_marker();
+        void* temp = scratch.malloc(500);
+        for (int i = 0; i < 200; i++) {
+            scratch.malloc(1000);  // Spills over into more chunks
+        }
+        scratch.rewind(marker);
+        assert(scratch.malloc(500) == temp);
+        
+        // A request bigger than a chunk gets a chunk of its own
+        char* big = static_cast<char*>(scratch.malloc(3 * MONOTONIC_CHUNK_SIZE));
+        assert(big != nullptr);
+        std::memset(big, 1, 3 * MONOTONIC_CHUNK_SIZE);
+        
+        // Request loop: reset reuses the same chunks, so the heap sees no traffic
+        scratch.reset();
+        size_t reserved = scratch.get_reserved_memory();
+        for (int request = 0; request < 100; request++) {
+            assert(scratch.malloc(32) == a);
+            for (int i = 0; i < 100; i++) {
+                std::memset(scratch.malloc(100 + i), request, 100 + i);
+            }
+            scratch.reset();
+        }
+        assert(scratch.get_reserved_memory() == reserved);
+        assert(get_fragmentation_count() == fragments_before);
+        std::cout << "100 requests ran in " << reserved / 1024 << " KB of reused chunks\n";
+    }
+    
+    // Destruction gave every chunk back
+    assert(get_fragmentation_count() == fragments_before);
+    
+    // It can sit on a dedicated heap as well
+    std::vector<char> buffer(1024 * 1024);
+    Heap heap(buffer.data(), buffer.size());
+    {
+        MonotonicHeap scratch(heap, 4096);
+        void* ptr = scratch.malloc(100);
+        assert(heap.contains(ptr));
+        while (scratch.malloc(1000)) {
+        }
+        assert(heap.malloc(5000) == nullptr);  // The scratch heap took every chunk it could
+    }
+    assert(heap.malloc(1000) != nullptr);
+    
+    my_free(long_lived);
+    init_allocator();
+}
+
+// Test 23: Huge-page backed regions
+void test_huge_pages() {
+    std::cout << "\n>>> Test 23: Huge Pages\n";
+    
+    HugePageMode modes[] = {HUGE_PAGES_TRANSPARENT, HUGE_PAGES_EXPLICIT};
+    for (size_t m = 0; m < 2; m++) {
+        init_allocator(ENGINE_SEGREGATED_FIT, 2, modes[m]);
+        
+        // Regions come in whole, aligned huge pages
+        void* small = my_malloc(3000);
+        void* large = my_malloc(5 * HUGE_PAGE_SIZE);
+        assert(small && large);
+        assert(get_heap_size() % HUGE_PAGE_SIZE == 0);
+        std::memset(large, 7, 5 * HUGE_PAGE_SIZE);
+        
+        // Purging only ever releases whole huge pages, never part of one
+        void* hole = my_malloc(HUGE_PAGE_SIZE / 2);
+        void* guard = my_malloc(3000);
+        std::memset(hole, 1, HUGE_PAGE_SIZE / 2);
+        my_free(hole);
+        my_free(large);
+        size_t released = purge_free_memory();
+        assert(released >= 4 * HUGE_PAGE_SIZE);
+        assert(released % HUGE_PAGE_SIZE == 0);
+        std::cout << (m == 0 ? "Transparent" : "Reserved") << " huge pages: released "
+                  << released / HUGE_PAGE_SIZE << " huge pages\n";
+        
+        my_free(small);
+        my_free(guard);
+    }
+    
+    init_allocator();
+}
+
+// Test 24: Recording an allocation trace
+void test_trace() {
+    std::cout << "\n>>> Test 24: Allocation Trace\n";
+    
+    const char* path = "allocator_test_trace.bin";
+    assert(start_trace(path));
+    assert(!start_trace(path));  // Already running
+    
+    void* a = my_malloc(100);
+    void* b = my_aligned_alloc(64, 200);
+    void* c = my_realloc(a, 3000);
+    my_free(b);
+    my_free(c);
+    
+    // Events of a thread that exits are written out by the thread itself
+    std::thread worker([]() {
+        void* ptrs[4];
+        size_t count = my_malloc_batch(48, ptrs, 4);
+        my_free_batch(ptrs, count);
+    });
+    worker.join();
+    
+    // Calls made after a thread's buffer is destroyed are written one at a time
+    void* late_block = nullptr;
+    std::thread exiting([&late_block]() {
+        LateFree& holder = late_free;
+        holder.block = late_block = my_malloc(300);
+    });
+    exiting.join();
+    
+    stop_trace();
+    void* untraced = my_malloc(10);
+    my_free(untraced);
+    
+    std::FILE* file = std::fopen(path, "rb");
+    assert(file);
+    char magic[TRACE_MAGIC_SIZE];
+    assert(std::fread(magic, 1, TRACE_MAGIC_SIZE, file) == TRACE_MAGIC_SIZE);
+    assert(std::memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0);
+    TraceEvent events[32];
+    size_t count = std::fread(events, sizeof(TraceEvent), 32, file);
+    std::fclose(file);
+    std::remove(path);
+    
+    // The worker wrote its 8 events first (at thread exit), then the exiting thread its
+    // buffered malloc and the 11 calls of LateFree, then stop_trace() wrote ours
+    assert(count == 25);
+    uint16_t worker_thread = events[0].thread;
+    for (size_t i = 0; i < 8; i++) {
+        assert(events[i].thread == worker_thread);
+        assert(events[i].op == (i < 4 ? TRACE_MALLOC : TRACE_FREE));
+    }
+    TraceEvent* late_events = events + 8;
+    assert(late_events[0].op == TRACE_MALLOC && late_events[0].ptr == reinterpret_cast<uintptr_t>(late_block));
+    assert(late_events[1].op == TRACE_FREE && late_events[1].ptr == reinterpret_cast<uintptr_t>(late_block));
+    for (size_t i = 1; i < 12; i++) {
+        assert(late_events[i].thread == late_events[0].thread && late_events[i].thread != worker_thread);
+    }
+    
+    TraceEvent* main_events = events + 20;
+    assert(main_events[0].op == TRACE_MALLOC && main_events[0].size == 100);
+    assert(main_events[0].ptr == reinterpret_cast<uintptr_t>(a));
+    assert(main_events[1].op == TRACE_ALIGNED_ALLOC && main_events[1].arg == 64);
+    assert(main_events[2].op == TRACE_REALLOC && main_events[2].arg == reinterpret_cast<uintptr_t>(a));
+    assert(main_events[2].ptr == reinterpret_cast<uintptr_t>(c) && main_events[2].size == 3000);
+    assert(main_events[3].op == TRACE_FREE && main_events[3].ptr == reinterpret_cast<uintptr_t>(b));
+    assert(main_events[4].op == TRACE_FREE && main_events[4].ptr == reinterpret_cast<uintptr_t>(c));
+    for (size_t i = 1; i < 5; i++) {
+        assert(main_events[i].thread != worker_thread && main_events[i].thread != late_events[0].thread);
+        assert(main_events[i].timestamp >= main_events[i - 1].timestamp);
+    }
+    std::cout << "Recorded " << count << " events from 3 threads\n";
+}
+
+// Size class of a block in HeapStats (floor of log2 of its usable size)
+static size_t stats_class(size_t usable_size) {
+    size_t size_class = 0;
+    while (usable_size >>= 1) {
+        size_class++;
+    }
+    return size_class;
+}
 
+// Test 25: Statistics from running counters
+void test_heap_stats() {
+    std::cout << "\n>>> Test 25: Heap Statistics\n";
+    
+    init_allocator(ENGINE_SEGREGATED_FIT, 2);
+    HeapStats before = get_heap_stats();
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        assert(before.malloc_counts[i] == 0 && before.free_counts[i] == 0);
+    }
+    
+    // Cached small blocks, slab slots and general blocks are all counted
+    void* small[20];
+    for (size_t i = 0; i < 20; i++) {
+        small[i] = my_malloc(40);
+    }
+    void* large = my_malloc(5000);
+    size_t small_class = stats_class(my_malloc_usable_size(small[0]));
+    size_t large_class = stats_class(my_malloc_usable_size(large));
+    
+    HeapStats stats = get_heap_stats();
+    assert(stats.malloc_counts[small_class] == 20);
+    assert(stats.malloc_counts[large_class] == 1);
+    assert(stats.used_memory == get_used_memory());
+    assert(stats.free_memory == get_free_memory());
+    assert(stats.free_block_count == get_fragmentation_count());
+    assert(stats.heap_size == get_heap_size());
+    assert(stats.used_memory >= 5000 + 20 * 40);
+    assert(stats.largest_free_block > 0 && stats.largest_free_block <= stats.free_memory);
+    
+    for (size_t i = 0; i < 20; i++) {
+        my_free(small[i]);
+    }
+    my_free(large);
+    
+    // Calls of threads that have exited still count
+    std::thread worker([]() {
+        for (size_t i = 0; i < 10; i++) {
+            my_free(my_malloc(3000));
+        }
+    });
+    worker.join();
+    
+    stats = get_heap_stats();
+    assert(stats.free_counts[small_class] == 20);
+    assert(stats.free_counts[large_class] == 1);
+    uint64_t mallocs = 0;
+    uint64_t frees = 0;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        mallocs += stats.malloc_counts[i];
+        frees += stats.free_counts[i];
+    }
+    assert(mallocs == 31 && frees == 31);
+    
+    // A heap without thread caches counts in its arenas, and the largest free block
+    // is found without walking the heap
+    std::vector<char> buffer(2 * REGION_SIZE);
+    Heap heap(buffer.data(), buffer.size());
+    void* hole = heap.malloc(300000);
+    void* keep = heap.malloc(1000);
+    HeapStats heap_stats = heap.get_stats();
+    assert(heap_stats.free_block_count == 1);
+    assert(heap_stats.largest_free_block == heap_stats.free_memory);
+    assert(heap_stats.malloc_counts[stats_class(heap.usable_size(keep))] >= 1);
+    
+    heap.free(hole);
+    heap_stats = heap.get_stats();
+    assert(heap_stats.free_block_count == heap.get_fragmentation_count());
+    assert(heap_stats.largest_free_block >= 300000);
+    assert(heap_stats.largest_free_block < heap_stats.free_memory);
+    assert(heap_stats.free_counts[stats_class(300000)] == 1);
+    heap.free(keep);
+    
+    // The largest block of the top list is found wherever it sits in the list
+    const AllocatorEngine list_engines[] = {ENGINE_SEGREGATED_FIT, ENGINE_TLSF};
+    for (size_t e = 0; e < 2; e++) {
+        std::vector<char> list_buffer(2 * REGION_SIZE);
+        Heap list_heap(list_buffer.data(), list_buffer.size(), list_engines[e]);
+        void* big = list_heap.malloc(500000);
+        void* fence = list_heap.malloc(1000);
+        void* small = list_heap.malloc(495000);
+        void* end_fence = list_heap.malloc(1000);
+        size_t big_size = list_heap.usable_size(big);
+        list_heap.free(big);
+        list_heap.free(small);
+        assert(list_heap.get_stats().largest_free_block == big_size);
+        list_heap.free(fence);
+        list_heap.free(end_fence);
+    }
+    
+    std::cout << "Counted " << mallocs << " mallocs and " << frees << " frees; largest free block "
+              << heap_stats.largest_free_block << " bytes\n";
+    init_allocator();
+}
+
+// Number of times a piece of text occurs in a string
+static size_t count_occurrences(const std::string& text, const std::string& piece) {
+    size_t count = 0;
+    for (size_t at = text.find(piece); at != std::string::npos; at = text.find(piece, at + 1)) {
+        count++;
+    }
+    return count;
+}
+
+// Test 26: Exporting the heap layout as JSON
+void test_heap_export() {
+    std::cout << "\n>>> Test 26: Heap Layout Export\n";
+    
+    std::vector<char> buffer(REGION_SIZE);
+    Heap heap(buffer.data(), buffer.size(), ENGINE_TLSF);
+    void* a = heap.malloc(1000);
+    void* b = heap.malloc(2000);
+    void* c = heap.malloc(3000);
+    void* slot = heap.malloc(32);
+    heap.free(b);
+    
+    std::ostringstream out;
+    heap.export_json(out);
+    std::string json = out.str();
+    
+    // a and c, the slab page holding slot, and the free blocks (the hole left by b,
+    // the padding in front of the page-aligned slab page and the rest of the region)
+    assert(json[0] == '{' && json.substr(json.size() - 2) == "}\n");
+    assert(count_occurrences(json, "{") == count_occurrences(json, "}"));
+    assert(count_occurrences(json, "[") == count_occurrences(json, "]"));
+    assert(count_occurrences(json, ",\"u\"]") == 2);
+    assert(count_occurrences(json, ",\"f\"]") == heap.get_fragmentation_count());
+    assert(count_occurrences(json, ",\"s\",") == 1);
+    assert(json.find("\"engine\":\"tlsf\"") != std::string::npos);
+    
+    // The metrics agree with the running statistics
+    HeapStats stats = heap.get_stats();
+    std::ostringstream expected;
+    expected << "\"free_bytes\":" << stats.free_memory << ",\"free_blocks\":" << stats.free_block_count
+             << ",\"largest_free_block\":" << stats.largest_free_block << ",";
+    assert(json.find(expected.str()) != std::string::npos);
+    assert(json.find("\"external_fragmentation\":") != std::string::npos);
+    assert(json.find("\"free_block_histogram\":[{\"min_size\":") != std::string::npos);
+    
+    // A parked free is exported as such, and exporting doesn't sweep it
+    heap.set_deferred_coalescing(true);
+    heap.free(a);
+    size_t parked_pending = heap.get_stats().pending_free_memory;
+    assert(parked_pending > 0);
+    std::ostringstream parked_out;
+    heap.export_json(parked_out);
+    assert(count_occurrences(parked_out.str(), ",\"d\"]") == 1);
+    assert(count_occurrences(parked_out.str(), ",\"u\"]") == 1);
+    assert(heap.get_stats().pending_free_memory == parked_pending);
+    heap.set_deferred_coalescing(false);
+    
+    heap.free(c);
+    heap.free(slot);
+    
+    // The default heap exports the same way (and the stream's format flags survive)
+    std::ostringstream default_out;
+    default_out << std::hex;
+    export_heap_json(default_out);
+    assert(default_out.flags() & std::ios::hex);
+    assert(default_out.str().find("\"arenas\":[{\"index\":0") != std::string::npos);
+    
+    // So is a free queued by a thread of another arena, which stays queued
+    init_allocator(ENGINE_SEGREGATED_FIT, 2);
+    void* queued = my_malloc(3000);
+    std::thread other([queued]() {
+        void* own = my_malloc(16);  // This thread gets the other arena
+        assert(get_arena_index(own) != get_arena_index(queued));
+        my_free(queued);
+        my_free(own);
+    });
+    other.join();
+    size_t queued_pending = get_heap_stats().pending_free_memory;
+    assert(queued_pending >= 3000);
+    std::ostringstream queued_out;
+    export_heap_json(queued_out);
+    assert(count_occurrences(queued_out.str(), ",\"r\"]") == 1);
+    assert(get_heap_stats().pending_free_memory == queued_pending);
+    init_allocator();
+    
+    std::cout << "Exported " << json.size() << " bytes of JSON for a heap with "
+              << stats.free_block_count << " free blocks\n";
+}
+
+// Live samples and live bytes from the first line of a heap profile
+static void read_profile_totals(const std::string& profile, unsigned long& samples, unsigned long& bytes) {
+    samples = bytes = 0;
+    assert(std::sscanf(profile.c_str(), "heap profile: %lu: %lu", &samples, &bytes) == 2);
+}
+
+// Test 27: Sampling heap profiler
+void test_heap_profile() {
+    std::cout << "\n>>> Test 27: Heap Profile\n";
+    
+    init_allocator();
+    std::ostringstream empty;
+    my_free(my_malloc(1000));
+    write_heap_profile(empty);
+    assert(empty.str().find("heap profile: 0: 0 [0: 0] @ heap_v2/0\n") == 0);
+    
+    // A mean of one byte samples every allocation
+    set_heap_sampling(1);
+    void* blocks[10];
+    for (size_t i = 0; i < 10; i++) {
+        blocks[i] = my_malloc(100);
+    }
+    std::ostringstream out;
+    write_heap_profile(out);
+    std::string profile = out.str();
+    assert(profile.find("heap profile: 10: 1000 [10: 1000] @ heap_v2/1\n") == 0);
+    assert(profile.find("\n10: 1000 [10: 1000] @ 0x") != std::string::npos);  // All from one call stack
+#if defined(__linux__)
+    assert(profile.find("\nMAPPED_LIBRARIES:\n") != std::string::npos);
+#endif
+    
+    // Frees of every kind drop the samples; a moving realloc is sampled again
+    for (size_t i = 0; i < 4; i++) {
+        my_free(blocks[i]);
+    }
+    blocks[4] = my_realloc(blocks[4], 5000);
+    void* aligned = my_aligned_alloc(256, 300);
+    assert(reinterpret_cast<uintptr_t>(aligned) % 256 == 0);
+    my_free_batch(blocks + 5, 5);
+    
+    std::ostringstream after;
+    write_heap_profile(after);
+    assert(after.str().find("heap profile: 2: 5300 [12: 6300] @ heap_v2/1\n") == 0);
+    my_free(blocks[4]);
+    my_free(aligned);
+    
+    // Blocks allocated once sampling is off aren't sampled; the sampled ones still drop
+    // their samples when freed
+    for (size_t i = 0; i < 10; i++) {
+        blocks[i] = my_malloc(100);
+    }
+    set_heap_sampling(0);
+    void* unsampled = my_malloc(100);
+    for (size_t i = 0; i < 10; i++) {
+        my_free(blocks[i]);
+    }
+    my_free(unsampled);
+    std::ostringstream freed;
+    write_heap_profile(freed);
+    assert(freed.str().find("heap profile: 0: 0 [22: 7300] @ heap_v2/0\n") == 0);
+    
+    // A block resized in place keeps its sample, which follows its new size
+    // (sampling is turned off first, or growing would move it to a new sampled block)
+    set_heap_sampling(1);
+    void* resized = my_malloc(3000);
+    set_heap_sampling(0);
+    unsigned long resized_samples;
+    unsigned long resized_bytes;
+    const size_t resized_sizes[] = {500, 3000};  // Shrunk, then grown back over the split-off tail
+    for (size_t i = 0; i < 2; i++) {
+        assert(my_realloc(resized, resized_sizes[i]) == resized);
+        std::ostringstream in_place;
+        write_heap_profile(in_place);
+        read_profile_totals(in_place.str(), resized_samples, resized_bytes);
+        assert(resized_samples == 1 && resized_bytes == resized_sizes[i]);
+    }
+    my_free(resized);
+    std::ostringstream resized_freed;
+    write_heap_profile(resized_freed);
+    read_profile_totals(resized_freed.str(), resized_samples, resized_bytes);
+    assert(resized_samples == 0 && resized_bytes == 0);
+    
+    // With a 4 KB mean, 1 MB of allocations takes about 256 samples
+    init_allocator();
+    set_heap_sampling(4096);
+    std::vector<void*> live;
+    for (size_t i = 0; i < 2048; i++) {
+        live.push_back(my_malloc(512));
+    }
+    std::ostringstream sampled;
+    write_heap_profile(sampled);
+    unsigned long samples;
+    unsigned long bytes;
+    read_profile_totals(sampled.str(), samples, bytes);
+    assert(samples > 150 && samples < 400);
+    assert(bytes == samples * 512);
+    for (size_t i = 0; i < live.size(); i++) {
+        my_free(live[i]);
+    }
+    
+    set_heap_sampling(0);
+    std::cout << "Sampled " << samples << " of 2048 512-byte allocations with a 4096-byte mean\n";
+    init_allocator();
+}
+
+// Test 28: Best-fit engine
+void test_best_fit_engine() {
+    std::cout << "\n>>> Test 28: Best-Fit Engine\n";
+    
+    std::vector<char> buffer(REGION_SIZE);
+    Heap heap(buffer.data(), buffer.size(), ENGINE_BEST_FIT);
+    size_t heap_free = heap.get_free_memory();
+    
+    // Holes of 3000, 2000, 2000 and 2500 bytes, kept apart by live guards
+    size_t hole_sizes[4] = {3000, 2000, 2000, 2500};
+    void* holes[4];
+    void* guards[4];
+    for (int i = 0; i < 4; i++) {
+        holes[i] = heap.malloc(hole_sizes[i]);
+        guards[i] = heap.malloc(600);
+        assert(holes[i] && guards[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        heap.free(holes[i]);
+    }
+    
+    // Each request takes the smallest hole it fits in, the lower address among equal ones
+    void* first = heap.malloc(1900);
+    void* second = heap.malloc(1900);
+    void* third = heap.malloc(2400);
+    assert(first == holes[1]);
+    assert(second == holes[2]);
+    assert(third == holes[3]);
+    assert(heap.malloc(2900) == holes[0]);
+    
+    std::ostringstream out;
+    heap.export_json(out);
+    assert(out.str().find("\"engine\":\"best_fit\"") != std::string::npos);
+    
+    // Random sizes: contents survive, and the running statistics match the trees
+    std::vector<void*> live;
+    std::vector<size_t> sizes;
+    uint32_t seed = 12345;
+    for (int round = 0; round < 4000; round++) {
+        seed = seed * 1103515245 + 12345;
+        if (live.empty() || (seed >> 16) % 3 != 0) {
+            size_t size = 300 + (seed >> 8) % 4000;
+            void* ptr = heap.malloc(size);
+            if (ptr) {
+                std::memset(ptr, static_cast<int>(size & 0xFF), size);
+                live.push_back(ptr);
+                sizes.push_back(size);
+            }
+        } else {
+            size_t victim = (seed >> 4) % live.size();
+            unsigned char* bytes = static_cast<unsigned char*>(live[victim]);
+            unsigned char fill = static_cast<unsigned char>(sizes[victim] & 0xFF);
+            assert(bytes[0] == fill && bytes[sizes[victim] - 1] == fill);
+            heap.free(live[victim]);
+            live[victim] = live.back();
+            sizes[victim] = sizes.back();
+            live.pop_back();
+            sizes.pop_back();
+        }
+    }
+    HeapStats stats = heap.get_stats();
+    assert(stats.free_block_count == heap.get_fragmentation_count());
+    assert(stats.largest_free_block <= stats.free_memory);
+    
+    for (size_t i = 0; i < live.size(); i++) {
+        heap.free(live[i]);
+    }
+    heap.free(first);
+    heap.free(second);
+    heap.free(third);
+    heap.free(holes[0]);
+    for (int i = 0; i < 4; i++) {
+        heap.free(guards[i]);
+    }
+    
+    // Everything coalesces back into one block
+    assert(heap.get_fragmentation_count() == 1);
+    assert(heap.get_free_memory() == heap_free);
+    std::cout << "Best fit picked the smallest holes and coalesced back into one block\n";
+    
+    // The default heap with the thread cache and slabs in front of it
+    init_allocator(ENGINE_BEST_FIT);
+    void* blocks[64];
+    for (int i = 0; i < 64; i++) {
+        blocks[i] = my_malloc(16 + i * 131);
+        assert(blocks[i] != nullptr);
+    }
+    for (int i = 0; i < 64; i++) {
+        my_free(blocks[i]);
+    }
+    flush_thread_cache();
+    print_heap_state();
+    init_allocator();
+}
+
+// Test 29: Deferred coalescing
+void test_deferred_coalescing() {
+    std::cout << "\n>>> Test 29: Deferred Coalescing\n";
+    
+    // Best fit makes the sweeps visible: a merged run is a smaller fit than the rest of the region
+    std::vector<char> buffer(REGION_SIZE);
+    Heap heap(buffer.data(), buffer.size(), ENGINE_BEST_FIT);
+    size_t heap_free = heap.get_free_memory();
+    heap.set_deferred_coalescing(true);
+    
+    const int count = 128;
+    void* blocks[count];
+    for (int i = 0; i < count; i++) {
+        blocks[i] = heap.malloc(1000);
+        assert(blocks[i] != nullptr);
+    }
+    void* guard = heap.malloc(1000);
+    size_t stride = static_cast<char*>(blocks[1]) - static_cast<char*>(blocks[0]);
+    size_t overhead = stride - heap.usable_size(blocks[0]);
+    
+    // Neighbours freed one after the other stay apart, and come back last in, first out
+    heap.free(blocks[10]);
+    heap.free(blocks[11]);
+    assert(heap.malloc(1000) == blocks[11]);
+    assert(heap.malloc(1000) == blocks[10]);
+    
+    // A parked block is caught when it is freed again
+    heap.free(blocks[12]);
+    heap.free(blocks[12]);
+    assert(heap.malloc(1000) == blocks[12]);
+    
+    // Reading statistics leaves parked blocks alone: they are pending, neither used nor free
+    size_t used = heap.get_used_memory();
+    for (int i = 20; i < 30; i++) {
+        heap.free(blocks[i]);
+    }
+    HeapStats stats = heap.get_stats();
+    assert(stats.free_block_count == 1);
+    assert(stats.pending_free_memory == 10 * (stride - overhead));
+    assert(stats.used_memory == used - stats.pending_free_memory);
+    assert(heap.get_fragmentation_count() == 1);
+    
+    // A sweep merges the ten neighbours into one free block next to the rest of the region
+    heap.set_deferred_coalescing(false);
+    heap.set_deferred_coalescing(true);
+    assert(heap.get_fragmentation_count() == 2);
+    assert(heap.get_stats().pending_free_memory == 0);
+    assert(heap.malloc(10 * stride - overhead) == blocks[20]);
+    
+    // Parking more than QUICK_LIST_MAX_BYTES sweeps on its own
+    for (int i = 40; i < count; i++) {
+        heap.free(blocks[i]);
+    }
+    assert(heap.malloc(20000) == blocks[40]);
+    
+    // Turning deferral off sweeps what is left
+    heap.set_deferred_coalescing(false);
+    heap.free(blocks[40]);
+    heap.free(blocks[20]);
+    heap.free(guard);
+    for (int i = 0; i < 20; i++) {
+        heap.free(blocks[i]);
+    }
+    for (int i = 30; i < 40; i++) {
+        heap.free(blocks[i]);
+    }
+    assert(heap.get_fragmentation_count() == 1);
+    assert(heap.get_free_memory() == heap_free);
+    std::cout << "Parked blocks were reused by size and swept back into one block\n";
+    
+    // The default heap: blocks flushed from the thread cache are parked too
+    init_allocator();
+    set_deferred_coalescing(true);
+    assert(get_deferred_coalescing());
+    size_t default_free = get_free_memory();
+    std::vector<void*> live;
+    for (int round = 0; round < 8; round++) {
+        for (int i = 0; i < 64; i++) {
+            live.push_back(my_malloc(300 + (i % 8) * 90));
+        }
+        for (size_t i = 0; i < live.size(); i++) {
+            my_free(live[i]);
+        }
+        live.clear();
+    }
+    flush_thread_cache();
+    set_deferred_coalescing(false);
+    assert(get_fragmentation_count() == 1);
+    assert(get_free_memory() == default_free);
+    init_allocator();
+}
+
+#if defined(ALLOCATOR_HARDENED) && !defined(_WIN32)
+// Run a corruption in a child process and report how the child ended
+// (the heap aborts on what it finds, which would take the tests down with it)
+static int run_corrupted(void (*corrupt)()) {
+    std::cout.flush();
+    pid_t child = fork();
+    if (child == 0) {
+        std::freopen("/dev/null", "w", stderr);
+        corrupt();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    return status;
+}
+
+// An overflow of one block runs into the header of the block after it
+static void overflow_into_header() {
+    static char buffer[64 * 1024];
+    Heap heap(buffer, sizeof(buffer));
+    char* a = static_cast<char*>(heap.malloc(2000));
+    void* b = heap.malloc(2000);
+    std::memset(a, 'A', static_cast<char*>(b) - a);
+    heap.free(b);
+}
+
+// A write to a freed block replaces its free list link with an address of the attacker's choosing
+static void overwrite_free_link() {
+    static char buffer[64 * 1024];
+    static char target[64];
+    Heap heap(buffer, sizeof(buffer));
+    
+    // An aligned address decodes to a misaligned one unless bits 12-14 of the link's
+    // own address are zero (then the check is the neighbours', below)
+    void* a = heap.malloc(2000);
+    while (((reinterpret_cast<uintptr_t>(a) >> 12) & 7) == 0) {
+        a = heap.malloc(2000);
+    }
+    void* guard = heap.malloc(2000);
+    heap.free(a);
+    *static_cast<char**>(a) = target;
+    heap.free(guard);  // Merging with a takes it off its list
+}
+#endif
+
+// Test 30: Hardened build
+void test_hardening() {
+    std::cout << "\n>>> Test 30: Hardened Build\n";
+    
+#if defined(ALLOCATOR_HARDENED) && !defined(_WIN32)
+    int status = run_corrupted(overflow_into_header);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    std::cout << "An overwritten block header was caught by its checksum\n";
+    
+    status = run_corrupted(overwrite_free_link);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    std::cout << "An overwritten free list link was caught before it was followed\n";
+    
+    // Intact blocks pass every check
+    static char buffer[64 * 1024];
+    Heap heap(buffer, sizeof(buffer));
+    size_t heap_free = heap.get_free_memory();
+    std::vector<void*> blocks;
+    for (int i = 0; i < 12; i++) {
+        blocks.push_back(heap.malloc(SLAB_MAX_SIZE + 100 + i * 150));
+    }
+    for (size_t i = 0; i < blocks.size(); i += 2) {
+        heap.free(blocks[i]);
+    }
+    for (size_t i = 1; i < blocks.size(); i += 2) {
+        blocks[i] = heap.realloc(blocks[i], 3000);
+        assert(blocks[i] != nullptr);
+        heap.free(blocks[i]);
+    }
+    assert(heap.get_free_memory() == heap_free);
+#else
+    std::cout << "Skipped (build with -DALLOCATOR_HARDENED)\n";
+#endif
+}
+
+// A single-threaded heap that rounds requests to a few sizes and hands out cache lines
+struct ParserHeapConfig : DefaultHeapConfig {
+    static const size_t alignment = 64;
+    typedef SizeClassTable<32, 64, 128, 256, 512, 1024> size_classes;
+    static const AllocatorEngine fit = ENGINE_BEST_FIT;
+    typedef NoLock locking;
+    typedef NoStats stats;
+};
+
+// A heap shared by several threads, each working in its own arena
+struct SharedHeapConfig : DefaultHeapConfig {
+    static const AllocatorEngine fit = ENGINE_TLSF;
+    typedef SpinLock locking;
+    static const size_t arena_count = 4;
+};
+
+// Whether a heap type offers get_stats()
+template <typename T>
+struct HasGetStats {
+    template <typename U>
+    static char test(decltype(std::declval<U&>().get_stats())*);
+    template <typename U>
+    static long test(...);
+    
+    static const bool value = sizeof(test<T>(nullptr)) == 1;
+};
+
+// The policies that compile to nothing hold nothing, and a heap without statistics
+// has no get_stats() to call
+static_assert(std::is_empty<NoLock>::value && std::is_empty<NoStats>::value && std::is_empty<Stats>::value,
+              "NoLock and the statistics policies must hold no state");
+static_assert(!HasGetStats<BasicHeap<ParserHeapConfig> >::value, "a NoStats heap must not offer get_stats()");
+static_assert(HasGetStats<BasicHeap<SharedHeapConfig> >::value, "a Stats heap must offer get_stats()");
+static_assert(std::is_same<BasicHeap<ParserHeapConfig>::Engine, HeapEngine<NoLock, NoStats> >::value,
+              "a BasicHeap calls the engine compiled for its policies");
+
+// Test 31: Compile-time heap configurations
+void test_basic_heap() {
+    std::cout << "\n>>> Test 31: Compile-Time Heap Configuration\n";
+    
+    typedef SizeClassTable<32, 64> TwoClasses;
+    assert(TwoClasses::round_up(1) == 32);
+    assert(TwoClasses::round_up(33) == 64);
+    assert(TwoClasses::round_up(65) == 65);
+    
+    std::vector<char> parser_memory(2 * REGION_SIZE);
+    std::vector<char> shared_memory(8 * REGION_SIZE);
+    BasicHeap<ParserHeapConfig> parser_heap(parser_memory.data(), parser_memory.size());
+    BasicHeap<SharedHeapConfig> shared_heap(shared_memory.data(), shared_memory.size());
+    assert(parser_heap.get_heap().get_arena_count() == 1);
+    assert(shared_heap.get_heap().get_arena_count() == 4);
+    
+    // Requests are rounded to the table and start on a cache line
+    size_t parser_free = parser_heap.get_heap().get_free_memory();
+    assert(parser_heap.malloc(0) == nullptr);
+    char* text = static_cast<char*>(parser_heap.malloc(100));
+    assert(reinterpret_cast<uintptr_t>(text) % 64 == 0);
+    assert(parser_heap.usable_size(text) >= 128);
+    std::strcpy(text, "tokens");
+    
+    // Growing moves the block to a new cache line and keeps its contents
+    void* blocker = parser_heap.malloc(1000);
+    text = static_cast<char*>(parser_heap.realloc(text, 5000));
+    assert(text && reinterpret_cast<uintptr_t>(text) % 64 == 0);
+    assert(std::strcmp(text, "tokens") == 0);
+    assert(parser_heap.realloc(text, 100) == text);  // Shrinking stays in place
+    parser_heap.free(text);
+    parser_heap.free(blocker);
+    assert(parser_heap.get_heap().get_free_memory() == parser_free);
+    
+    // Built without statistics, the heap counts no calls (and parser_heap.get_stats() wouldn't compile)
+    HeapStats parser_stats = parser_heap.get_heap().get_stats();
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        assert(parser_stats.malloc_counts[i] == 0 && parser_stats.free_counts[i] == 0);
+    }
+    std::cout << "Single-threaded heap: 64-byte aligned blocks rounded to its size classes\n";
+    
+    // Four threads share the other heap, next to the single-threaded one
+    const int thread_count = 4;
+    const int rounds = 2000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.push_back(std::thread([&shared_heap, t]() {
+            void* blocks[16];
+            for (int round = 0; round < rounds; round++) {
+                for (int i = 0; i < 16; i++) {
+                    blocks[i] = shared_heap.malloc(300 + (i + t) * 40);
+                    assert(blocks[i] != nullptr);
+                }
+                for (int i = 0; i < 16; i++) {
+                    shared_heap.free(blocks[i]);
+                }
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    
+    HeapStats shared_stats = shared_heap.get_stats();
+    uint64_t mallocs = 0;
+    uint64_t frees = 0;
+    for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+        mallocs += shared_stats.malloc_counts[i];
+        frees += shared_stats.free_counts[i];
+    }
+    assert(mallocs == static_cast<uint64_t>(thread_count) * rounds * 16);
+    assert(frees == mallocs);
+    assert(shared_stats.used_memory == 0);
+    std::cout << "Spin-locked arena heap: " << mallocs << " mallocs from " << thread_count << " threads, all counted\n";
+}
+
+// Test 32: NUMA-aware arenas
+void test_numa_arenas() {
+    std::cout << "\n>>> Test 32: NUMA-Aware Arenas\n";
+    
+    init_allocator(ENGINE_SEGREGATED_FIT, MAX_ARENAS);
+    size_t nodes = get_numa_node_count();
+    assert(nodes >= 1 && nodes <= get_arena_count());
+    // Arena i is on the (i % nodes)th online node, and node ids may have gaps
+    for (size_t i = 0; i < get_arena_count(); i++) {
+        assert(get_arena_numa_node(i) == get_arena_numa_node(i % nodes));
+        for (size_t j = 0; j < i && i < nodes; j++) {
+            assert(get_arena_numa_node(i) != get_arena_numa_node(j));
+        }
+    }
+    std::cout << get_arena_count() << " arenas spread over " << nodes << " NUMA node(s)\n";
+    
+    // Blocks freed by other threads (maybe on other nodes) find their way back to their arenas
+    size_t used_before = get_used_memory();
+    const int num_threads = 4;
+    const int per_thread = 64;
+    std::vector<void*> blocks(num_threads * per_thread);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&blocks, t]() {
+            for (int i = 0; i < per_thread; i++) {
+                blocks[t * per_thread + i] = my_malloc(i % 2 ? SLAB_MAX_SIZE + 100 : 5000);
+            }
+            // The thread's arenas are on one node (unless one ran out of memory)
+            for (int i = 1; i < per_thread; i++) {
+                assert(get_arena_numa_node(get_arena_index(blocks[t * per_thread + i])) ==
+                       get_arena_numa_node(get_arena_index(blocks[t * per_thread])));
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    for (size_t i = 0; i < blocks.size(); i++) {
+        my_free(blocks[i]);
+    }
+    flush_thread_cache();
+    assert(get_used_memory() == used_before);
+    std::cout << blocks.size() << " blocks allocated on " << num_threads << " threads and freed on another\n";
+    
+    init_allocator();
+}
+
+#if defined(__linux__)
+// Bytes of the process that are backed by physical memory
+static size_t resident_bytes() {
+    std::FILE* file = std::fopen("/proc/self/statm", "r");
+    unsigned long pages = 0, resident = 0;
+    if (file) {
+        if (std::fscanf(file, "%lu %lu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        std::fclose(file);
+    }
+    return resident * 4096;
+}
+#endif
+
+// Whether every byte of a block is zero (every 512th byte in the middle, for speed)
+static bool looks_zeroed(const unsigned char* data, size_t size) {
+    for (size_t i = 0; i < size; i += (i < 64 || i + 64 >= size) ? 1 : 512) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Test 33: Zeroed allocation
+void test_calloc() {
+    std::cout << "\n>>> Test 33: Zeroed Allocation\n";
+    init_allocator();
+    
+    assert(my_calloc(SIZE_MAX / 2, 4) == nullptr);  // count * size overflows
+    assert(my_calloc(0, 100) == nullptr);
+    
+    // A block carved out of a fresh region is zero without being cleared
+    const size_t big = 32 * 1024 * 1024;
+#if defined(__linux__)
+    size_t resident_before = resident_bytes();
+#endif
+    unsigned char* fresh = static_cast<unsigned char*>(my_calloc(big / 64, 64));
+    assert(fresh != nullptr);
+#if defined(__linux__)
+    // None of its pages were written, so almost none of them are backed yet
+    size_t faulted_in = resident_bytes() - resident_before;
+    assert(faulted_in < big / 4);
+    std::cout << "Fresh " << big / (1024 * 1024) << " MB block: " << faulted_in / 1024 << " KB faulted in\n";
+#endif
+    assert(looks_zeroed(fresh, big));
+    
+    // Once written and freed, the memory is cleared when it is handed out again
+    std::memset(fresh, 0xab, big);
+    my_free(fresh);
+    unsigned char* reused = static_cast<unsigned char*>(my_calloc(1, big));
+    assert(reused != nullptr && looks_zeroed(reused, big));
+    my_free(reused);
+    
+    // Thread cache, slab and general blocks that held data
+    size_t sizes[] = {24, 200, 1000, 3000};
+    for (size_t i = 0; i < 4; i++) {
+        void* dirty = my_malloc(sizes[i]);
+        std::memset(dirty, 0xcd, sizes[i]);
+        my_free(dirty);
+        flush_thread_cache();
+        unsigned char* zeroed = static_cast<unsigned char*>(my_calloc(sizes[i], 1));
+        assert(zeroed != nullptr && looks_zeroed(zeroed, sizes[i]));
+        my_free(zeroed);
+    }
+    
+    // The other engines keep different links in free blocks
+    AllocatorEngine engines[] = {ENGINE_TLSF, ENGINE_BEST_FIT};
+    for (size_t e = 0; e < 2; e++) {
+        init_allocator(engines[e]);
+        void* first = my_malloc(5000);  // Leaves a split remainder behind
+        unsigned char* block = static_cast<unsigned char*>(my_calloc(1, 100000));
+        assert(block != nullptr && looks_zeroed(block, 100000));
+        std::memset(block, 0xef, 100000);
+        my_free(block);
+        block = static_cast<unsigned char*>(my_calloc(1, 100000));
+        assert(block != nullptr && looks_zeroed(block, 100000));
+        my_free(block);
+        my_free(first);
+    }
+    std::cout << "my_calloc returned zeroed memory for fresh and reused blocks with every engine\n";
+    
+    init_allocator();
+}
@@ -0,0 +1,289 @@
+// Optional drop-in replacement for the global allocation functions
+//
+// Linking this file into a program routes every new/delete (including the
+// nothrow, sized and aligned forms) through the free-list allocator.
+// Built with -DALLOCATOR_PRELOAD as a shared library it also exports
+// malloc/free/calloc/realloc/posix_memalign, so it can be injected into an
+// existing binary on Linux:
+//
+//   g++ -std=c++11 -O2 -pthread -fPIC -shared -DALLOCATOR_ALIGNMENT=16
+//       -DALLOCATOR_PRELOAD -o liballocator.so allocator.cpp malloc_override.cpp
+//   LD_PRELOAD=./liballocator.so ./your_program
+//
+// The heap sets itself up on the first allocation; a program using this file must
+// not call init_allocator() itself (that would throw away every live object).
+// With ALLOCATOR_TRACE=<file> set, every allocation is recorded for replay.cpp until
+// the trace is stopped at exit; calls made once a thread's trace buffer is destroyed
+// (from late thread_local destructors or atexit handlers) are written one by one. With
+// ALLOCATOR_HEAP_PROFILE=<file> set, allocations are sampled every
+// HEAP_SAMPLE_INTERVAL bytes on average and a heap profile is written at exit.
+
+#include "allocator.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <new>
+
+// new and malloc must return memory aligned for any type
+static_assert(ALIGN_SIZE >= alignof(std::max_align_t),
+              "malloc_override.cpp needs -DALLOCATOR_ALIGNMENT=16 (or the platform's max_align_t alignment)");
+
+static std::atomic<bool> options_checked(false);
+static const char* heap_profile_path = nullptr;
+
+static void stop_trace_at_exit() {
+    stop_trace();
+}
+
+static void write_heap_profile_at_exit() {
+    std::ofstream out(heap_profile_path);
+    if (out) {
+        write_heap_profile(out);
+    }
+}
+
+// Read the environment options on the first allocation (from any thread)
+static void ensure_initialized() {
+    // Opening the trace file allocates, and those nested calls must see options_checked already set
+    if (!options_checked.load(std::memory_order_acquire) && !options_checked.exchange(true)) {
+        const char* path = std::getenv("ALLOCATOR_TRACE");
+        if (path && start_trace(path)) {
+            std::atexit(stop_trace_at_exit);
+        }
+        
+        heap_profile_path = std::getenv("ALLOCATOR_HEAP_PROFILE");
+        if (heap_profile_path) {
+            set_heap_sampling(HEAP_SAMPLE_INTERVAL);
+            std::atexit(write_heap_profile_at_exit);
+        }
+    }
+}
+
+// Allocate like malloc: a zero-byte request still gets a unique pointer
+static void* heap_malloc(size_t size) {
+    ensure_initialized();
+    return my_malloc(size ? size : 1);
+}
+
+static void* heap_aligned_alloc(size_t alignment, size_t size) {
+    ensure_initialized();
+    return my_aligned_alloc(alignment, size ? size : 1);
+}
+
+// Free like free: pointers the heap doesn't know (e.g. allocated by the dynamic
+// loader before this library was loaded) are ignored instead of reported
+static void heap_free(void* ptr) {
+    if (my_malloc_usable_size(ptr) != 0) {
+        my_free(ptr);
+    }
+}
+
+// Keep calling the new_handler until memory turns up, as operator new must
+static void* new_or_throw(size_t size, size_t alignment) {
+    for (;;) {
+        void* ptr = alignment ? heap_aligned_alloc(alignment, size) : heap_malloc(size);
+        if (ptr) {
+            return ptr;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void* new_or_null(size_t size, size_t alignment) {
+    try {
+        return new_or_throw(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+// Plain and array forms
+
+void* operator new(std::size_t size) {
+    return new_or_throw(size, 0);
+}
+
+void* operator new[](std::size_t size) {
+    return new_or_throw(size, 0);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return new_or_null(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return new_or_null(size, 0);
+}
+
+void operator delete(void* ptr) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    heap_free(ptr);
+}
+
+// Sized forms (C++14); the block header already knows the size
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* ptr, std::size_t) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    heap_free(ptr);
+}
+#endif
+
+// Over-aligned forms (C++17)
+
+#if defined(__cpp_aligned_new)
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return new_or_throw(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return new_or_throw(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_or_null(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return new_or_null(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    heap_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    heap_free(ptr);
+}
+#endif
+
+// C allocation functions for LD_PRELOAD
+
+#if defined(ALLOCATOR_PRELOAD)
+static bool is_power_of_two(size_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Like heap_malloc, zeroed
+static void* heap_calloc(size_t count, size_t size) {
+    ensure_initialized();
+    return count && size ? my_calloc(count, size) : my_calloc(1, 1);
+}
+
+extern "C" {
+
+void* malloc(size_t size) noexcept {
+    void* ptr = heap_malloc(size);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void* ptr) noexcept {
+    heap_free(ptr);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    // Fresh memory from the OS is zero already: my_calloc only clears reused blocks
+    void* ptr = heap_calloc(count, size);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    if (!ptr) {
+        return malloc(size);
+    }
+    if (my_malloc_usable_size(ptr) == 0) {
+        errno = ENOMEM;  // Not ours: we can't know how much to copy
+        return nullptr;
+    }
+
+    void* new_ptr = my_realloc(ptr, size);
+    if (!new_ptr && size != 0) {
+        errno = ENOMEM;
+    }
+    return new_ptr;
+}
+
+int posix_memalign(void** out, size_t alignment, size_t size) noexcept {
+    if (!is_power_of_two(alignment) || alignment % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+
+    void* ptr = heap_aligned_alloc(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept {
+    if (!is_power_of_two(alignment)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    void* ptr = heap_aligned_alloc(alignment, size);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* memalign(size_t alignment, size_t size) noexcept {
+    return aligned_alloc(alignment, size);
+}
+
+size_t malloc_usable_size(void* ptr) noexcept {
+    return my_malloc_usable_size(ptr);
+}
+
+}  // extern "C"
+#endif
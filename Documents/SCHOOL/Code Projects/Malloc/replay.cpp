@@ -0,0 +1,221 @@
+// Replays an allocation trace recorded with start_trace() against the allocator
+// The events are merged by timestamp and replayed on one thread, so the same trace
+// and engine always produce the same sequence of calls and the same heap layout
+//
+// Usage: replay <trace file> [segregated|tlsf|bestfit]
+
+#include "allocator.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static bool timestamp_less(const TraceEvent& a, const TraceEvent& b) {
+    return a.timestamp < b.timestamp;
+}
+
+// Read every event of a trace file
+static bool load_trace(const char* path, std::vector<TraceEvent>& events) {
+    std::FILE* file = std::fopen(path, "rb");
+    if (!file) {
+        std::cerr << "ERROR: Could not open trace file " << path << "\n";
+        return false;
+    }
+
+    char magic[TRACE_MAGIC_SIZE];
+    if (std::fread(magic, 1, TRACE_MAGIC_SIZE, file) != TRACE_MAGIC_SIZE ||
+        std::memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+        std::cerr << "ERROR: " << path << " is not an allocation trace\n";
+        std::fclose(file);
+        return false;
+    }
+
+    TraceEvent chunk[1024];
+    size_t read;
+    while ((read = std::fread(chunk, sizeof(TraceEvent), 1024, file)) > 0) {
+        events.insert(events.end(), chunk, chunk + read);
+    }
+    std::fclose(file);
+
+    // Each thread's events are already in order; stable_sort keeps it that way for equal timestamps
+    std::stable_sort(events.begin(), events.end(), timestamp_less);
+    return true;
+}
+
+// What happened during a replay
+struct ReplayStats {
+    size_t calls[4];            // Replayed events per TraceOp
+    size_t failed;              // Allocations that failed when recorded (not replayed)
+    size_t unmatched;           // Frees of blocks allocated before the trace started
+    size_t reordered;           // Blocks handed out again by an event that overtook their free
+    size_t live_bytes;
+    size_t peak_live_bytes;     // Most bytes requested and not yet freed at one time
+    size_t peak_heap_size;
+    size_t size_histogram[33];  // Requests per power of two (bucket i: sizes in [2^(i-1), 2^i))
+};
+
+// Blocks allocated by the replay, by the address they had when recorded
+struct LiveBlock {
+    void* ptr;
+    size_t size;
+};
+
+typedef std::unordered_map<uint64_t, LiveBlock> LiveMap;
+
+static size_t size_bucket(uint32_t size) {
+    size_t bucket = 0;
+    while (bucket < 32 && (static_cast<uint64_t>(1) << bucket) <= size) {
+        bucket++;
+    }
+    return bucket;
+}
+
+static void release(LiveMap& live, LiveMap::iterator it, ReplayStats& stats) {
+    my_free(it->second.ptr);
+    stats.live_bytes -= it->second.size;
+    live.erase(it);
+}
+
+// Remember a block allocated for a recorded address
+static void add_block(LiveMap& live, std::unordered_map<uint64_t, size_t>& early_frees,
+                      const TraceEvent& event, void* ptr, ReplayStats& stats) {
+    if (!ptr) {
+        std::cerr << "ERROR: Replay ran out of memory\n";
+        return;
+    }
+
+    // The address is still live: its free came a few nanoseconds later on another thread
+    LiveMap::iterator it = live.find(event.ptr);
+    if (it != live.end()) {
+        release(live, it, stats);
+        early_frees[event.ptr]++;
+        stats.reordered++;
+    }
+
+    LiveBlock block = {ptr, event.size};
+    live[event.ptr] = block;
+    stats.live_bytes += event.size;
+    stats.peak_live_bytes = std::max(stats.peak_live_bytes, stats.live_bytes);
+    stats.peak_heap_size = std::max(stats.peak_heap_size, get_heap_size());
+    stats.size_histogram[size_bucket(event.size)]++;
+}
+
+// Whether a free was already done ahead of time by add_block
+static bool take_early_free(std::unordered_map<uint64_t, size_t>& early_frees, uint64_t address) {
+    std::unordered_map<uint64_t, size_t>::iterator it = early_frees.find(address);
+    if (it == early_frees.end()) {
+        return false;
+    }
+    if (--it->second == 0) {
+        early_frees.erase(it);
+    }
+    return true;
+}
+
+static void replay(const std::vector<TraceEvent>& events, ReplayStats& stats) {
+    LiveMap live;
+    std::unordered_map<uint64_t, size_t> early_frees;
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& event = events[i];
+        if (event.op == TRACE_FREE) {
+            LiveMap::iterator it = live.find(event.ptr);
+            if (it != live.end() && !take_early_free(early_frees, event.ptr)) {
+                release(live, it, stats);
+            } else if (it == live.end()) {
+                stats.unmatched++;
+                continue;
+            }
+        } else if (event.ptr == 0 && !(event.op == TRACE_REALLOC && event.size == 0)) {
+            stats.failed++;
+            continue;
+        } else if (event.op == TRACE_MALLOC) {
+            add_block(live, early_frees, event, my_malloc(event.size), stats);
+        } else if (event.op == TRACE_ALIGNED_ALLOC) {
+            add_block(live, early_frees, event, my_aligned_alloc(static_cast<size_t>(event.arg), event.size), stats);
+        } else if (event.op == TRACE_REALLOC) {
+            LiveMap::iterator it = live.find(event.arg);
+            if (event.arg != 0 && it == live.end()) {
+                // Block from before the trace: its contents (and old size) are unknown
+                stats.unmatched++;
+                add_block(live, early_frees, event, my_malloc(event.size), stats);
+            } else if (it == live.end()) {
+                add_block(live, early_frees, event, my_malloc(event.size), stats);
+            } else {
+                void* old_ptr = it->second.ptr;
+                stats.live_bytes -= it->second.size;
+                live.erase(it);
+                void* ptr = my_realloc(old_ptr, event.size);
+                if (event.size != 0) {
+                    add_block(live, early_frees, event, ptr, stats);
+                }
+            }
+        } else {
+            std::cerr << "ERROR: Unknown trace event " << static_cast<int>(event.op) << "\n";
+            continue;
+        }
+        stats.calls[event.op]++;
+    }
+
+    for (LiveMap::iterator it = live.begin(); it != live.end(); ++it) {
+        my_free(it->second.ptr);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: replay <trace file> [segregated|tlsf|bestfit]\n";
+        return 1;
+    }
+    AllocatorEngine engine = ENGINE_SEGREGATED_FIT;
+    if (argc > 2 && std::string(argv[2]) == "tlsf") {
+        engine = ENGINE_TLSF;
+    } else if (argc > 2 && std::string(argv[2]) == "bestfit") {
+        engine = ENGINE_BEST_FIT;
+    }
+
+    std::vector<TraceEvent> events;
+    if (!load_trace(argv[1], events)) {
+        return 1;
+    }
+
+    init_allocator(engine);
+    ReplayStats stats;
+    std::memset(&stats, 0, sizeof(stats));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    replay(events, stats);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Replayed " << events.size() << " events with the "
+              << (engine == ENGINE_TLSF ? "TLSF" : engine == ENGINE_BEST_FIT ? "best fit" : "segregated fit") << " engine\n";
+    std::cout << "  malloc: " << stats.calls[TRACE_MALLOC]
+              << "  aligned: " << stats.calls[TRACE_ALIGNED_ALLOC]
+              << "  realloc: " << stats.calls[TRACE_REALLOC]
+              << "  free: " << stats.calls[TRACE_FREE] << "\n";
+    std::cout << "  failed when recorded: " << stats.failed << "  unmatched: " << stats.unmatched
+              << "  reordered: " << stats.reordered << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Time: " << seconds * 1000 << " ms ("
+              << (events.empty() ? 0.0 : seconds * 1e9 / events.size()) << " ns per event)\n";
+    std::cout << "Peak live bytes: " << stats.peak_live_bytes << "\n";
+    std::cout << "Peak heap size: " << stats.peak_heap_size;
+    if (stats.peak_heap_size) {
+        std::cout << " (peak live bytes are " << 100.0 * stats.peak_live_bytes / stats.peak_heap_size << "% of it)";
+    }
+    std::cout << "\n\nRequest sizes:\n";
+    for (size_t i = 0; i < 33; i++) {
+        if (stats.size_histogram[i]) {
+            uint64_t low = i ? (static_cast<uint64_t>(1) << (i - 1)) : 0;
+            std::cout << "  " << std::setw(11) << low << " - " << std::setw(11) << ((static_cast<uint64_t>(1) << i) - 1)
+                      << ": " << stats.size_histogram[i] << "\n";
+        }
+    }
+
+    return 0;
+}